@@ -6,19 +6,79 @@ extern "C" {
 #include "sntp.h"
 }
 
+// Set when the configuration has been modified, but not written to flash yet
+static bool       config_dirty = false;
+static os_timer_t quiet_timer;
+static os_timer_t max_delay_timer;
+
+static void ICACHE_FLASH_ATTR clear_config_dirty()
+{
+    os_timer_disarm(&quiet_timer);
+    os_timer_disarm(&max_delay_timer);
+    config_dirty = false;
+}
+
+#ifdef UNIT_TEST
+namespace mock {
+    void destroy_config()
+    {
+        clear_config_dirty();
+    }
+}
+#endif
+
+// Settings written by older firmware, which kept the log in a circular buffer
+// covered by the checksum of the sector
+struct legacy_config_settings : public config_base {
+    zone_settings zones[num_zones];
+    uint32_t      last_watering;
+    uint16_t      start_time : 11;
+    bool          enabled : 1;
+    bool          moisture_enabled : 1;
+    uint16_t      last_log_idx;
+    uint16_t      moisture_threshold;
+};
+
+// Converts settings loaded from a sector written by older firmware.  The old
+// log is not converted, the new log starts after the sector.
+static void ICACHE_FLASH_ATTR convert_legacy_config(config* cfg)
+{
+    legacy_config_settings legacy;
+    os_memcpy(&legacy, cfg, sizeof(legacy));
+
+    os_memcpy(cfg->zones, legacy.zones, sizeof(cfg->zones));
+    cfg->last_watering      = legacy.last_watering;
+    cfg->start_time         = legacy.start_time;
+    cfg->enabled            = legacy.enabled;
+    cfg->moisture_enabled   = legacy.moisture_enabled;
+    cfg->moisture_threshold = legacy.moisture_threshold;
+
+    os_memset(reinterpret_cast<char*>(cfg) + sizeof(config_settings), 0xFF,
+              config_size - sizeof(config_settings));
+
+    // Marks the settings as converted, the sector is replaced on next save
+    cfg->size = sizeof(config_settings);
+
+    defer_save_config();
+}
+
 config* ICACHE_FLASH_ATTR get_config()
 {
     config* cfg = static_cast<config*>(load_config());
     if ( ! cfg)
         return cfg;
 
-    if (cfg->id != ~0u)
+    if (cfg->id != ~0u && cfg->magic == legacy_config_magic && ! cfg->size)
+        convert_legacy_config(cfg);
+
+    // Configuration which has never been saved is initialized, unless it
+    // has already been modified
+    if (cfg->id != ~0u || config_dirty)
         return cfg;
 
     cfg->last_watering      = 0;
     cfg->start_time         = 0;
     cfg->enabled            = false;
-    cfg->last_log_idx       = 0xFFFFu;
     cfg->moisture_threshold = 0xFFFFu;
 
     for (uint32_t i = 0; i < num_zones; i++) {
@@ -36,6 +96,106 @@ config* ICACHE_FLASH_ATTR get_config()
     return cfg;
 }
 
+// Writes a new sector with the configuration and an empty log.
+static bool ICACHE_FLASH_ATTR write_config(config* cfg)
+{
+    if (save_config(cfg, sizeof(config_settings)))
+        return false;
+
+    // Pending changes have been written together with the new sector
+    clear_config_dirty();
+
+    return true;
+}
+
+static void ICACHE_FLASH_ATTR flush_config_timer(void*)
+{
+    if (flush_config())
+        return;
+
+    // Try again later, e.g. if time is not available yet
+    os_timer_disarm(&max_delay_timer);
+    os_timer_setfn(&max_delay_timer, flush_config_timer, nullptr);
+    os_timer_arm(&max_delay_timer, config_max_delay_ms, false);
+}
+
+void ICACHE_FLASH_ATTR defer_save_config()
+{
+    os_timer_disarm(&quiet_timer);
+    os_timer_setfn(&quiet_timer, flush_config_timer, nullptr);
+    os_timer_arm(&quiet_timer, config_quiet_period_ms, false);
+
+    if (config_dirty)
+        return;
+
+    config_dirty = true;
+
+    os_timer_disarm(&max_delay_timer);
+    os_timer_setfn(&max_delay_timer, flush_config_timer, nullptr);
+    os_timer_arm(&max_delay_timer, config_max_delay_ms, false);
+}
+
+bool ICACHE_FLASH_ATTR flush_config()
+{
+    if ( ! config_dirty)
+        return true;
+
+    config* cfg = get_config();
+    if ( ! cfg)
+        return false;
+
+    // Nothing to do if the settings are the same as in flash, e.g. if they
+    // were changed back or saved again without a change
+    if ( ! is_config_modified(sizeof(config_settings))) {
+        clear_config_dirty();
+        return true;
+    }
+
+    return write_config(cfg);
+}
+
+constexpr unsigned max_log_records = sizeof(config::log) / sizeof(log_record);
+
+static uint32_t ICACHE_FLASH_ATTR calc_record_check(const log_entry& entry)
+{
+    uint32_t words[2];
+    os_memcpy(words, &entry, sizeof(words));
+
+    // Offset, so that a record with all bits cleared is not valid
+    return 0x10Cu - words[0] - words[1];
+}
+
+static bool ICACHE_FLASH_ATTR is_erased(const log_record& record)
+{
+    const uint32_t* const words = reinterpret_cast<const uint32_t*>(&record);
+
+    for (unsigned i = 0; i < sizeof(record) / sizeof(uint32_t); i++)
+        if (words[i] != ~0u)
+            return false;
+
+    return true;
+}
+
+static bool ICACHE_FLASH_ATTR is_valid(const log_record& record)
+{
+    return record.entry.timestamp != ~0u         &&
+           record.entry.event     >  LOG_ZERO    &&
+           record.entry.event     <  LOG_INVALID &&
+           record.check           == calc_record_check(record.entry);
+}
+
+// Returns the number of used record slots in a sector, including records
+// which are not valid, e.g. due to an interrupted write.
+static unsigned ICACHE_FLASH_ATTR get_num_records(const config* cfg)
+{
+    unsigned num = max_log_records;
+
+    while (num && is_erased(cfg->log[num - 1u]))
+        --num;
+
+    return num;
+}
+
 bool ICACHE_FLASH_ATTR log_event(log_code event, uint32_t data)
 {
     if (event <= LOG_ZERO || event >= LOG_INVALID)
@@ -49,30 +209,28 @@ bool ICACHE_FLASH_ATTR log_event(log_code event, uint32_t data)
     if ( ! timestamp)
         return false;
 
-    constexpr uint16_t max_log_entries = sizeof(cfg->log) / sizeof(cfg->log[0]);
+    log_record record;
+    record.entry.timestamp = timestamp;
+    record.entry.event     = event;
+    record.entry.data      = data;
+    record.check           = calc_record_check(record.entry);
 
-    if (cfg->id != ~0u) {
+    unsigned idx = get_num_records(cfg);
 
-        config* next = static_cast<config*>(load_config(1));
-        if ( ! next)
-            return false;
-
-        os_memcpy(cfg->log, next->log, sizeof(cfg->log));
+    // Write a new sector with empty log when the current one is full or
+    // when it has been written by older firmware
+    if (cfg->id == ~0u || cfg->magic == legacy_config_magic || idx >= max_log_records) {
 
-        cfg->last_log_idx = next->last_log_idx;
-    }
+        if ( ! write_config(cfg))
+            return false;
 
-    uint16_t idx = cfg->last_log_idx + 1u;
-    if (idx >= max_log_entries)
         idx = 0;
-    cfg->last_log_idx = idx;
+    }
 
-    log_entry& e = cfg->log[idx];
-    e.timestamp = timestamp;
-    e.event     = event;
-    e.data      = data;
+    const uint32_t offset = static_cast<uint32_t>(reinterpret_cast<char*>(&cfg->log[idx]) -
+                                                  reinterpret_cast<char*>(cfg));
 
-    return save_config(cfg) == 0;
+    return append_config(offset, &record, sizeof(record)) == 0;
 }
 
 unsigned ICACHE_FLASH_ATTR get_event_history(unsigned offset, log_entry* buffer, unsigned size)
@@ -82,43 +240,35 @@ unsigned ICACHE_FLASH_ATTR get_event_history(unsigned offset, log_entry* buffer,
 
     const unsigned num_log_sectors = get_num_log_sectors();
 
-    config* cfg;
-
-    constexpr uint16_t max_log_entries = sizeof(cfg->log) / sizeof(cfg->log[0]);
-
-    if (offset >= num_log_sectors * max_log_entries)
-        return 0u;
-
     unsigned num = 0;
+    uint32_t id  = ~0u;
 
-    for ( ; num < size; num++) {
+    for (unsigned sec_idx = 0; sec_idx < num_log_sectors && num < size; sec_idx++) {
 
-        const unsigned idx = offset + num;
+        const config* cfg = sec_idx ? static_cast<config*>(load_config(-static_cast<int>(sec_idx)))
+                                    : get_config();
 
-        const unsigned sec_idx = idx % num_log_sectors;
-
-        cfg = static_cast<config*>(load_config(-static_cast<int>(sec_idx)));
-
-        if (cfg->last_log_idx >= max_log_entries)
+        // Ids of consecutive sectors are consecutive, otherwise the sector
+        // has not been written yet or it has already been overwritten
+        if ( ! cfg || cfg->id == ~0u || (sec_idx && cfg->id + 1u != id))
             break;
 
-        const uint16_t log_idx_offs = idx / num_log_sectors;
+        id = cfg->id;
 
-        if (log_idx_offs >= max_log_entries)
-            break;
+        for (unsigned idx = get_num_records(cfg); idx && num < size; ) {
 
-        const unsigned log_idx = (cfg->last_log_idx >= log_idx_offs)
-                                 ? cfg->last_log_idx - log_idx_offs
-                                 : max_log_entries + cfg->last_log_idx - log_idx_offs;
+            const log_record& record = cfg->log[--idx];
 
-        const auto entry = cfg->log[log_idx];
+            if ( ! is_valid(record))
+                continue;
 
-        if (entry.timestamp == ~0u ||
-            entry.event <= LOG_ZERO ||
-            entry.event >= LOG_INVALID)
-            break;
+            if (offset) {
+                --offset;
+                continue;
+            }
 
-        buffer[num] = cfg->log[log_idx];
+            buffer[num++] = record.entry;
+        }
     }
 
     return num;
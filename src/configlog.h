@@ -52,8 +52,6 @@ struct config_settings : public config_base {
     bool          enabled : 1;
     // `moisture_enabled` enables or disables moisture monitoring
     bool          moisture_enabled : 1;
-    // Index of last log entry (for horizontal circular log buffer)
-    uint16_t      last_log_idx;
     // Maximum moisture threshold above which watering is not triggered
     uint16_t      moisture_threshold;
 };
@@ -92,18 +90,43 @@ struct log_entry {
 
 static_assert(sizeof(log_entry) == 8u, "Invalid size of log_entry");
 
+// Log entries are appended in place to erased slots after the settings,
+// which are covered by the checksum of the sector, so each log entry carries
+// its own check.  Once all slots are used, a new sector is written.
+struct log_record {
+    log_entry entry;
+    uint32_t  check;
+};
+
 constexpr size_t config_size = 0x1000u;
 
 struct config : public config_settings {
-    log_entry log[(config_size - sizeof(config_settings)) / sizeof(log_entry)];
+    log_record log[(config_size - sizeof(config_settings)) / sizeof(log_record)];
 };
 
 static_assert(sizeof(config) <= config_size, "Incorrect config size");
-static_assert(config_size - sizeof(config) < sizeof(log_entry), "Incorrect config size");
+static_assert(config_size - sizeof(config) < sizeof(log_record), "Incorrect config size");
 
 // Loads and initializes configuration
 config* get_config();
 
+// Saves configuration returned by get_config() after it has been modified.
+//
+// The configuration is not written to flash immediately.  Changes made in
+// quick succession are written together, once no change has been made for
+// config_quiet_period_ms, but at most config_max_delay_ms after the first
+// change.
+void defer_save_config();
+
+// Writes configuration to flash if there are changes which have not been
+// written yet.
+//
+// Returns true on success and false on failure.
+bool flush_config();
+
+constexpr uint32_t config_quiet_period_ms = 5000u;
+constexpr uint32_t config_max_delay_ms    = 60000u;
+
 // Logs a specific event.
 //
 // Returns true on success and false on failure.
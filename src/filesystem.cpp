@@ -10,6 +10,19 @@ extern "C" {
 
 #include "filesystem.h"
 
+#ifdef UNIT_TEST
+namespace mock {
+    const char* get_flash_map();
+    uint32_t    get_flash_map_size();
+}
+#define FLASH_MAP_BEGIN mock::get_flash_map()
+#define FLASH_MAP_SIZE  mock::get_flash_map_size()
+#else
+// The first 1MB of flash is mapped by the flash cache at this address
+#define FLASH_MAP_BEGIN reinterpret_cast<const char*>(0x40200000u)
+#define FLASH_MAP_SIZE  0x100000u
+#endif
+
 constexpr uint32_t max_writes_per_day = 400u;
 constexpr uint32_t sec_per_day        = 60u * 60u * 24u;
 
@@ -20,22 +33,169 @@ static uint32_t& log_begin    = data_end;
 static uint32_t  log_end      = 0u;
 static bool      supports_ota = false;
 
-static filesystem* fs = nullptr;
+// Filesystem slots.  If there is enough flash, there are two slots.  A new
+// filesystem is uploaded to the inactive slot while the active one keeps
+// being used and the slots are switched once the new filesystem has been
+// verified.  The commit record indicates which slot is active.
+//
+// The commit record is stored in two sectors, which are written alternately,
+// and the record with the higher sequence number is valid.  A sector must be
+// erased before it is written, so if power is lost in between, the record in
+// the other sector still indicates the slot which was active before.
+static uint32_t fs_slots[2]  = { 0u, 0u };
+static uint32_t num_fs_slots = 0u;
+static uint32_t active_slot  = 0u;
+static uint32_t commit_addr  = 0u; // address of the first of the two commit record sectors
+
+#define FS_COMMIT_MAGIC 0xC0DEC0A2u
+
+struct fs_commit_record {
+    uint32_t magic;    // must be FS_COMMIT_MAGIC
+    uint32_t slot;     // index of the active slot
+    uint32_t sequence; // incremented with every commit
+    uint32_t checksum; // checksum of the above fields
+};
+
+constexpr uint32_t num_commit_copies = 2u;
+
+// Minimum size of the log area required to have two filesystem slots
+constexpr uint32_t min_log_sectors = 16u;
+
+// Index of the directory, kept in RAM instead of the directory itself.
+//
+// The directory stays in flash and only the header and a compact index of
+// the files are resident, which take 12 bytes per file.  The index is enough
+// to find files by name and to tell which files share data.  File entries
+// and names are read from flash on demand.
+//
+// The index is sorted by hash of file name, so that files can be looked up
+// with binary search.  Files with the same hash are sorted by name, like in
+// the directory.  Files are identified by their position in the index.
+struct dir_index_entry {
+    uint32_t name_hash; // FNV-1a hash of file name
+    uint32_t offset;    // offset of file data, same as in file_entry, or ~0u for empty files
+    uint16_t file;      // index of the file entry in the directory
+    uint16_t owner;     // position of the first file in the index with the same data
+};
+
+static_assert(max_files <= 0x10000u, "Too many files for directory index");
+
+struct directory {
+    uint32_t        addr;       // address of the filesystem in flash
+    uint32_t        num_files;
+    uint32_t        dir_size;   // size of the directory in flash, including file names
+    uint32_t        image_size; // size of the filesystem image, up to the end of the last file
+    dir_index_entry index[1];
+};
+
+static directory* fs = nullptr;
+
+// Entries of recently found files, find_file() returns pointers to them
+struct cached_entry {
+    uint32_t   index;                   // index of the file in the directory, ~0u if unused
+    file_entry entry;
+    char       name[max_filename_size];
+};
+
+static cached_entry entry_cache[file_entry_cache_size];
+static uint32_t     entry_cache_next = 0u; // slot which is reused next
+
+// State of filesystem upload
+static bool       uploading      = false;
+static directory* upload_fs      = nullptr; // directory of the uploaded filesystem
+static uint32_t   upload_slot    = 0u;
+static uint32_t   upload_sectors = 0u;      // bitmap of sectors written during upload
+static uint32_t   erase_sectors  = 0u;      // bitmap of sectors to erase ahead of the upload
+static os_timer_t erase_timer;
+
+// State of verification of an image uploaded with write_fs(), checksums are
+// calculated from the received data while it is being written to flash
+struct upload_check {
+    bool       in_order;     // all data so far has been received in order, without gaps
+    uint32_t   pos;          // offset of the next byte of the image
+    uint32_t   dir_size;     // size of the directory, from the image header
+    uint32_t   dir_checksum; // checksum of the directory received so far
+    uint32_t   file;         // index of the file being verified, ~0u if none
+    file_entry entry;        // entry of the file being verified
+    uint32_t   checksum;     // checksum of the head or data of the file received so far
+    uint32_t   num_verified; // number of verified files, files which share data count once
+};
+
+static upload_check check;
+
+static_assert(max_fs_sectors <= 32u, "Too many sectors for upload bitmap");
+
+// Incremented whenever the filesystem is written, invalidates open file streams
+static uint32_t fs_generation = 0u;
+
+// Bitmap of files whose data checksum has been verified since the filesystem
+// was loaded
+static uint32_t verified_files[(max_files + 31u) / 32u];
+
+// State of scrub_filesystem()
+static uint32_t    scrub_index = 0u;
+static file_stream scrub_stream;
+
+struct cached_file {
+    cached_file* next;       // less recently used file
+    uint32_t     offset;     // offset of file data, identifies the file and files sharing data
+    uint32_t     alloc_size;
+    char         data[1];    // HTTP response head followed by file data
+};
+
+static cached_file* file_cache      = nullptr; // most recently used file first
+static uint32_t     file_cache_used = 0u;
+static uint32_t     file_cache_max  = default_file_cache_size;
+
+static void flush_file_cache();
+static void flush_entry_cache();
+static void stop_erase_ahead();
+
+// Identifies the layout of log/configuration sectors
+#define CONFIG_MAGIC 0xC0DEC0F6u
 
 static config_base* cfg      = nullptr;
 static config_base* cfg_aux  = nullptr;
 static uint32_t     cfg_addr = ~0u;
-static config_base  cfg_last = { ~0u, ~0u, 0u, 0u };
+static config_base  cfg_last = { ~0u, ~0u, 0u, 0u, 0u, 0u };
+
+// Location of the last log/configuration sector is kept in RTC memory, which
+// survives warm reboots, so that load_config() does not have to search for it.
+#define CFG_RTC_MAGIC 0xC0DE4C06u
+
+constexpr uint8_t cfg_rtc_block = 64u; // first 4-byte block of RTC user memory
+
+struct cfg_rtc_record {
+    uint32_t    magic;    // must be CFG_RTC_MAGIC
+    uint32_t    addr;     // address of the last log/configuration sector
+    config_base last;     // header of the last log/configuration sector
+    uint32_t    checksum; // checksum of the above fields
+};
 
 #ifdef UNIT_TEST
 namespace mock {
     void destroy_filesystem()
     {
+        flush_file_cache();
+        flush_entry_cache();
+        file_cache_max = default_file_cache_size;
+
+        ++fs_generation;
+        scrub_index       = 0u;
+        scrub_stream.size = 0u;
+
         if (fs) {
             os_free(fs);
             fs = nullptr;
         }
 
+        if (upload_fs) {
+            os_free(upload_fs);
+            upload_fs = nullptr;
+        }
+        uploading = false;
+        stop_erase_ahead();
+
         if (cfg) {
             os_free(cfg);
             cfg = nullptr;
@@ -50,8 +210,23 @@ namespace mock {
         data_begin   = 0u;
         data_end     = 0u;
         log_end      = 0u;
+        fs_slots[0]  = 0u;
+        fs_slots[1]  = 0u;
+        num_fs_slots = 0u;
+        active_slot  = 0u;
+        commit_addr  = 0u;
         cfg_addr     = 0u;
-        cfg_last     = { ~0u, ~0u, 0u, 0u };
+        cfg_last     = { ~0u, ~0u, 0u, 0u, 0u, 0u };
+    }
+
+    uint32_t get_fs_offset()
+    {
+        return fs_slots[active_slot] - data_begin;
+    }
+
+    uint32_t get_log_addr()
+    {
+        return log_begin;
     }
 }
 #endif
@@ -127,6 +302,27 @@ static void ICACHE_FLASH_ATTR configure_flash()
         data_begin = log_end;
         data_end   = log_end;
     }
+
+    fs_slots[0]  = data_begin;
+    fs_slots[1]  = data_begin;
+    num_fs_slots = 1u;
+    commit_addr  = 0u;
+
+    // If there is enough flash, the commit record and the second filesystem slot
+    // are placed at the end of the log area, so that the layout of the first slot
+    // and of the log area remain compatible with single-slot configuration.
+    // This takes num_commit_copies + max_fs_sectors sectors away from the log,
+    // so wear of the log sectors is spread over fewer sectors.
+    constexpr uint32_t second_slot_size = num_commit_copies * SPI_FLASH_SEC_SIZE + max_fs_size;
+
+    if (data_end - data_begin == max_fs_size &&
+        log_end >= data_end + second_slot_size + min_log_sectors * SPI_FLASH_SEC_SIZE) {
+
+        log_end     -= second_slot_size;
+        commit_addr  = log_end;
+        fs_slots[1]  = log_end + num_commit_copies * SPI_FLASH_SEC_SIZE;
+        num_fs_slots = 2u;
+    }
 }
 
 // This function returns the index of the sector where the SDK can store its data.
@@ -150,359 +346,2111 @@ static uint32_t ICACHE_FLASH_ATTR calc_checksum(const uint32_t* begin, const uin
     return checksum;
 }
 
-int ICACHE_FLASH_ATTR init_filesystem()
+// Returns offset of a file entry from the beginning of the directory.
+static uint32_t ICACHE_FLASH_ATTR get_entry_offset(uint32_t index)
 {
-    if (fs)
-        return 0;
+    return sizeof(filesystem) + sizeof(file_entry) * index - sizeof(file_entry);
+}
 
-    filesystem hdr;
-    if (spi_flash_read(data_begin, reinterpret_cast<uint32_t*>(&hdr), sizeof(hdr))
-            != SPI_FLASH_RESULT_OK) {
-        os_printf("Error: failed to read filesystem header\n");
-        return 1;
-    }
+// Returns offset of file names from the beginning of the directory.
+static uint32_t ICACHE_FLASH_ATTR get_names_offset(uint32_t num_files)
+{
+    return get_entry_offset(num_files);
+}
 
-    if (hdr.magic != FILESYSTEM_MAGIC) {
-        os_printf("Error: filesystem magic is 0x%08x, but should be 0x%08x\n",
-                  hdr.magic, FILESYSTEM_MAGIC);
-        return 1;
-    }
+// Computes checksum of 'size' bytes of flash at 'addr', padded with zeroes
+// to a multiple of 4.
+static bool ICACHE_FLASH_ATTR checksum_flash(uint32_t addr, uint32_t size, uint32_t* checksum)
+{
+    uint32_t buf[128];
 
-    constexpr uint32_t max_files = 1 + (SPI_FLASH_SEC_SIZE - sizeof(hdr)) / sizeof(file_entry);
+    *checksum = 0u;
 
-    if (hdr.num_files == 0 || hdr.num_files > max_files) {
-        os_printf("Error: incorrect number of files: %u (must be from 1 to %u)\n",
-                  hdr.num_files, max_files);
-        return 1;
+    while (size) {
+        const uint32_t read_size    = size < sizeof(buf) ? size : sizeof(buf);
+        const uint32_t aligned_size = ((read_size - 1u) & ~3u) + 4u;
+
+        if (spi_flash_read(addr, buf, aligned_size) != SPI_FLASH_RESULT_OK) {
+            os_printf("Error: failed to read file\n");
+            return false;
+        }
+
+        char* const bytes = reinterpret_cast<char*>(buf);
+        for (uint32_t i = read_size; i < aligned_size; i++)
+            bytes[i] = 0;
+
+        *checksum += calc_checksum(buf, buf + aligned_size / sizeof(uint32_t));
+
+        addr += aligned_size;
+        size -= read_size;
     }
 
-    const uint32_t fs_size = sizeof(filesystem) + sizeof(file_entry) * (hdr.num_files - 1);
+    return true;
+}
+
+// Updates 32-bit FNV-1a hash with 'size' bytes of data.
+static uint32_t ICACHE_FLASH_ATTR fnv1a(uint32_t hash, const void* data, uint32_t size)
+{
+    const uint8_t* const bytes = static_cast<const uint8_t*>(data);
 
-    fs = static_cast<filesystem*>(os_malloc(fs_size));
+    for (uint32_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
 
-    if (!fs) {
-        os_printf("Error: failed to allocate memory\n");
+    return hash;
+}
+
+constexpr uint32_t fnv1a_basis = 2166136261u;
+
+// Reads and checks the header of the directory of the filesystem stored at 'addr'.
+//
+// Returns 0 on success or 1 on failure.
+static int ICACHE_FLASH_ATTR read_directory_header(uint32_t addr, filesystem* hdr)
+{
+    if (spi_flash_read(addr, reinterpret_cast<uint32_t*>(hdr), sizeof(*hdr))
+            != SPI_FLASH_RESULT_OK) {
+        os_printf("Error: failed to read filesystem header\n");
         return 1;
     }
 
-    if (spi_flash_read(data_begin, reinterpret_cast<uint32_t*>(fs), fs_size)
-            != SPI_FLASH_RESULT_OK) {
-        os_printf("Error: failed to read filesystem\n");
-        os_free(fs);
-        fs = nullptr;
+    if (hdr->magic != FILESYSTEM_MAGIC) {
+        os_printf("Error: filesystem magic is 0x%08x, but should be 0x%08x\n",
+                  hdr->magic, FILESYSTEM_MAGIC);
         return 1;
     }
 
-    const uint32_t* src = &fs->num_files; // skip magic and checksum
-    const uint32_t* end = reinterpret_cast<uint32_t*>(fs) + fs_size / sizeof(uint32_t);
-    const uint32_t checksum = calc_checksum(src, end);
+    if (hdr->num_files == 0 || hdr->num_files > max_files) {
+        os_printf("Error: incorrect number of files: %u (must be from 1 to %u)\n",
+                  hdr->num_files, max_files);
+        return 1;
+    }
 
-    if (checksum != hdr.checksum) {
-        os_printf("Error: incorrect checksum 0x%08x, but should be 0x%08x\n",
-                  checksum, hdr.checksum);
-        os_free(fs);
-        fs = nullptr;
+    if ((hdr->dir_size & 3u) || hdr->dir_size <= get_names_offset(hdr->num_files) ||
+        hdr->dir_size > data_end - data_begin) {
+        os_printf("Error: incorrect directory size: %u\n", hdr->dir_size);
         return 1;
     }
 
-    os_printf("initialized filesystem: %u files\n", hdr.num_files);
     return 0;
 }
 
-const file_entry* ICACHE_FLASH_ATTR find_file(const char* filename)
+// Reads a part of the directory, 'size' is a multiple of 4.
+//
+// If the directory is in the memory-mapped flash window, it is read from
+// there, which is much faster than spi_flash_read().
+static bool ICACHE_FLASH_ATTR read_directory(uint32_t addr, uint32_t* buf, uint32_t size)
 {
-    if (!fs)
-        return nullptr;
+    if (addr + size <= FLASH_MAP_SIZE) {
+        // The mapped flash can only be read with 32-bit loads
+        const uint32_t* const src = reinterpret_cast<const uint32_t*>(FLASH_MAP_BEGIN + addr);
 
-    file_entry* file = &fs->entries[0];
-    file_entry* const fs_end = file + fs->num_files;
+        for (uint32_t i = 0; i < size / sizeof(uint32_t); i++)
+            buf[i] = src[i];
 
-    for ( ; file != fs_end; ++file) {
-        if (os_strncmp(filename, file->filename, sizeof(file->filename)) == 0)
-            return file;
+        return true;
     }
 
-    return nullptr;
+    return spi_flash_read(addr, buf, size) == SPI_FLASH_RESULT_OK;
 }
 
-char* ICACHE_FLASH_ATTR load_file(const file_entry* file, int size_in_front)
+// Reads the entry of the file at 'index' from the directory stored at 'addr'.
+//
+// Returns 0 on success or 1 on failure.
+static int ICACHE_FLASH_ATTR read_entry(uint32_t addr, uint32_t index, file_entry* entry)
 {
-    if (!fs)
-        return nullptr;
-
-    if (size_in_front & 3)
-        return nullptr;
-
-    const uint32_t offset = file->offset + data_begin;
-
-    if ((offset & 3u) || ! file->size || offset > data_end || offset + file->size > data_end) {
-        os_printf("Error: invalid file offset 0x%08x or size 0x%08x\n",
-                  file->offset, file->size);
-        return nullptr;
+    if ( ! read_directory(addr + get_entry_offset(index), reinterpret_cast<uint32_t*>(entry),
+                          sizeof(*entry))) {
+        os_printf("Error: failed to read file entry %u\n", index);
+        return 1;
     }
 
-    const uint32_t alloc_size = size_in_front + ((file->size - 1u) & ~3u) + 4u;
-
-    char* const buf = static_cast<char*>(os_malloc(alloc_size));
-    if (!buf) {
-        os_printf("Error: failed to allocate memory\n");
-        return nullptr;
-    }
+    return 0;
+}
 
-    if (spi_flash_read(offset, reinterpret_cast<uint32_t*>(buf + size_in_front), file->size)
-            != SPI_FLASH_RESULT_OK) {
-        os_printf("Error: failed to read file\n");
-        os_free(buf);
-        return nullptr;
-    }
+// Reads the entry of the file at 'index' in the index of directory 'dir'.
+//
+// Returns 0 on success or 1 on failure.
+static int ICACHE_FLASH_ATTR read_index_entry(const directory* dir, uint32_t index, file_entry* entry)
+{
+    return read_entry(dir->addr, dir->index[index].file, entry);
+}
 
-    // Pad with zeroes for checksum
-    for (uint32_t i = size_in_front + file->size; i < alloc_size; i++)
-        buf[i] = 0;
+// Reads the name of a file from the directory stored at 'addr'.
+//
+// - addr     - address of the directory
+// - dir_size - size of the directory
+// - offset   - offset of the name from the beginning of the directory
+// - name     - receives the name, max_filename_size bytes
+//
+// Returns the length of the name or 0 if the name is invalid.
+static uint32_t ICACHE_FLASH_ATTR read_file_name(uint32_t addr,
+                                                 uint32_t dir_size,
+                                                 uint32_t offset,
+                                                 char*    name)
+{
+    if (offset < get_entry_offset(0) || offset >= dir_size)
+        return 0u;
 
-    const uint32_t checksum = calc_checksum(reinterpret_cast<uint32_t*>(buf + size_in_front),
-                                            reinterpret_cast<uint32_t*>(buf + alloc_size));
-    if (checksum != file->checksum) {
-        os_printf("Error: file checksum 0x%08x mismatch, expected 0x%08x\n",
-                  checksum, file->checksum);
-        os_free(buf);
-        return nullptr;
-    }
+    // Names are not aligned, but flash is read in 32-bit words
+    uint32_t buf[max_filename_size / sizeof(uint32_t) + 1u];
 
-    return buf;
-}
+    const uint32_t aligned   = offset & ~3u;
+    const uint32_t skip      = offset & 3u;
+    const uint32_t read_size = dir_size - aligned < sizeof(buf) ? dir_size - aligned : sizeof(buf);
 
-int ICACHE_FLASH_ATTR write_fs(unsigned offset, const char* data, int size)
-{
-    if (fs && offset == 0) {
-        os_free(fs);
-        fs = nullptr;
+    if ( ! read_directory(addr + aligned, buf, read_size)) {
+        os_printf("Error: failed to read file name\n");
+        return 0u;
     }
 
-    if (offset % SPI_FLASH_SEC_SIZE) {
-        os_printf("Error: invalid offset 0x%08x\n", offset);
-        return 1;
-    }
+    const char* const src     = reinterpret_cast<const char*>(buf) + skip;
+    const uint32_t    max_len = read_size - skip < max_filename_size
+                                ? read_size - skip : max_filename_size;
 
-    const uint32_t data_size = data_end - data_begin;
-    if (offset > data_size || offset + size > data_size) {
-        os_printf("Error: data overflows allocated space in flash, offset 0x%08x size 0x%08x\n",
-                  offset, size);
-        return 1;
+    uint32_t len = 0;
+    while (len < max_len && src[len]) {
+        name[len] = src[len];
+        ++len;
     }
 
-    int sector = (data_begin + offset) / SPI_FLASH_SEC_SIZE;
-    const int end_sector = sector + ((size - 1) / SPI_FLASH_SEC_SIZE) + 1;
+    if (len == max_len)
+        return 0u;
 
-    for ( ; sector < end_sector; ++sector) {
-        os_printf("erase @0x%08x\n", sector * SPI_FLASH_SEC_SIZE);
-        if (spi_flash_erase_sector(sector) != SPI_FLASH_RESULT_OK) {
-            os_printf("Error: failed to erase sector %d\n", sector);
-            return 1;
-        }
-    }
+    name[len] = 0;
+    return len;
+}
 
-    uint32_t buf[SPI_FLASH_SEC_SIZE / sizeof(uint32_t)];
-    uint32_t dest = data_begin + offset;
+// mkfs.py stores files with identical contents and HTTP response head only once
+// and their directory entries point to the same data.  Such files are treated
+// as one object, they are verified, scrubbed and cached together.
+static bool ICACHE_FLASH_ATTR same_data(const file_entry& a, const file_entry& b)
+{
+    return a.offset        == b.offset        &&
+           a.size          == b.size          &&
+           a.checksum      == b.checksum      &&
+           a.head_size     == b.head_size     &&
+           a.head_checksum == b.head_checksum &&
+           a.splice        == b.splice;
+}
 
-    while (size) {
+// Returns index of the first file in the index which has the same data
+// as the file at 'index', which is 'index' itself if the data is not shared.
+//
+// load_directory() ensures that files at the same offset have the same data.
+static uint32_t ICACHE_FLASH_ATTR get_data_owner(const directory* dir, uint32_t index)
+{
+    return dir->index[index].owner;
+}
 
-        const int copy_size = size > static_cast<int>(sizeof(buf)) ? sizeof(buf) : size;
+// Sorts 'num' items with heap sort, which takes O(n log n) time even in the
+// worst case and needs no additional memory.
+//
+// - less - returns true if the first item must come before the second one
+template<typename T, typename Less>
+static void ICACHE_FLASH_ATTR heap_sort(T* items, uint32_t num, Less less)
+{
+    const auto sift_down = [items, less](uint32_t root, uint32_t end) ICACHE_FLASH_ATTR {
+        for (;;) {
+            uint32_t child = root * 2u + 1u;
+            if (child >= end)
+                break;
 
-        if (copy_size < static_cast<int>(sizeof(buf)))
-            buf[copy_size / sizeof(uint32_t)] = 0;
+            if (child + 1u < end && less(items[child], items[child + 1u]))
+                ++child;
 
-        os_memcpy(buf, data, copy_size);
+            if ( ! less(items[root], items[child]))
+                break;
 
-        const auto write_size = ((copy_size - 1u) & ~3u) + 4u;
-        os_printf("write @0x%08x size 0x%04x\n", dest, write_size);
-        if (spi_flash_write(dest, buf, write_size) != SPI_FLASH_RESULT_OK) {
-            os_printf("Error: failed to write 0x%x bytes at offset 0x%x\n",
-                      copy_size, dest);
-            return 1;
+            const T tmp  = items[root];
+            items[root]  = items[child];
+            items[child] = tmp;
+            root         = child;
         }
+    };
 
-        data += copy_size;
-        size -= copy_size;
-        dest += write_size;
-    }
+    for (uint32_t i = num / 2u; i; i--)
+        sift_down(i - 1u, num);
 
-    return init_filesystem();
+    for (uint32_t end = num; end > 1u; end--) {
+        const T tmp     = items[0];
+        items[0]        = items[end - 1u];
+        items[end - 1u] = tmp;
+        sift_down(0u, end - 1u);
+    }
 }
 
-static uint32_t ICACHE_FLASH_ATTR calc_config_checksum(config_base* config)
+// Sorts the index by hash of file name.  Files with the same hash stay
+// sorted by name, because the directory is sorted by name.
+static void ICACHE_FLASH_ATTR sort_index(directory* dir)
 {
-    return calc_checksum(&config->checksum + 1, &config->checksum + (SPI_FLASH_SEC_SIZE / 4u));
+    heap_sort(dir->index, dir->num_files, [](const dir_index_entry& a, const dir_index_entry& b) ICACHE_FLASH_ATTR {
+        return a.name_hash < b.name_hash || (a.name_hash == b.name_hash && a.file < b.file);
+    });
 }
 
-static bool ICACHE_FLASH_ATTR read_config(uint32_t addr, config_base* config)
+// Finds files which share data and records the first of them as the owner
+// of the data in each of them.
+//
+// Files are visited in the order of their data offset, so files at the same
+// offset are next to each other.
+//
+// Returns 0 on success or 1 if files which share data have different entries.
+static int ICACHE_FLASH_ATTR find_data_owners(directory* dir)
 {
-    if (spi_flash_read(addr, &config->checksum, SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK) {
-        os_printf("Error: failed to read log from 0x%08x\n", addr);
-        return false;
+    uint16_t* const order = static_cast<uint16_t*>(os_malloc(sizeof(uint16_t) * dir->num_files));
+
+    if ( ! order) {
+        os_printf("Error: failed to allocate memory\n");
+        return 1;
     }
 
-    if (config->id == ~0u && config->checksum == ~0u)
-        return true;
+    for (uint32_t i = 0; i < dir->num_files; i++)
+        order[i] = static_cast<uint16_t>(i);
 
-    const uint32_t checksum = calc_config_checksum(config);
+    const dir_index_entry* const index = dir->index;
 
-    if (checksum != config->checksum) {
-        os_printf("Error: invalid log entry checksum 0x%08x, expected 0x%08x\n",
-                  config->checksum, checksum);
-        return false;
-    }
+    heap_sort(order, dir->num_files, [index](uint16_t a, uint16_t b) ICACHE_FLASH_ATTR {
+        return index[a].offset < index[b].offset || (index[a].offset == index[b].offset && a < b);
+    });
 
-    return true;
-}
+    uint32_t   owner       = ~0u;
+    file_entry owner_entry = { };
 
-uint32_t ICACHE_FLASH_ATTR get_num_log_sectors()
-{
-    return (log_end - log_begin) / SPI_FLASH_SEC_SIZE;
-}
+    for (uint32_t i = 0; i < dir->num_files; i++) {
 
-static config_base* ICACHE_FLASH_ATTR load_config_sector(int idx)
-{
-    const uint32_t num_log_sectors = get_num_log_sectors();
+        const uint32_t pos = order[i];
 
-    int sec_idx = (cfg_addr - log_begin) / SPI_FLASH_SEC_SIZE + idx;
-    sec_idx %= static_cast<int>(num_log_sectors);
-    if (sec_idx < 0)
-        sec_idx += num_log_sectors;
+        if (owner == ~0u || dir->index[owner].offset != dir->index[pos].offset) {
+            owner = pos;
 
-    const uint32_t addr = sec_idx * SPI_FLASH_SEC_SIZE + log_begin;
+            if (dir->index[pos].offset != ~0u && read_index_entry(dir, pos, &owner_entry)) {
+                os_free(order);
+                return 1;
+            }
+        }
 
-    if (addr == cfg_addr)
-        return cfg;
+        dir->index[pos].owner = static_cast<uint16_t>(owner);
 
-    if ( ! cfg_aux)
-        cfg_aux = static_cast<config_base*>(os_malloc(SPI_FLASH_SEC_SIZE));
+        // Empty files have no data
+        if (pos == owner || dir->index[pos].offset == ~0u)
+            continue;
 
-    if ( ! read_config(addr, cfg_aux))
-        return nullptr;
+        // Files which share data must have identical entries, except for the name
+        file_entry entry;
+        if (read_index_entry(dir, pos, &entry) || ! same_data(entry, owner_entry)) {
+            os_printf("Error: file %u overlaps file %u\n",
+                      dir->index[pos].file, dir->index[owner].file);
+            os_free(order);
+            return 1;
+        }
+    }
 
-    return cfg_aux;
+    os_free(order);
+    return 0;
 }
 
-config_base* ICACHE_FLASH_ATTR load_config(int idx)
+// Verifies the directory of the filesystem stored at 'addr' and builds its index.
+//
+// The directory is read from flash piece by piece, so it is never loaded
+// into RAM as a whole.
+//
+// If 'dir_checksum' is not null, it is the checksum of the directory which
+// has been calculated while the directory was being uploaded.
+//
+// Returns the allocated index or nullptr on failure.
+static directory* ICACHE_FLASH_ATTR load_directory(uint32_t addr, const uint32_t* dir_checksum = nullptr)
 {
-    if (log_begin >= log_end) {
-        os_printf("Error: config area not available\n");
+    filesystem hdr;
+    if (read_directory_header(addr, &hdr))
         return nullptr;
-    }
 
-    if (idx != 0) {
-        if ( ! cfg) {
-            os_printf("Error: config not initialized\n");
-            return nullptr;
-        }
+    constexpr uint32_t skip = 2u * sizeof(uint32_t); // magic and checksum
 
-        return load_config_sector(idx);
-    }
+    uint32_t checksum = 0u;
+    if (dir_checksum)
+        checksum = *dir_checksum;
+    else if ( ! checksum_flash(addr + skip, hdr.dir_size - skip, &checksum))
+        return nullptr;
 
-    if (cfg)
-        return cfg;
+    if (checksum != hdr.checksum) {
+        os_printf("Error: incorrect checksum 0x%08x, but should be 0x%08x\n",
+                  checksum, hdr.checksum);
+        return nullptr;
+    }
 
-    config_base* low  = static_cast<config_base*>(os_malloc(SPI_FLASH_SEC_SIZE));
-    config_base* mid  = static_cast<config_base*>(os_malloc(SPI_FLASH_SEC_SIZE));
-    config_base* high = static_cast<config_base*>(os_malloc(SPI_FLASH_SEC_SIZE));
+    const uint32_t alloc_size = sizeof(directory) + sizeof(dir_index_entry) * (hdr.num_files - 1u);
 
-    class free_ptr {
-        public:
-            explicit free_ptr(config_base*& ptr) ICACHE_FLASH_ATTR : ptr_(ptr) { }
-            ~free_ptr() ICACHE_FLASH_ATTR {
-                if (ptr_)
-                    os_free(ptr_);
-            }
-        private:
-            config_base*& ptr_;
-    };
-    free_ptr free_low(low);
-    free_ptr free_mid(mid);
-    free_ptr free_high(high);
+    directory* const dir = static_cast<directory*>(os_malloc(alloc_size));
 
-    if ( ! low || ! mid || ! high) {
+    if (!dir) {
         os_printf("Error: failed to allocate memory\n");
         return nullptr;
     }
 
-    uint32_t low_addr  = log_begin;
-    uint32_t high_addr = log_end - SPI_FLASH_SEC_SIZE;
-
-    if (!read_config(low_addr, low))
-        return nullptr;
+    dir->addr       = addr;
+    dir->num_files  = hdr.num_files;
+    dir->dir_size   = hdr.dir_size;
+    dir->image_size = hdr.dir_size;
 
-    if (low->id == ~0u)
-        low_addr = log_end; // First entry will be saved at log_begin
+    char name[max_filename_size];
+    char prev[max_filename_size];
 
-    else {
+    for (uint32_t i = 0; i < hdr.num_files; i++) {
 
-        if (!read_config(high_addr, high))
+        file_entry entry;
+        if (read_entry(addr, i, &entry)) {
+            os_free(dir);
             return nullptr;
+        }
 
-        while (low_addr < high_addr) {
+        // File names must be within the directory and they must be null-terminated
+        const uint32_t len = read_file_name(addr, hdr.dir_size, entry.name, name);
 
-            config_base* tmp;
+        if ( ! len || entry.name < get_names_offset(hdr.num_files)) {
+            os_printf("Error: invalid name of file %u\n", i);
+            os_free(dir);
+            return nullptr;
+        }
 
-            if (high->id != ~0u && high->id > low->id) {
-                tmp      = high;
-                high     = low;
-                low      = tmp;
-                low_addr = high_addr;
-                break;
-            }
+        // The directory must be sorted by file name, which also guarantees
+        // that file names are unique
+        if (i && os_strncmp(prev, name, max_filename_size) >= 0) {
+            os_printf("Error: directory is not sorted at file %u\n", i);
+            os_free(dir);
+            return nullptr;
+        }
 
-            if (low_addr + SPI_FLASH_SEC_SIZE == high_addr)
-                break;
+        os_memcpy(prev, name, len + 1u);
 
-            const uint32_t mid_addr = ((low_addr + high_addr) / (2u * SPI_FLASH_SEC_SIZE))
-                                      * SPI_FLASH_SEC_SIZE;
+        // Empty files have no data, their offset can be the same as of the next file
+        dir->index[i].name_hash = fnv1a(fnv1a_basis, name, len);
+        dir->index[i].offset    = entry.size ? entry.offset : ~0u;
+        dir->index[i].file      = static_cast<uint16_t>(i);
+        dir->index[i].owner     = static_cast<uint16_t>(i);
 
-            if (!read_config(mid_addr, mid))
-                return nullptr;
+        const uint32_t end = entry.offset + entry.size;
+        if (end > dir->image_size)
+            dir->image_size = end;
+    }
 
-            if (mid->id == ~0u || mid->id < low->id) {
-                tmp       = high;
-                high      = mid;
-                mid       = tmp;
-                high_addr = mid_addr;
-            }
-            else {
-                tmp       = low;
-                low       = mid;
-                mid       = tmp;
-                low_addr  = mid_addr;
-            }
-        }
+    sort_index(dir);
 
-        cfg_last = *low;
+    if (find_data_owners(dir)) {
+        os_free(dir);
+        return nullptr;
     }
 
-    cfg      = low;
-    cfg_addr = low_addr;
-    low      = nullptr;
-    return cfg;
+    return dir;
 }
 
-bool ICACHE_FLASH_ATTR writing_too_fast(uint32_t timestamp, uint32_t first_timestamp, uint32_t id)
+// Reads the latest valid commit record.
+//
+// Returns index of the copy which holds the record or ~0u if there is no valid record.
+static uint32_t ICACHE_FLASH_ATTR read_commit_record(fs_commit_record* latest)
 {
-    if (timestamp == first_timestamp && ! id)
-        return false;
+    uint32_t latest_copy = ~0u;
 
-    if (timestamp <= first_timestamp || id == ~0u)
-        return true;
+    if (num_fs_slots < 2u)
+        return latest_copy;
 
-    // Add sec_per_day to allow max writes on the first day
-    const uint32_t total_lifetime = timestamp - first_timestamp + sec_per_day;
+    for (uint32_t copy = 0; copy < num_commit_copies; copy++) {
 
-    const uint32_t cur_writes_per_day = static_cast<uint32_t>(
-            (static_cast<uint64_t>(id) * sec_per_day) / total_lifetime);
+        fs_commit_record record;
+        if (spi_flash_read(commit_addr + copy * SPI_FLASH_SEC_SIZE,
+                           reinterpret_cast<uint32_t*>(&record), sizeof(record))
+                != SPI_FLASH_RESULT_OK)
+            continue;
 
-    return cur_writes_per_day > max_writes_per_day;
-}
+        if (record.magic != FS_COMMIT_MAGIC || record.slot >= num_fs_slots ||
+            record.checksum != calc_checksum(&record.magic, &record.checksum))
+            continue;
 
-static int ICACHE_FLASH_ATTR write_config_sector(config_base* config)
-{
+        if (latest_copy == ~0u || static_cast<int32_t>(record.sequence - latest->sequence) > 0) {
+            *latest     = record;
+            latest_copy = copy;
+        }
+    }
+
+    return latest_copy;
+}
+
+// Returns the slot indicated by the commit record, or 0 if there is no valid record.
+static uint32_t ICACHE_FLASH_ATTR get_committed_slot()
+{
+    fs_commit_record record;
+    if (read_commit_record(&record) == ~0u)
+        return 0u;
+
+    return record.slot;
+}
+
+static void ICACHE_FLASH_ATTR flush_entry_cache()
+{
+    for (auto& cached : entry_cache)
+        cached.index = ~0u;
+}
+
+int ICACHE_FLASH_ATTR init_filesystem()
+{
+    if (fs)
+        return 0;
+
+    // Use the committed slot, fall back to the other slot if it is broken
+    const uint32_t first_slot = get_committed_slot();
+
+    for (uint32_t i = 0; i < num_fs_slots; i++) {
+
+        const uint32_t slot = (first_slot + i) % num_fs_slots;
+
+        fs = load_directory(fs_slots[slot]);
+
+        if (fs) {
+            active_slot = slot;
+
+            flush_entry_cache();
+
+            for (auto& bits : verified_files)
+                bits = 0u;
+
+            os_printf("initialized filesystem: %u files in slot %u\n", fs->num_files, slot);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Returns the entry of the file at 'index' in the active filesystem, which is
+// read from flash unless it is already in the entry cache.
+static cached_entry* ICACHE_FLASH_ATTR get_cached_entry(uint32_t index)
+{
+    for (auto& cached : entry_cache) {
+        if (cached.index == index)
+            return &cached;
+    }
+
+    cached_entry& cached = entry_cache[entry_cache_next];
+
+    entry_cache_next = (entry_cache_next + 1u) % file_entry_cache_size;
+
+    cached.index = ~0u;
+
+    if (read_index_entry(fs, index, &cached.entry) ||
+        ! read_file_name(fs->addr, fs->dir_size, cached.entry.name, cached.name))
+        return nullptr;
+
+    cached.index = index;
+
+    return &cached;
+}
+
+#ifdef UNIT_TEST
+static uint64_t name_hash_compares = 0u;
+
+namespace mock {
+    uint64_t get_name_hash_compare_count()
+    {
+        return name_hash_compares;
+    }
+}
+#endif
+
+static uint32_t ICACHE_FLASH_ATTR get_name_hash(const directory* dir, uint32_t index)
+{
+#ifdef UNIT_TEST
+    ++name_hash_compares;
+#endif
+    return dir->index[index].name_hash;
+}
+
+const file_entry* ICACHE_FLASH_ATTR find_file(const char* filename)
+{
+    if (!fs)
+        return nullptr;
+
+    const uint32_t len = os_strlen(filename);
+    if ( ! len || len >= max_filename_size)
+        return nullptr;
+
+    const uint32_t hash = fnv1a(fnv1a_basis, filename, len);
+
+    // Find the first file with the same hash
+    uint32_t low  = 0u;
+    uint32_t high = fs->num_files;
+
+    while (low < high) {
+        const uint32_t mid = (low + high) / 2u;
+
+        if (get_name_hash(fs, mid) < hash)
+            low = mid + 1u;
+        else
+            high = mid;
+    }
+
+    // Names are unique, but different names can have the same hash
+    for (uint32_t i = low; i < fs->num_files && get_name_hash(fs, i) == hash; i++) {
+
+        const cached_entry* const cached = get_cached_entry(i);
+        if ( ! cached)
+            return nullptr;
+
+        const int cmp = os_strncmp(filename, cached->name, max_filename_size);
+
+        if ( ! cmp)
+            return &cached->entry;
+
+        // Files with the same hash are sorted by name
+        if (cmp < 0)
+            break;
+    }
+
+    return nullptr;
+}
+
+// Returns the slot of the entry cache which holds 'file' or nullptr if 'file'
+// is not in the cache.
+static const cached_entry* ICACHE_FLASH_ATTR find_cached_entry(const file_entry* file)
+{
+    for (const auto& cached : entry_cache) {
+        if (&cached.entry == file && cached.index != ~0u)
+            return &cached;
+    }
+
+    return nullptr;
+}
+
+#ifdef UNIT_TEST
+namespace mock {
+    const char* get_file_name(const file_entry* file)
+    {
+        const cached_entry* const cached = find_cached_entry(file);
+
+        return cached ? cached->name : nullptr;
+    }
+}
+#endif
+
+static bool ICACHE_FLASH_ATTR check_file(const file_entry* file)
+{
+    const uint32_t fs_size = data_end - data_begin;
+    const uint32_t offset  = file->offset;
+
+    if ((offset & 3u) || ! file->size || offset > fs_size || offset + file->size > fs_size) {
+        os_printf("Error: invalid file offset 0x%08x or size 0x%08x\n",
+                  file->offset, file->size);
+        return false;
+    }
+
+    if ((file->head_size & 3u) || file->head_size > max_file_head_size ||
+        file->head_size > file->offset) {
+        os_printf("Error: invalid file head size 0x%08x\n", file->head_size);
+        return false;
+    }
+
+    if ((file->splice & 3u) || file->splice > file->size) {
+        os_printf("Error: invalid file splice offset 0x%08x\n", file->splice);
+        return false;
+    }
+
+    return true;
+}
+
+// Returns index of a file in the directory or ~0u if the entry is not in the directory.
+static uint32_t ICACHE_FLASH_ATTR get_file_index(const file_entry* file)
+{
+    const cached_entry* const cached = find_cached_entry(file);
+
+    return cached ? cached->index : ~0u;
+}
+
+// Files which share data are verified together, so only the owner of the
+// data is marked as verified.
+static bool ICACHE_FLASH_ATTR is_verified(uint32_t index)
+{
+    if (index >= fs->num_files)
+        return false;
+
+    const uint32_t owner = get_data_owner(fs, index);
+
+    return verified_files[owner / 32u] & (1u << (owner % 32u));
+}
+
+static void ICACHE_FLASH_ATTR set_verified(uint32_t index, bool verified)
+{
+    if (index >= fs->num_files)
+        return;
+
+    const uint32_t owner = get_data_owner(fs, index);
+
+    if (verified)
+        verified_files[owner / 32u] |= 1u << (owner % 32u);
+    else
+        verified_files[owner / 32u] &= ~(1u << (owner % 32u));
+}
+
+char* ICACHE_FLASH_ATTR load_file(const file_entry* file, int size_in_front)
+{
+    if (!fs)
+        return nullptr;
+
+    if (size_in_front & 3)
+        return nullptr;
+
+    if ( ! check_file(file))
+        return nullptr;
+
+    const uint32_t offset = file->offset + fs_slots[active_slot];
+
+    const uint32_t alloc_size = size_in_front + ((file->size - 1u) & ~3u) + 4u;
+
+    char* const buf = static_cast<char*>(os_malloc(alloc_size));
+    if (!buf) {
+        os_printf("Error: failed to allocate memory\n");
+        return nullptr;
+    }
+
+    if (spi_flash_read(offset, reinterpret_cast<uint32_t*>(buf + size_in_front), file->size)
+            != SPI_FLASH_RESULT_OK) {
+        os_printf("Error: failed to read file\n");
+        os_free(buf);
+        return nullptr;
+    }
+
+    // Pad with zeroes for checksum
+    for (uint32_t i = size_in_front + file->size; i < alloc_size; i++)
+        buf[i] = 0;
+
+    const uint32_t index = get_file_index(file);
+
+    if (is_verified(index))
+        return buf;
+
+    const uint32_t checksum = calc_checksum(reinterpret_cast<uint32_t*>(buf + size_in_front),
+                                            reinterpret_cast<uint32_t*>(buf + alloc_size));
+    if (checksum != file->checksum) {
+        os_printf("Error: file checksum 0x%08x mismatch, expected 0x%08x\n",
+                  checksum, file->checksum);
+        os_free(buf);
+        return nullptr;
+    }
+
+    set_verified(index, true);
+
+    return buf;
+}
+
+// Opens the file at 'index' in the directory, see open_file().
+static int ICACHE_FLASH_ATTR open_entry(const file_entry* file, uint32_t index, file_stream* stream)
+{
+    if (!fs)
+        return 1;
+
+    if ( ! check_file(file))
+        return 1;
+
+    stream->file       = *file;
+    stream->begin      = 0u;
+    stream->pos        = 0u;
+    stream->size       = file->head_size + file->size;
+    stream->checksum   = 0u;
+    stream->index      = index;
+    stream->generation = fs_generation;
+    stream->verify     = ! is_verified(stream->index);
+    stream->mapped     = nullptr;
+
+    // Files can only be read directly if the entire filesystem is in the window
+    const uint32_t slot = fs_slots[active_slot];
+    if (slot + (data_end - data_begin) <= FLASH_MAP_SIZE)
+        stream->mapped = FLASH_MAP_BEGIN + slot + file->offset - file->head_size;
+
+    return 0;
+}
+
+int ICACHE_FLASH_ATTR open_file(const file_entry* file, file_stream* stream)
+{
+    return open_entry(file, get_file_index(file), stream);
+}
+
+int ICACHE_FLASH_ATTR open_file_range(const file_entry* file,
+                                      uint32_t          begin,
+                                      uint32_t          size,
+                                      file_stream*      stream)
+{
+    if (open_file(file, stream))
+        return 1;
+
+    if ( ! size || begin >= file->size || size > file->size - begin)
+        return 1;
+
+    // The file must have been verified as a whole, because the part which is
+    // read is not verified
+    if (stream->verify) {
+        const char* chunk = nullptr;
+
+        if (stream->mapped) {
+            if (map_file(stream, &chunk, sizeof(uint32_t)) < 0)
+                return 1;
+        }
+        else {
+            uint32_t buf[128];
+
+            int read_size;
+            do
+                read_size = read_file(stream, buf, sizeof(buf));
+            while (read_size > 0);
+
+            if (read_size < 0)
+                return 1;
+        }
+    }
+
+    stream->begin    = file->head_size + begin;
+    stream->pos      = 0u;
+    stream->size     = size;
+    stream->checksum = 0u;
+    stream->verify   = false;
+
+    return 0;
+}
+
+int ICACHE_FLASH_ATTR read_file(file_stream* stream, uint32_t* buf, uint32_t size)
+{
+    // The filesystem is being rewritten or has been rewritten
+    if (!fs || stream->generation != fs_generation)
+        return -1;
+
+    if ( ! size || (size & 3u))
+        return -1;
+
+    const file_entry& file = stream->file;
+
+    if (stream->pos >= stream->size)
+        return 0;
+
+    const uint32_t left      = stream->size - stream->pos;
+    const uint32_t file_pos  = stream->begin + stream->pos;
+    const uint32_t offset    = file.offset - file.head_size + fs_slots[active_slot] + file_pos;
+    const uint32_t skip      = offset & 3u;
+
+    // Flash can only be read at multiples of 4, which is where the HTTP response
+    // head and file data begin.  A part of a file which begins elsewhere is
+    // aligned by returning the rest of the first word on its own.
+    if (skip) {
+        if (stream->verify || file_pos < file.head_size)
+            return -1;
+
+        if (spi_flash_read(offset - skip, buf, sizeof(uint32_t)) != SPI_FLASH_RESULT_OK) {
+            os_printf("Error: failed to read file\n");
+            return -1;
+        }
+
+        const uint32_t part = left < sizeof(uint32_t) - skip ? left : sizeof(uint32_t) - skip;
+
+        char* const bytes = reinterpret_cast<char*>(buf);
+        for (uint32_t i = 0; i < sizeof(uint32_t); i++)
+            bytes[i] = i < part ? bytes[skip + i] : 0;
+
+        stream->pos += part;
+
+        return static_cast<int>(part);
+    }
+
+    const uint32_t read_size = left < size ? left : size;
+
+    if (spi_flash_read(offset, buf, read_size) != SPI_FLASH_RESULT_OK) {
+        os_printf("Error: failed to read file\n");
+        return -1;
+    }
+
+    const uint32_t aligned_size = ((read_size - 1u) & ~3u) + 4u;
+
+    // Pad with zeroes for checksum
+    char* const bytes = reinterpret_cast<char*>(buf);
+    for (uint32_t i = read_size; i < aligned_size; i++)
+        bytes[i] = 0;
+
+    const uint32_t* data = buf;
+
+    // HTTP response head has its own checksum, verify it once it has been read.
+    // Head size is a multiple of 4 and chunks start at multiples of 4.
+    if (file_pos < file.head_size) {
+        const uint32_t head_left = file.head_size - file_pos;
+        const uint32_t head_part = head_left < aligned_size ? head_left : aligned_size;
+
+        data = buf + head_part / sizeof(uint32_t);
+
+        stream->checksum += calc_checksum(buf, data);
+
+        if (head_part == head_left) {
+            if (stream->checksum != file.head_checksum) {
+                os_printf("Error: file head checksum 0x%08x mismatch, expected 0x%08x\n",
+                          stream->checksum, file.head_checksum);
+                return -1;
+            }
+
+            stream->checksum = 0u;
+        }
+    }
+
+    if (stream->verify)
+        stream->checksum += calc_checksum(data, buf + aligned_size / sizeof(uint32_t));
+
+    stream->pos += read_size;
+
+    if (stream->pos == stream->size && stream->verify) {
+
+        const bool ok = stream->checksum == file.checksum;
+
+        set_verified(stream->index, ok);
+
+        if ( ! ok) {
+            os_printf("Error: file checksum 0x%08x mismatch, expected 0x%08x\n",
+                      stream->checksum, file.checksum);
+            return -1;
+        }
+    }
+
+    return static_cast<int>(read_size);
+}
+
+int ICACHE_FLASH_ATTR map_file(file_stream* stream, const char** chunk, uint32_t size)
+{
+    // The filesystem is being rewritten or has been rewritten
+    if (!fs || stream->generation != fs_generation)
+        return -1;
+
+    if ( ! stream->mapped || ! size)
+        return -1;
+
+    const file_entry& file = stream->file;
+
+    if (stream->pos >= stream->size)
+        return 0;
+
+    // The mapped flash can only be read with 32-bit loads, which is fine, because
+    // the HTTP response head and file data are aligned to 4 bytes
+    if (stream->pos == 0 && stream->begin == 0) {
+        const uint32_t* const head = reinterpret_cast<const uint32_t*>(stream->mapped);
+        const uint32_t* const data = head + file.head_size / sizeof(uint32_t);
+
+        const uint32_t head_checksum = calc_checksum(head, data);
+        if (head_checksum != file.head_checksum) {
+            os_printf("Error: file head checksum 0x%08x mismatch, expected 0x%08x\n",
+                      head_checksum, file.head_checksum);
+            return -1;
+        }
+
+        if (stream->verify) {
+            const uint32_t* const end = data + file.size / sizeof(uint32_t);
+
+            uint32_t checksum = calc_checksum(data, end);
+
+            // Bytes past the end of file are assumed to be zeroes, like in read_file()
+            if (file.size & 3u)
+                checksum -= *end & ((1u << ((file.size & 3u) * 8u)) - 1u);
+
+            const bool ok = checksum == file.checksum;
+
+            set_verified(stream->index, ok);
+
+            if ( ! ok) {
+                os_printf("Error: file checksum 0x%08x mismatch, expected 0x%08x\n",
+                          checksum, file.checksum);
+                return -1;
+            }
+
+            stream->verify = false;
+        }
+    }
+
+    const uint32_t left       = stream->size - stream->pos;
+    const uint32_t chunk_size = left < size ? left : size;
+
+    *chunk = stream->mapped + stream->begin + stream->pos;
+
+    stream->pos += chunk_size;
+
+    return static_cast<int>(chunk_size);
+}
+
+// Number of bytes verified by each call to scrub_filesystem()
+constexpr uint32_t scrub_chunk_size = 512u;
+
+void ICACHE_FLASH_ATTR scrub_filesystem()
+{
+    if (!fs)
+        return;
+
+    // Start verifying the next file
+    if (scrub_stream.pos >= scrub_stream.size || scrub_stream.generation != fs_generation) {
+
+        if (scrub_index >= fs->num_files)
+            scrub_index = 0u;
+
+        const uint32_t index = scrub_index++;
+
+        // Shared data is verified with the first file which uses it
+        if (get_data_owner(fs, index) != index) {
+            scrub_stream.size = 0u;
+            return;
+        }
+
+        // The entry is read directly, so that the entry cache is left
+        // to find_file()
+        file_entry file;
+
+        if (read_index_entry(fs, index, &file) || open_entry(&file, index, &scrub_stream)) {
+            scrub_stream.size = 0u;
+            return;
+        }
+
+        scrub_stream.verify = true;
+    }
+
+    uint32_t buf[scrub_chunk_size / sizeof(uint32_t)];
+
+    if (read_file(&scrub_stream, buf, sizeof(buf)) < 0) {
+        os_printf("Error: file %u is corrupted\n", scrub_stream.index);
+        scrub_stream.size = 0u;
+    }
+}
+
+// Minimum amount of free heap which must remain after adding a file to the cache,
+// so that the SDK and lwIP have enough memory to handle connections.
+constexpr uint32_t file_cache_min_free_heap = 16u * 1024u;
+
+static void ICACHE_FLASH_ATTR evict_cached_file()
+{
+    // The least recently used file is at the end of the list
+    auto ptr = &file_cache;
+    while ((*ptr)->next)
+        ptr = &(*ptr)->next;
+
+    file_cache_used -= (*ptr)->alloc_size;
+
+    os_free(*ptr);
+    *ptr = nullptr;
+}
+
+static void ICACHE_FLASH_ATTR flush_file_cache()
+{
+    while (file_cache) {
+        const auto next = file_cache->next;
+        os_free(file_cache);
+        file_cache = next;
+    }
+
+    file_cache_used = 0u;
+}
+
+// Evicts files until 'size' more bytes fit in the cache and on the heap.
+static void ICACHE_FLASH_ATTR trim_file_cache(uint32_t size)
+{
+    while (file_cache &&
+           (file_cache_used + size > file_cache_max ||
+            system_get_free_heap_size() < file_cache_min_free_heap + size))
+        evict_cached_file();
+}
+
+void ICACHE_FLASH_ATTR set_file_cache_size(uint32_t max_size)
+{
+    file_cache_max = max_size;
+
+    trim_file_cache(0u);
+}
+
+const char* ICACHE_FLASH_ATTR find_cached_file(const file_entry* file)
+{
+    trim_file_cache(0u);
+
+    for (auto ptr = &file_cache; *ptr; ptr = &(*ptr)->next) {
+
+        const auto cached = *ptr;
+
+        if (cached->offset == file->offset) {
+
+            // Move to the front of the list
+            *ptr         = cached->next;
+            cached->next = file_cache;
+            file_cache   = cached;
+
+            return cached->data;
+        }
+    }
+
+    return nullptr;
+}
+
+void ICACHE_FLASH_ATTR cache_file(const file_entry* file, const void* data)
+{
+    if (!fs)
+        return;
+
+    const uint32_t size       = file->head_size + file->size;
+    const uint32_t alloc_size = sizeof(cached_file) - 1u + size;
+
+    if (alloc_size > file_cache_max || find_cached_file(file))
+        return;
+
+    trim_file_cache(alloc_size);
+
+    if (system_get_free_heap_size() < file_cache_min_free_heap + alloc_size)
+        return;
+
+    const auto cached = static_cast<cached_file*>(os_malloc(alloc_size));
+    if (!cached)
+        return;
+
+    cached->next       = file_cache;
+    cached->offset     = file->offset;
+    cached->alloc_size = alloc_size;
+    os_memcpy(cached->data, data, size);
+
+    file_cache       = cached;
+    file_cache_used += alloc_size;
+}
+
+// Writes one sector of flash, unless it already contains the same data.
+//
+// - addr - address of the sector
+// - data - new contents of the sector, the rest of the sector is left erased
+// - size - size of data, multiple of 4, at most sector size
+//
+// The sector is erased only if some bits must change from 0 to 1.  If only
+// 1 to 0 transitions are needed, e.g. when the sector is already erased,
+// the data is programmed without erasing the sector.
+//
+// Returns 0 on success or 1 on failure.
+static int ICACHE_FLASH_ATTR update_sector(uint32_t addr, const uint32_t* data, uint32_t size)
+{
+    bool same       = true;
+    bool need_erase = false;
+
+    uint32_t buf[64];
+
+    for (uint32_t pos = 0; pos < SPI_FLASH_SEC_SIZE && ! need_erase; pos += sizeof(buf)) {
+
+        if (spi_flash_read(addr + pos, buf, sizeof(buf)) != SPI_FLASH_RESULT_OK) {
+            need_erase = true;
+            break;
+        }
+
+        for (uint32_t i = 0; i < sizeof(buf) / sizeof(uint32_t); i++) {
+
+            const uint32_t offset    = pos + i * sizeof(uint32_t);
+            const uint32_t new_value = offset < size ? data[offset / sizeof(uint32_t)] : ~0u;
+
+            if (buf[i] != new_value) {
+                same = false;
+
+                if ((buf[i] & new_value) != new_value) {
+                    need_erase = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (same)
+        return 0;
+
+    if (need_erase) {
+        const uint32_t sector = addr / SPI_FLASH_SEC_SIZE;
+        os_printf("erase @0x%08x\n", addr);
+        if (spi_flash_erase_sector(sector) != SPI_FLASH_RESULT_OK) {
+            os_printf("Error: failed to erase sector %d\n", sector);
+            return 1;
+        }
+    }
+
+    if (size) {
+        os_printf("write @0x%08x size 0x%04x\n", addr, size);
+        if (spi_flash_write(addr, const_cast<uint32_t*>(data), size) != SPI_FLASH_RESULT_OK) {
+            os_printf("Error: failed to write 0x%x bytes at offset 0x%x\n", size, addr);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Writes data to consecutive sectors starting at 'addr', skipping sectors
+// which already contain the same data.
+static int ICACHE_FLASH_ATTR write_sectors(uint32_t addr, const char* data, int size)
+{
+    uint32_t buf[SPI_FLASH_SEC_SIZE / sizeof(uint32_t)];
+    uint32_t dest = addr;
+
+    do {
+        const int copy_size = size > static_cast<int>(sizeof(buf)) ? sizeof(buf) : size;
+
+        if (copy_size < static_cast<int>(sizeof(buf)))
+            buf[copy_size / sizeof(uint32_t)] = 0;
+
+        os_memcpy(buf, data, copy_size);
+
+        const uint32_t write_size = copy_size ? ((copy_size - 1u) & ~3u) + 4u : 0u;
+
+        if (update_sector(dest, buf, write_size))
+            return 1;
+
+        data += copy_size;
+        size -= copy_size;
+        dest += SPI_FLASH_SEC_SIZE;
+    } while (size > 0);
+
+    return 0;
+}
+
+// Returns the bitmap of sectors occupied by the uploaded filesystem image,
+// based on its directory.
+static uint32_t ICACHE_FLASH_ATTR get_upload_size_sectors()
+{
+    const uint32_t num_sectors = (upload_fs->image_size - 1u) / SPI_FLASH_SEC_SIZE + 1u;
+
+    return num_sectors >= 32u ? ~0u : ((1u << num_sectors) - 1u);
+}
+
+// Returns the bitmap of sectors occupied by the directory of the uploaded
+// filesystem image, or 0 if the header of the directory is invalid.
+static uint32_t ICACHE_FLASH_ATTR get_directory_sectors()
+{
+    filesystem hdr;
+    if (read_directory_header(fs_slots[upload_slot], &hdr))
+        return 0u;
+
+    const uint32_t num_sectors = (hdr.dir_size - 1u) / SPI_FLASH_SEC_SIZE + 1u;
+
+    return num_sectors >= 32u ? ~0u : ((1u << num_sectors) - 1u);
+}
+
+// Erase-ahead pipeline.
+//
+// Erasing a sector takes tens of milliseconds, while programming it takes
+// only a few.  When the sectors which will be uploaded are known in advance,
+// see begin_fs_update(), they are erased from a timer while their data is
+// still being received, so that writes from the receive callback only need
+// to program the sectors.  Each timer callback erases at most one sector,
+// which keeps the time spent in the callback well below the watchdog timeout
+// and lets the SDK handle network traffic between the erases.
+
+// Interval between erase steps
+constexpr uint32_t erase_ahead_interval_ms = 5u;
+
+static void ICACHE_FLASH_ATTR stop_erase_ahead()
+{
+    os_timer_disarm(&erase_timer);
+    erase_sectors = 0u;
+}
+
+// Returns true if the sector at 'addr' is erased.
+static bool ICACHE_FLASH_ATTR is_sector_erased(uint32_t addr)
+{
+    uint32_t buf[64];
+
+    for (uint32_t pos = 0; pos < SPI_FLASH_SEC_SIZE; pos += sizeof(buf)) {
+
+        if (spi_flash_read(addr + pos, buf, sizeof(buf)) != SPI_FLASH_RESULT_OK)
+            return false;
+
+        for (const uint32_t value : buf) {
+            if (value != ~0u)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// Erases the next sector which has been scheduled for erasing and which has
+// not been written yet.
+static void ICACHE_FLASH_ATTR erase_ahead(void*)
+{
+    for (;;) {
+        const uint32_t pending = uploading ? (erase_sectors & ~upload_sectors) : 0u;
+
+        if ( ! pending) {
+            stop_erase_ahead();
+            return;
+        }
+
+        // Data is uploaded in ascending order, so the first sector is needed first
+        uint32_t sector = 0u;
+        while ( ! (pending & (1u << sector)))
+            ++sector;
+
+        erase_sectors &= ~(1u << sector);
+
+        const uint32_t addr = fs_slots[upload_slot] + sector * SPI_FLASH_SEC_SIZE;
+
+        // Erasing a sector which is already erased would only wear it
+        if (is_sector_erased(addr))
+            continue;
+
+        // On failure, the sector is erased again when it is written
+        if (spi_flash_erase_sector(addr / SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK)
+            os_printf("Error: failed to erase sector %u\n", addr / SPI_FLASH_SEC_SIZE);
+
+        return;
+    }
+}
+
+static void ICACHE_FLASH_ATTR abort_upload()
+{
+    if (upload_fs) {
+        os_free(upload_fs);
+        upload_fs = nullptr;
+    }
+
+    uploading = false;
+
+    stop_erase_ahead();
+}
+
+// Returns the slot to which the next upload will be written.
+static uint32_t ICACHE_FLASH_ATTR get_upload_slot()
+{
+    return num_fs_slots < 2u ? active_slot : (active_slot ^ 1u);
+}
+
+static void ICACHE_FLASH_ATTR start_upload()
+{
+    abort_upload();
+
+    // Without the second slot, the filesystem is rewritten in place
+    if (num_fs_slots < 2u) {
+        flush_file_cache();
+        flush_entry_cache();
+
+        ++fs_generation;
+
+        if (fs) {
+            os_free(fs);
+            fs = nullptr;
+        }
+    }
+
+    upload_slot    = get_upload_slot();
+    upload_sectors = 0u;
+    uploading      = true;
+}
+
+static int ICACHE_FLASH_ATTR write_upload(unsigned offset, const char* data, int size)
+{
+    if (offset % SPI_FLASH_SEC_SIZE) {
+        os_printf("Error: invalid offset 0x%08x\n", offset);
+        return 1;
+    }
+
+    const uint32_t data_size = data_end - data_begin;
+    if (offset > data_size || offset + size > data_size) {
+        os_printf("Error: data overflows allocated space in flash, offset 0x%08x size 0x%08x\n",
+                  offset, size);
+        return 1;
+    }
+
+    if (write_sectors(fs_slots[upload_slot] + offset, data, size)) {
+        abort_upload();
+        return 1;
+    }
+
+    const uint32_t first_sector = offset / SPI_FLASH_SEC_SIZE;
+    const uint32_t end_sector   = first_sector + ((size - 1) / SPI_FLASH_SEC_SIZE) + 1;
+
+    for (uint32_t sector = first_sector; sector < end_sector; sector++)
+        upload_sectors |= 1u << sector;
+
+    return 0;
+}
+
+// In-stream verification of images uploaded with write_fs().
+//
+// The image is received in order, directory first.  The checksums of the
+// directory and of each file are accumulated from the received data, so once
+// the last sector has been written, the image is known to be valid without
+// reading it back from flash.  A corrupted file is detected as soon as its
+// last byte has been received.  If the data is not received in order, the
+// files are verified from flash by commit_upload() instead.
+
+static void ICACHE_FLASH_ATTR start_upload_check()
+{
+    check.in_order     = true;
+    check.pos          = 0u;
+    check.dir_size     = 0u;
+    check.dir_checksum = 0u;
+    check.file         = ~0u;
+    check.checksum     = 0u;
+    check.num_verified = 0u;
+}
+
+// Returns the 32-bit word at 'pos' in 'data', padded with zeroes past 'size'.
+static uint32_t ICACHE_FLASH_ATTR get_data_word(const char* data, uint32_t size, uint32_t pos)
+{
+    uint32_t value = 0u;
+    os_memcpy(&value, data + pos, size - pos < 4u ? size - pos : 4u);
+    return value;
+}
+
+// Adds the part of the directory contained in the received data to its checksum.
+static void ICACHE_FLASH_ATTR check_directory_data(uint32_t offset, const char* data, uint32_t size)
+{
+    if ( ! check.in_order)
+        return;
+
+    if (offset != check.pos || ( ! offset && size < sizeof(filesystem))) {
+        check.in_order = false;
+        return;
+    }
+
+    if ( ! offset)
+        check.dir_size = get_data_word(data, size, offsetof(filesystem, dir_size));
+
+    constexpr uint32_t skip = 2u * sizeof(uint32_t); // magic and checksum
+
+    const uint32_t begin = offset > skip ? offset : skip;
+    const uint32_t end   = offset + size < check.dir_size ? offset + size : check.dir_size;
+
+    for (uint32_t pos = begin; pos < end; pos += 4u)
+        check.dir_checksum -= get_data_word(data, size, pos - offset);
+}
+
+// Finds the file whose data follows 'pos' in the uploaded image.
+//
+// Returns false if there are no more files.
+static bool ICACHE_FLASH_ATTR find_next_checked_file(uint32_t pos)
+{
+    uint32_t next = ~0u;
+
+    // Files which share data have the same offset, the first of them is found
+    for (uint32_t i = 0; i < upload_fs->num_files; i++) {
+        const uint32_t file_offset = upload_fs->index[i].offset;
+
+        if (file_offset != ~0u && file_offset >= pos &&
+            (next == ~0u || file_offset < upload_fs->index[next].offset))
+            next = i;
+    }
+
+    if (next == ~0u)
+        return false;
+
+    // Files which are not laid out in order are verified from flash
+    if (read_index_entry(upload_fs, next, &check.entry) || ! check_file(&check.entry) ||
+        check.entry.offset - check.entry.head_size < pos) {
+        check.in_order = false;
+        return false;
+    }
+
+    check.file     = next;
+    check.checksum = 0u;
+    return true;
+}
+
+// Adds the file data contained in the received data to the checksums of files.
+//
+// Returns 0 on success or 1 if a file is corrupted.
+static int ICACHE_FLASH_ATTR check_file_data(uint32_t offset, const char* data, uint32_t size)
+{
+    if ( ! check.in_order)
+        return 0;
+
+    const uint32_t end = offset + size;
+    uint32_t       pos = offset;
+
+    while (pos < end) {
+
+        if (check.file == ~0u && ! find_next_checked_file(pos))
+            break;
+
+        const file_entry& file       = check.entry;
+        const uint32_t    head_begin = file.offset - file.head_size;
+        const uint32_t    data_end   = file.offset + file.size;
+
+        // Skip padding between files
+        if (pos < head_begin)
+            pos = head_begin;
+
+        for ( ; pos < file.offset && pos < end; pos += 4u)
+            check.checksum -= get_data_word(data, size, pos - offset);
+
+        if (pos == file.offset && file.head_size) {
+            if (check.checksum != file.head_checksum) {
+                os_printf("Error: uploaded file %u is corrupted\n", check.file);
+                return 1;
+            }
+            check.checksum = 0u;
+        }
+
+        for ( ; pos < data_end && pos < end; pos += 4u) {
+            uint32_t value = get_data_word(data, size, pos - offset);
+
+            // Bytes past the end of the file are not included in the checksum
+            if (data_end - pos < 4u)
+                value &= (1u << ((data_end - pos) * 8u)) - 1u;
+
+            check.checksum -= value;
+        }
+
+        if (pos < data_end)
+            break;
+
+        if (check.checksum != file.checksum) {
+            os_printf("Error: uploaded file %u is corrupted\n", check.file);
+            return 1;
+        }
+
+        check.file = ~0u;
+        ++check.num_verified;
+    }
+
+    return 0;
+}
+
+// Returns true if all files of the uploaded filesystem have been verified
+// while they were being received.
+static bool ICACHE_FLASH_ATTR is_upload_checked()
+{
+    if ( ! check.in_order)
+        return false;
+
+    uint32_t num_files = 0u;
+
+    for (uint32_t i = 0; i < upload_fs->num_files; i++) {
+        if (upload_fs->index[i].offset != ~0u && get_data_owner(upload_fs, i) == i)
+            ++num_files;
+    }
+
+    return check.num_verified == num_files;
+}
+
+// Writes a commit record which makes 'slot' active.
+//
+// The record is written to the copy which does not hold the latest record,
+// so the latest record is not lost if the write is interrupted.
+//
+// Returns 0 on success or 1 on failure.
+static int ICACHE_FLASH_ATTR write_commit_record(uint32_t slot)
+{
+    fs_commit_record latest;
+    const uint32_t   latest_copy = read_commit_record(&latest);
+
+    fs_commit_record record = { FS_COMMIT_MAGIC, slot, 0u, 0u };
+    uint32_t         copy   = 0u;
+
+    if (latest_copy != ~0u) {
+        record.sequence = latest.sequence + 1u;
+        copy            = (latest_copy + 1u) % num_commit_copies;
+    }
+
+    record.checksum = calc_checksum(&record.magic, &record.checksum);
+
+    return write_sectors(commit_addr + copy * SPI_FLASH_SEC_SIZE,
+                         reinterpret_cast<const char*>(&record), sizeof(record));
+}
+
+// Verifies all files of the uploaded filesystem and makes it active.
+static int ICACHE_FLASH_ATTR commit_upload()
+{
+    const uint32_t base = fs_slots[upload_slot];
+
+    // Files which have been verified while they were received are not read back
+    const uint32_t num_files = is_upload_checked() ? 0u : upload_fs->num_files;
+
+    for (uint32_t i = 0; i < num_files; i++) {
+
+        // Shared data has already been verified
+        if (get_data_owner(upload_fs, i) != i)
+            continue;
+
+        file_entry file;
+        if (read_index_entry(upload_fs, i, &file)) {
+            abort_upload();
+            return 1;
+        }
+
+        // Empty files cannot be read, so there is nothing to verify
+        if ( ! file.size)
+            continue;
+
+        uint32_t head_checksum = 0u;
+        uint32_t checksum      = 0u;
+
+        if ( ! check_file(&file) ||
+             ! checksum_flash(base + file.offset - file.head_size, file.head_size, &head_checksum) ||
+             ! checksum_flash(base + file.offset, file.size, &checksum)) {
+            abort_upload();
+            return 1;
+        }
+
+        if (head_checksum != file.head_checksum || checksum != file.checksum) {
+            os_printf("Error: uploaded file %u is corrupted\n", i);
+            abort_upload();
+            return 1;
+        }
+    }
+
+    // Without the second slot, the filesystem has been rewritten in place
+    if (num_fs_slots >= 2u && write_commit_record(upload_slot)) {
+        abort_upload();
+        return 1;
+    }
+
+    // Switch to the new filesystem
+    flush_file_cache();
+    flush_entry_cache();
+
+    ++fs_generation;
+
+    if (fs)
+        os_free(fs);
+
+    fs          = upload_fs;
+    upload_fs   = nullptr;
+    uploading   = false;
+    active_slot = upload_slot;
+
+    stop_erase_ahead();
+
+    // All files have just been verified
+    for (uint32_t i = 0; i < fs->num_files; i++)
+        set_verified(i, true);
+
+    os_printf("switched to filesystem slot %u\n", active_slot);
+    return 0;
+}
+
+int ICACHE_FLASH_ATTR write_fs(unsigned offset, const char* data, int size)
+{
+    if (offset == 0) {
+        start_upload();
+        start_upload_check();
+    }
+
+    else if ( ! uploading) {
+        os_printf("Error: filesystem upload not started\n");
+        return 1;
+    }
+
+    if (write_upload(offset, data, size))
+        return 1;
+
+    check_directory_data(offset, data, size);
+
+    if ( ! upload_fs) {
+        const uint32_t dir_sectors = get_directory_sectors();
+
+        if ( ! dir_sectors) {
+            abort_upload();
+            return 1;
+        }
+
+        // The directory can span several sectors, wait until all of them have been written
+        if ((upload_sectors & dir_sectors) != dir_sectors) {
+            check.pos = offset + size;
+            return 0;
+        }
+
+        upload_fs = load_directory(fs_slots[upload_slot], check.in_order ? &check.dir_checksum : nullptr);
+        if ( ! upload_fs) {
+            abort_upload();
+            return 1;
+        }
+    }
+
+    if (check_file_data(offset, data, size)) {
+        abort_upload();
+        return 1;
+    }
+
+    check.pos = offset + size;
+
+    // Switch to the new filesystem once all of its sectors have been written
+    const uint32_t image_sectors = get_upload_size_sectors();
+
+    if ((upload_sectors & image_sectors) != image_sectors)
+        return 0;
+
+    return commit_upload();
+}
+
+int ICACHE_FLASH_ATTR begin_fs_update(uint32_t sectors)
+{
+    start_upload();
+
+    // Sectors can be uploaded in any order, files are verified from flash on commit
+    check.in_order = false;
+
+    const uint32_t num_sectors = (data_end - data_begin) / SPI_FLASH_SEC_SIZE;
+
+    erase_sectors = sectors & (num_sectors >= 32u ? ~0u : ((1u << num_sectors) - 1u));
+
+    if (erase_sectors) {
+        os_timer_setfn(&erase_timer, erase_ahead, nullptr);
+        os_timer_arm(&erase_timer, erase_ahead_interval_ms, true);
+    }
+
+    return 0;
+}
+
+int ICACHE_FLASH_ATTR update_fs(unsigned offset, const char* data, int size)
+{
+    if ( ! uploading) {
+        os_printf("Error: filesystem update not started\n");
+        return 1;
+    }
+
+    return write_upload(offset, data, size);
+}
+
+int ICACHE_FLASH_ATTR commit_fs_update(uint32_t copy_sectors)
+{
+    if ( ! uploading) {
+        os_printf("Error: filesystem update not started\n");
+        return 1;
+    }
+
+    // Copy sectors which have not changed from the active filesystem,
+    // without the second slot they are already in place
+    copy_sectors &= num_fs_slots < 2u ? 0u : ~upload_sectors;
+
+    if (copy_sectors) {
+
+        uint32_t* const buf = static_cast<uint32_t*>(os_malloc(SPI_FLASH_SEC_SIZE));
+        if ( ! buf) {
+            os_printf("Error: failed to allocate memory\n");
+            abort_upload();
+            return 1;
+        }
+
+        for (uint32_t sector = 0; sector < max_fs_sectors; sector++) {
+
+            if ( ! (copy_sectors & (1u << sector)))
+                continue;
+
+            const uint32_t offset = sector * SPI_FLASH_SEC_SIZE;
+
+            if (spi_flash_read(fs_slots[active_slot] + offset, buf, SPI_FLASH_SEC_SIZE)
+                    != SPI_FLASH_RESULT_OK) {
+                os_printf("Error: failed to read sector 0x%08x\n", fs_slots[active_slot] + offset);
+                abort_upload();
+                os_free(buf);
+                return 1;
+            }
+
+            if (write_upload(offset, reinterpret_cast<const char*>(buf), SPI_FLASH_SEC_SIZE)) {
+                os_free(buf);
+                return 1;
+            }
+        }
+
+        os_free(buf);
+    }
+
+    if (upload_fs)
+        os_free(upload_fs);
+
+    upload_fs = load_directory(fs_slots[upload_slot]);
+    if ( ! upload_fs) {
+        abort_upload();
+        return 1;
+    }
+
+    return commit_upload();
+}
+
+int ICACHE_FLASH_ATTR get_fs_sector_hash(bool upload_slot_hash, uint32_t sector, uint32_t* hash)
+{
+    if (sector >= max_fs_sectors || (sector + 1u) * SPI_FLASH_SEC_SIZE > data_end - data_begin)
+        return 1;
+
+    const uint32_t slot = upload_slot_hash ? get_upload_slot() : active_slot;
+    uint32_t       addr = fs_slots[slot] + sector * SPI_FLASH_SEC_SIZE;
+
+    uint32_t value = fnv1a_basis;
+
+    uint32_t buf[128];
+
+    for (uint32_t left = SPI_FLASH_SEC_SIZE; left; left -= sizeof(buf)) {
+
+        if (spi_flash_read(addr, buf, sizeof(buf)) != SPI_FLASH_RESULT_OK) {
+            os_printf("Error: failed to read sector 0x%08x\n", addr);
+            return 1;
+        }
+
+        value = fnv1a(value, buf, sizeof(buf));
+
+        addr += sizeof(buf);
+    }
+
+    *hash = value;
+    return 0;
+}
+
+static uint32_t ICACHE_FLASH_ATTR calc_config_checksum(config_base* config)
+{
+    return calc_checksum(&config->checksum + 1, &config->checksum + (config->size / 4u));
+}
+
+static bool ICACHE_FLASH_ATTR is_valid_config_size(uint32_t size)
+{
+    return size >= sizeof(config_base) && size <= SPI_FLASH_SEC_SIZE && ! (size % 4u);
+}
+
+static bool ICACHE_FLASH_ATTR verify_config(config_base* config)
+{
+    if (config->id == ~0u && config->checksum == ~0u)
+        return true;
+
+    if (config->magic != CONFIG_MAGIC) {
+        os_printf("Error: unknown log entry format 0x%08x\n", config->magic);
+        return false;
+    }
+
+    if ( ! is_valid_config_size(config->size)) {
+        os_printf("Error: invalid log entry size 0x%x\n", config->size);
+        return false;
+    }
+
+    const uint32_t checksum = calc_config_checksum(config);
+
+    if (checksum != config->checksum) {
+        os_printf("Error: invalid log entry checksum 0x%08x, expected 0x%08x\n",
+                  config->checksum, checksum);
+        return false;
+    }
+
+    return true;
+}
+
+static bool ICACHE_FLASH_ATTR read_config(uint32_t addr, config_base* config)
+{
+    if (spi_flash_read(addr, &config->checksum, SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK) {
+        os_printf("Error: failed to read log from 0x%08x\n", addr);
+        return false;
+    }
+
+    return verify_config(config);
+}
+
+// Older firmware stored a shorter header, without 'magic' and 'size', and the
+// checksum covered the entire sector.
+static constexpr uint32_t legacy_config_header_size = offsetof(config_base, magic);
+
+static bool ICACHE_FLASH_ATTR is_legacy_config(config_base* config)
+{
+    return config->id != ~0u &&
+           config->checksum == calc_checksum(&config->checksum + 1,
+                                             &config->checksum + (SPI_FLASH_SEC_SIZE / 4u));
+}
+
+// Moves the data of a sector written by older firmware after config_base, so
+// that the caller can convert it.  The end of the sector held the old log,
+// which is not kept.
+static void ICACHE_FLASH_ATTR convert_legacy_config(config_base* config)
+{
+    uint8_t* const data = reinterpret_cast<uint8_t*>(config);
+
+    os_memmove(data + sizeof(config_base),
+               data + legacy_config_header_size,
+               SPI_FLASH_SEC_SIZE - sizeof(config_base));
+
+    config->magic = legacy_config_magic;
+    config->size  = 0u;
+}
+
+// Number of sectors before the last one which are searched for a valid
+// configuration if the last sector is corrupted
+static constexpr uint32_t max_config_fallback = 8u;
+
+// Finds the newest valid log/configuration sector at or before 'addr', which
+// holds the last sector, whose header is 'last', but which failed verification,
+// e.g. because its write was interrupted by power loss or because it has been
+// written by older firmware.  The sector found is read into 'config'.
+//
+// Returns address of the sector or ~0u if no valid sector has been found.
+static uint32_t ICACHE_FLASH_ATTR find_valid_config(uint32_t addr, const config_base& last, config_base* config)
+{
+    if (last.id == ~0u)
+        return ~0u;
+
+    for (uint32_t i = 0; i <= max_config_fallback && i <= last.id && i < get_num_log_sectors(); i++) {
+
+        if (i) {
+            if (addr == log_begin)
+                addr = log_end;
+            addr -= SPI_FLASH_SEC_SIZE;
+        }
+
+        if (spi_flash_read(addr, &config->checksum, SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK) {
+            os_printf("Error: failed to read log from 0x%08x\n", addr);
+            return ~0u;
+        }
+
+        // Ids of consecutive sectors are consecutive, otherwise the sector is
+        // left over from an older log
+        if (config->id != last.id - i)
+            return ~0u;
+
+        if (is_legacy_config(config)) {
+            convert_legacy_config(config);
+            return addr;
+        }
+
+        if (i && config->magic == CONFIG_MAGIC && verify_config(config))
+            return addr;
+    }
+
+    return ~0u;
+}
+
+// Reads only the header of the log/configuration sector at 'addr', without
+// verifying its checksum.
+static bool ICACHE_FLASH_ATTR read_config_header(uint32_t addr, config_base* header)
+{
+    if (spi_flash_read(addr, &header->checksum, sizeof(config_base)) != SPI_FLASH_RESULT_OK) {
+        os_printf("Error: failed to read log from 0x%08x\n", addr);
+        return false;
+    }
+
+    return true;
+}
+
+uint32_t ICACHE_FLASH_ATTR get_num_log_sectors()
+{
+    return (log_end - log_begin) / SPI_FLASH_SEC_SIZE;
+}
+
+static config_base* ICACHE_FLASH_ATTR load_config_sector(int idx)
+{
+    const uint32_t num_log_sectors = get_num_log_sectors();
+
+    int sec_idx = (cfg_addr - log_begin) / SPI_FLASH_SEC_SIZE + idx;
+    sec_idx %= static_cast<int>(num_log_sectors);
+    if (sec_idx < 0)
+        sec_idx += num_log_sectors;
+
+    const uint32_t addr = sec_idx * SPI_FLASH_SEC_SIZE + log_begin;
+
+    if (addr == cfg_addr)
+        return cfg;
+
+    if ( ! cfg_aux)
+        cfg_aux = static_cast<config_base*>(os_malloc(SPI_FLASH_SEC_SIZE));
+
+    if ( ! read_config(addr, cfg_aux))
+        return nullptr;
+
+    return cfg_aux;
+}
+
+static bool ICACHE_FLASH_ATTR same_config_header(const config_base& a, const config_base& b)
+{
+    return a.checksum        == b.checksum        &&
+           a.id              == b.id              &&
+           a.timestamp       == b.timestamp       &&
+           a.first_timestamp == b.first_timestamp &&
+           a.magic           == b.magic           &&
+           a.size            == b.size;
+}
+
+static void ICACHE_FLASH_ATTR save_config_location()
+{
+    cfg_rtc_record record = { CFG_RTC_MAGIC, cfg_addr, cfg_last, 0u };
+    record.checksum = calc_checksum(&record.magic, &record.checksum);
+
+    if ( ! system_rtc_mem_write(cfg_rtc_block, &record, sizeof(record)))
+        os_printf("Error: failed to write RTC memory\n");
+}
+
+// Returns address of the last log/configuration sector remembered in RTC memory,
+// or ~0u if there is no valid record or the log has changed since it was saved.
+static uint32_t ICACHE_FLASH_ATTR load_config_location()
+{
+    cfg_rtc_record record;
+    if ( ! system_rtc_mem_read(cfg_rtc_block, &record, sizeof(record)))
+        return ~0u;
+
+    if (record.magic != CFG_RTC_MAGIC ||
+        record.checksum != calc_checksum(&record.magic, &record.checksum) ||
+        record.addr < log_begin || record.addr >= log_end ||
+        record.addr % SPI_FLASH_SEC_SIZE)
+        return ~0u;
+
+    config_base header;
+    if ( ! read_config_header(record.addr, &header) || ! same_config_header(header, record.last))
+        return ~0u;
+
+    // If the device was reset after writing the next sector, but before the
+    // record was updated, the record is stale
+    uint32_t next_addr = record.addr + SPI_FLASH_SEC_SIZE;
+    if (next_addr >= log_end)
+        next_addr = log_begin;
+
+    if ( ! read_config_header(next_addr, &header) || (header.id != ~0u && header.id > record.last.id))
+        return ~0u;
+
+    return record.addr;
+}
+
+// Returns address of the last log/configuration sector, log_end if the log
+// is empty or ~0u on failure.
+static uint32_t ICACHE_FLASH_ATTR find_last_config()
+{
+    // The search compares only ids of the sectors, so only their headers are read
+    config_base low;
+    config_base mid;
+    config_base high;
+
+    uint32_t low_addr  = log_begin;
+    uint32_t high_addr = log_end - SPI_FLASH_SEC_SIZE;
+
+    if (!read_config_header(low_addr, &low))
+        return ~0u;
+
+    if (low.id == ~0u)
+        low_addr = log_end; // First entry will be saved at log_begin
+
+    else {
+
+        if (!read_config_header(high_addr, &high))
+            return ~0u;
+
+        while (low_addr < high_addr) {
+
+            if (high.id != ~0u && high.id > low.id) {
+                low      = high;
+                low_addr = high_addr;
+                break;
+            }
+
+            if (low_addr + SPI_FLASH_SEC_SIZE == high_addr)
+                break;
+
+            const uint32_t mid_addr = ((low_addr + high_addr) / (2u * SPI_FLASH_SEC_SIZE))
+                                      * SPI_FLASH_SEC_SIZE;
+
+            if (!read_config_header(mid_addr, &mid))
+                return ~0u;
+
+            if (mid.id == ~0u || mid.id < low.id) {
+                high      = mid;
+                high_addr = mid_addr;
+            }
+            else {
+                low       = mid;
+                low_addr  = mid_addr;
+            }
+        }
+    }
+
+    return low_addr;
+}
+
+config_base* ICACHE_FLASH_ATTR load_config(int idx)
+{
+    if (log_begin >= log_end) {
+        os_printf("Error: config area not available\n");
+        return nullptr;
+    }
+
+    if (idx != 0) {
+        if ( ! cfg) {
+            os_printf("Error: config not initialized\n");
+            return nullptr;
+        }
+
+        return load_config_sector(idx);
+    }
+
+    if (cfg)
+        return cfg;
+
+    uint32_t addr = load_config_location();
+
+    if (addr == ~0u) {
+        addr = find_last_config();
+        if (addr == ~0u)
+            return nullptr;
+    }
+
+    config_base* const config = static_cast<config_base*>(os_malloc(SPI_FLASH_SEC_SIZE));
+
+    if ( ! config) {
+        os_printf("Error: failed to allocate memory\n");
+        return nullptr;
+    }
+
+    // Only the sector which has been found is read in full and verified
+    if ( ! read_config(addr < log_end ? addr : log_begin, config)) {
+
+        // The header is needed to continue the log after the sector
+        if ( ! read_config_header(addr, config)) {
+            os_free(config);
+            return nullptr;
+        }
+
+        const config_base last = *config;
+
+        // The configuration is recovered from the sector if it has been written
+        // by older firmware, or from a previous sector if it is corrupted.
+        // The next save continues the log after the sector found, so it
+        // replaces a corrupted sector.
+        const uint32_t valid_addr = addr < log_end ? find_valid_config(addr, last, config) : ~0u;
+
+        if (valid_addr != ~0u) {
+            if (valid_addr != addr)
+                os_printf("Error: discarding log at 0x%08x\n", addr);
+
+            cfg      = config;
+            cfg_addr = valid_addr;
+            cfg_last = *config;
+            return cfg;
+        }
+
+        // The configuration is reset and a new log is started after the sector,
+        // with ids following its id, so that the last sector can still be found.
+        // The daily write limit also continues from its first timestamp.
+        os_printf("Error: discarding log at 0x%08x\n", addr);
+
+        cfg_last       = last;
+        cfg_last.magic = 0u;
+        cfg_last.size  = 0u;
+
+        os_memset(config, 0xFF, SPI_FLASH_SEC_SIZE);
+
+        cfg      = config;
+        cfg_addr = addr;
+        return cfg;
+    }
+
+    cfg      = config;
+    cfg_addr = addr;
+
+    if (addr < log_end) {
+        cfg_last = *config;
+        save_config_location();
+    }
+
+    return cfg;
+}
+
+bool ICACHE_FLASH_ATTR writing_too_fast(uint32_t timestamp, uint32_t first_timestamp, uint32_t id)
+{
+    if (timestamp == first_timestamp && ! id)
+        return false;
+
+    if (timestamp <= first_timestamp || id == ~0u)
+        return true;
+
+    // Add sec_per_day to allow max writes on the first day
+    const uint32_t total_lifetime = timestamp - first_timestamp + sec_per_day;
+
+    const uint32_t cur_writes_per_day = static_cast<uint32_t>(
+            (static_cast<uint64_t>(id) * sec_per_day) / total_lifetime);
+
+    return cur_writes_per_day > max_writes_per_day;
+}
+
+static int ICACHE_FLASH_ATTR write_config_sector(config_base* config, uint32_t size)
+{
     uint32_t write_addr = cfg_addr + SPI_FLASH_SEC_SIZE;
 
     if (write_addr >= log_end)
@@ -513,33 +2461,32 @@ static int ICACHE_FLASH_ATTR write_config_sector(config_base* config)
         return 1;
     }
 
-    os_printf("erase @0x%08x\n", write_addr);
-    const uint32_t sector = write_addr / SPI_FLASH_SEC_SIZE;
-    if (spi_flash_erase_sector(sector) != SPI_FLASH_RESULT_OK) {
-        os_printf("Error: failed to erase sector %d\n", sector);
+    if (update_sector(write_addr, &config->checksum, size))
         return 1;
-    }
 
-    os_printf("write @0x%08x size 0x%04x\n", write_addr, SPI_FLASH_SEC_SIZE);
-    if (spi_flash_write(write_addr, &config->checksum, SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK) {
-        os_printf("Error: failed to write 0x%x bytes at offset 0x%x\n",
-                  SPI_FLASH_SEC_SIZE, write_addr);
-        return 1;
-    }
+    // The buffer reflects what is now stored in flash
+    os_memset(reinterpret_cast<uint8_t*>(config) + size, 0xFF, SPI_FLASH_SEC_SIZE - size);
 
     cfg_addr = write_addr;
     cfg_last = *config;
 
+    save_config_location();
+
     return 0;
 }
 
-int ICACHE_FLASH_ATTR save_config(config_base* config)
+int ICACHE_FLASH_ATTR save_config(config_base* config, uint32_t size)
 {
     if (!cfg) {
         os_printf("Error: config not initialized\n");
         return 1;
     }
 
+    if ( ! is_valid_config_size(size)) {
+        os_printf("Error: invalid config size 0x%x\n", size);
+        return 1;
+    }
+
     const uint32_t timestamp = sntp_get_current_timestamp();
 
     if ( ! timestamp && ! cfg_last.timestamp) {
@@ -562,6 +2509,8 @@ int ICACHE_FLASH_ATTR save_config(config_base* config)
     // Note that we don't allow timestamps to go back, so if someone spoofs NTP, we will
     // still reach daily write limit and we won't kill the flash.
     config->timestamp = timestamp >= cfg_last.timestamp ? timestamp : cfg_last.timestamp;
+    config->magic     = CONFIG_MAGIC;
+    config->size      = size;
     config->checksum  = calc_config_checksum(config);
 
     if (writing_too_fast(config->timestamp, config->first_timestamp, config->id)) {
@@ -569,5 +2518,66 @@ int ICACHE_FLASH_ATTR save_config(config_base* config)
         return 1;
     }
 
-    return write_config_sector(config);
+    return write_config_sector(config, size);
+}
+
+bool ICACHE_FLASH_ATTR is_config_modified(uint32_t size)
+{
+    if ( ! cfg || cfg_addr >= log_end || cfg_last.size != size)
+        return true;
+
+    // The sector is read back in small pieces instead of keeping a copy in RAM
+    uint32_t buf[16];
+
+    for (uint32_t pos = sizeof(config_base); pos < size; pos += sizeof(buf)) {
+
+        const uint32_t chunk_size = size - pos < sizeof(buf) ? size - pos : sizeof(buf);
+
+        if (spi_flash_read(cfg_addr + pos, buf, chunk_size) != SPI_FLASH_RESULT_OK)
+            return true;
+
+        if (os_memcmp(buf, reinterpret_cast<const uint8_t*>(cfg) + pos, chunk_size))
+            return true;
+    }
+
+    return false;
+}
+
+int ICACHE_FLASH_ATTR append_config(uint32_t offset, const void* data, uint32_t size)
+{
+    if ( ! cfg || cfg_addr >= log_end) {
+        os_printf("Error: config not initialized\n");
+        return 1;
+    }
+
+    if (cfg_last.magic != CONFIG_MAGIC) {
+        os_printf("Error: config must be saved before appending\n");
+        return 1;
+    }
+
+    if (offset < cfg->size || offset > SPI_FLASH_SEC_SIZE || size > SPI_FLASH_SEC_SIZE - offset ||
+        (offset % 4u) || (size % 4u)) {
+        os_printf("Error: invalid config append offset 0x%x size 0x%x\n", offset, size);
+        return 1;
+    }
+
+    uint32_t* const dest = &cfg->checksum + offset / 4u;
+
+    for (uint32_t i = 0; i < size / 4u; i++) {
+        if (dest[i] != ~0u) {
+            os_printf("Error: config offset 0x%x is not erased\n", offset + i * 4u);
+            return 1;
+        }
+    }
+
+    // If the write fails, the area may be partially programmed, so it is
+    // not erased anymore, neither in flash nor in the buffer
+    os_memcpy(dest, data, size);
+
+    if (spi_flash_write(cfg_addr + offset, dest, size) != SPI_FLASH_RESULT_OK) {
+        os_printf("Error: failed to write 0x%x bytes at offset 0x%x\n", size, cfg_addr + offset);
+        return 1;
+    }
+
+    return 0;
 }
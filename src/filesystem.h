@@ -5,21 +5,51 @@
 
 struct file_entry
 {
-    char     filename[16];
+    uint32_t name;          // offset of null-terminated file name from the beginning of the fs
     uint32_t size;
-    uint32_t checksum;
-    uint32_t offset; // offset from the beginning of the fs
+    uint32_t checksum;      // checksum of file data, also used for ETag
+    uint32_t offset;        // offset of file data from the beginning of the fs, files with
+                            // identical data and HTTP response head share the same offset
+    uint32_t head_size;     // size of HTTP response head, which is stored right before file data
+    uint32_t head_checksum; // checksum of HTTP response head
+    uint32_t splice;        // offset in file data at which the server inserts dynamic content,
+                            // multiple of 4, or 0 if the file is entirely static
 };
 
-#define FILESYSTEM_MAGIC 0xC0DEA55Au
+#define FILESYSTEM_MAGIC 0xC0DEA55Eu
 
-// The root directory of the filesystem, which is stored at the beginning
-// of the first sector of the filesystem.
+// Maximum size of a file name, including the terminating null.
+//
+// File names are paths relative to the root of the filesystem, with
+// directories separated by '/', e.g. "img/zone1.svg".
+constexpr uint32_t max_filename_size = 64u;
+
+// Maximum number of files in the filesystem.
+constexpr uint32_t max_files = 512u;
+
+// Maximum size of HTTP response head stored with a file.
+//
+// mkfs.py prepares the complete HTTP response head (status line, content type,
+// length, caching and encoding headers) for each file which the server can
+// serve, so the server does not need to format it on every request.
+// The size of the head is a multiple of 4.
+constexpr uint32_t max_file_head_size = 256u;
+
+// The directory of the filesystem, which is stored at the beginning
+// of the filesystem.
+//
+// The header is followed by file entries and then by file names, which are
+// stored one after another, so that short names take little space.  The
+// directory can span several sectors.
+//
+// Entries are sorted by file name.  Files are looked up with binary search
+// in an index kept in RAM, which is sorted by hash of file name.
 struct filesystem
 {
-    uint32_t   magic; // must be FILESYSTEM_MAGIC
-    uint32_t   checksum;
+    uint32_t   magic;     // must be FILESYSTEM_MAGIC
+    uint32_t   checksum;  // checksum from num_files to the end of the directory
     uint32_t   num_files;
+    uint32_t   dir_size;  // size of the directory, including file names, multiple of 4
     file_entry entries[1];
 };
 
@@ -28,10 +58,24 @@ struct filesystem
 // Must be called before any other function below.
 int init_filesystem();
 
+// Number of file entries which find_file() keeps in RAM.
+//
+// The directory is not loaded into RAM, only a compact index with a hash of
+// each file name is.  find_file() reads the entry of the file it finds from
+// flash into a small cache of recently found entries.
+constexpr uint32_t file_entry_cache_size = 4u;
+
 // Searches for a file in the filesystem.
 //
+// - filename - path of the file, without leading slash, e.g. "img/zone1.svg"
+//
+// Compares hashes of file names in RAM and reads the entry and name of
+// the file with matching hash from flash, unless it is already cached.
+//
 // Returns a pointer to the file_entry structure if the file was found.
-// The pointer must not be freed.
+// The pointer must not be freed.  It remains valid until the filesystem is
+// rewritten or until find_file() has found file_entry_cache_size other files,
+// so it should be used right away and not stored.
 //
 // If the file was not found, returns nullptr.
 const file_entry* find_file(const char* filename);
@@ -45,13 +89,155 @@ const file_entry* find_file(const char* filename);
 // at offset 'size_in_front'.  The size of the allocated buffer
 // is the size of the file plus 'size_in_front'.
 //
+// Checksum of file data is verified only the first time the file is
+// read after the filesystem has been written, see scrub_filesystem().
+//
 // Returns a pointer to the allocated buffer.  The returned
 // buffer must be freed by the caller with os_free().
 //
 // Upon failure (e.g. when data in flash is corrupted), returns nullptr.
 char* load_file(const file_entry* file, int size_in_front = 0);
 
-constexpr uint32_t max_fs_size = 128u * 1024u;
+// State of a file which is being read in chunks.
+//
+// Holds a copy of the file entry, so it remains usable even if the filesystem
+// is rewritten in the meantime.  In such case the next read will fail.
+struct file_stream
+{
+    file_entry  file;
+    uint32_t    begin;      // offset of the first byte to read, from HTTP response head
+    uint32_t    pos;        // number of bytes read so far
+    uint32_t    size;       // total number of bytes to read, including HTTP response head
+    uint32_t    checksum;   // checksum of the bytes read so far
+    uint32_t    index;      // index of the file in the directory
+    uint32_t    generation; // generation of the filesystem image
+    bool        verify;     // whether checksum of file data is verified
+    const char* mapped;     // HTTP response head in memory-mapped flash, see map_file()
+};
+
+// Opens a file for reading in chunks.
+//
+// The HTTP response head stored with the file, if any, is read first,
+// followed by the file data.
+//
+// - file   - the file to read, returned by find_file
+// - stream - stream state to initialize
+//
+// Returns 0 on success or 1 if the file entry is invalid.
+int open_file(const file_entry* file, file_stream* stream);
+
+// Opens a part of a file for reading in chunks, e.g. for HTTP range requests.
+//
+// - file   - the file to read, returned by find_file
+// - begin  - offset of the first byte of file data to read
+// - size   - number of bytes to read, must be non-zero
+// - stream - stream state to initialize
+//
+// Only file data is read, without the HTTP response head.  Checksum of file data
+// is not verified when reading the part, instead the file must have been verified
+// as a whole.  After a new filesystem has been written, all files are verified
+// at once, so this is usually the case.  Otherwise the entire file is verified
+// by this function first.
+//
+// Returns 0 on success or 1 if the file entry or the range is invalid or if the
+// file is corrupted.
+int open_file_range(const file_entry* file, uint32_t begin, uint32_t size, file_stream* stream);
+
+// Reads the next chunk of a file opened with open_file() or open_file_range().
+//
+// - stream - stream state
+// - buf    - destination buffer
+// - size   - size of the buffer, must be a non-zero multiple of 4
+//
+// Bytes past the end of file up to the next multiple of 4 are filled
+// with zeroes.  If a range opened with open_file_range() does not begin at
+// a multiple of 4, the first call only returns the bytes up to the next
+// multiple of 4.
+//
+// The checksum is accumulated as the chunks are read and it is verified
+// when the last chunk is read.  Checksum of file data is only verified
+// if the file has not been verified yet.
+//
+// Returns the number of bytes read, 0 if the entire file has already been
+// read, or -1 on failure, including checksum mismatch.
+int read_file(file_stream* stream, uint32_t* buf, uint32_t size);
+
+// Returns the next chunk of a file opened with open_file() or open_file_range()
+// without copying it.
+//
+// The CPU can read the beginning of flash directly through the memory-mapped
+// flash window.  If the filesystem lies within the window, open_file() sets
+// stream->mapped and the file can be read with this function instead of
+// read_file(), so that no buffer is needed.  Otherwise stream->mapped is nullptr
+// and the file must be read with read_file().
+//
+// - stream - stream state
+// - chunk  - receives pointer to the chunk in the memory-mapped flash window
+// - size   - maximum size of the chunk
+//
+// Before the first chunk of a file opened with open_file() is returned,
+// checksums of the HTTP response head and, if the file has not been verified
+// yet, of the entire file data are verified, so a corrupted file fails before
+// any part of it is returned.
+//
+// The window can only be read with 32-bit loads, byte loads raise an exception.
+// The chunk is aligned if the stream is at a multiple of 4, which is the case
+// unless the range passed to open_file_range() begins elsewhere, and if 'size'
+// is a multiple of 4.  memcpy() of an unaligned chunk, e.g. in espconn_send(),
+// crashes, so such parts must be read with read_file() instead.
+//
+// The returned pointer remains valid until the filesystem is rewritten.
+//
+// Returns the number of bytes in the chunk, 0 if the entire file has already
+// been read, or -1 on failure.
+int map_file(file_stream* stream, const char** chunk, uint32_t size);
+
+// Re-verifies files in the background.
+//
+// Once a file has been verified, its checksum is not verified again when
+// it is read.  To detect flash corruption which occurs later, this function
+// verifies a small part of a file on each call, going through all files
+// over and over again.  It is meant to be called periodically, e.g. from
+// a timer.  When a corrupted file is found, it is marked as not verified,
+// so subsequent reads of the file fail.
+void scrub_filesystem();
+
+// Cache of small files in RAM.
+//
+// Small files which are requested often, like app.css or favicon.ico, are kept
+// in RAM together with their HTTP response head, so they don't need to be read
+// from flash and verified on every request.  When the cache exceeds its maximum
+// size or when free heap runs low, least recently used files are evicted.
+// The cache is emptied when the filesystem is rewritten.  Files which share
+// the same data in the filesystem are cached only once.
+
+// Default maximum total size of the file cache in bytes.
+constexpr uint32_t default_file_cache_size = 4096u;
+
+// Sets maximum total size of the file cache in bytes, 0 disables the cache.
+void set_file_cache_size(uint32_t max_size);
+
+// Looks up a file in the cache.
+//
+// - file - the file to look up, returned by find_file
+//
+// Returns a pointer to the HTTP response head followed by file data,
+// with total size of file->head_size + file->size, or nullptr if the file
+// is not cached.  The pointer is valid until the next call to any of the
+// file cache functions or to write_fs().
+const char* find_cached_file(const file_entry* file);
+
+// Adds a file to the cache.
+//
+// - file - the file to add, returned by find_file
+// - data - HTTP response head followed by file data, already verified
+//
+// The file is not added if it does not fit in the cache or if there
+// is not enough free heap.
+void cache_file(const file_entry* file, const void* data);
+
+constexpr uint32_t max_fs_size    = 128u * 1024u;
+constexpr uint32_t max_fs_sectors = max_fs_size / 4096u;
 
 // Writes data to the filesystem.
 //
@@ -61,17 +247,84 @@ constexpr uint32_t max_fs_size = 128u * 1024u;
 //
 // Note: offset must be a multiple of sector size.
 //
-// Returns 0 if the write was completed successfuly or 1 if it failed.
+// A new filesystem image is written in consecutive parts, starting with
+// offset 0.  If flash is large enough, the image is written to the inactive
+// filesystem slot and the current filesystem remains in use until the last
+// part has been written.  Otherwise the filesystem is overwritten in place
+// and is not available until the write has finished.
+//
+// Checksums of the directory and of all files are calculated from the data
+// as it is received, so a corrupted file fails the write which contains its
+// last byte.  Once the last part has been written and all files are correct,
+// the new filesystem becomes active without being read back from flash.
+//
+// Returns 0 if the write was completed successfuly or 1 if it failed,
+// including verification failure of the new filesystem.
 int write_fs(unsigned offset, const char* data, int size);
 
+// Differential filesystem update.
+//
+// Instead of uploading the entire filesystem image with write_fs(), only
+// the sectors which differ can be uploaded.  The client obtains hashes of
+// the sectors with get_fs_sector_hash() and compares them with the sectors
+// of the new image.  Sectors which match the slot to which the update is
+// written are not uploaded at all.  Sectors which match the active
+// filesystem are copied from it by commit_fs_update().
+//
+// The update begins with begin_fs_update(), followed by any number of
+// update_fs() calls, and is completed with commit_fs_update(), which
+// verifies the new filesystem and makes it active.
+//
+// All functions return 0 on success or 1 on failure.
+
+// Starts the update.
+//
+// - sectors - bitmap of sectors which will be uploaded with update_fs(), bit 0
+//             corresponds to the first sector
+//
+// The sectors are erased in the background from a timer, one at a time, while
+// their data is being received, so that update_fs() only needs to program
+// them.  Sectors which are written before they have been erased in the
+// background are erased by update_fs() as usual.
+int begin_fs_update(uint32_t sectors = 0u);
+
+// Writes sectors of the new filesystem, same parameters as write_fs().
+int update_fs(unsigned offset, const char* data, int size);
+
+// Completes the update.
+//
+// - copy_sectors - bitmap of sectors which are copied from the active filesystem,
+//                  bit 0 corresponds to the first sector
+int commit_fs_update(uint32_t copy_sectors);
+
+// Computes 32-bit FNV-1a hash of a sector of the filesystem area.
+//
+// - upload_slot - false to hash a sector of the active filesystem, true to hash
+//                 a sector of the slot to which the next update will be written
+//                 (which is the same slot if there is only one slot)
+// - sector      - index of the sector, from 0 to max_fs_sectors - 1
+// - hash        - receives the hash
+//
+// Returns 0 on success or 1 if the sector is out of range or cannot be read.
+int get_fs_sector_hash(bool upload_slot, uint32_t sector, uint32_t* hash);
+
 struct config_base
 {
-    uint32_t checksum;        // checksum from next field
+    uint32_t checksum;        // checksum from next field up to 'size'
     uint32_t id;              // id of the write
     uint32_t timestamp;       // timestamp of the write
     uint32_t first_timestamp; // first timestamp ever written
+    uint32_t magic;           // layout of the sector, must be CONFIG_MAGIC
+    uint32_t size;            // size of the data covered by checksum, the rest
+                              // of the sector is filled by append_config()
 };
 
+// Value of config_base::magic of a sector returned by load_config(), which has
+// been written by older firmware with a shorter header.  The data which followed
+// the old header is moved after config_base and config_base::size is 0.  Such
+// sector must be converted and saved before anything can be appended to it.
+constexpr uint32_t legacy_config_magic = 0u;
+
 // Returns the number of log sectors.
 uint32_t get_num_log_sectors();
 
@@ -99,6 +352,11 @@ uint32_t get_num_log_sectors();
 // If the log was never written before, id will be set to all Fs
 // to indicate that the contents are bogus.
 //
+// If the last sector is corrupted, e.g. due to power loss while it was being
+// written, the newest valid sector before it is loaded instead, so the next
+// save replaces the corrupted sector.  If there is no valid sector, id is set
+// to all Fs and the next save starts a new log after the corrupted sector.
+//
 // On failure, e.g. on corruption (bad checksum), returns a nullptr.
 config_base* load_config(int idx = 0);
 
@@ -106,8 +364,35 @@ config_base* load_config(int idx = 0);
 //
 // Writes system log/configuration to the flash.
 //
+// - config - buffer returned by load_config()
+// - size   - size of data to write, multiple of 4, sector size by default
+//
 // Increments config_base->id, computes checksum and performs write
-// to the next sector in the log area in the flash.
+// to the next sector in the log area in the flash.  The rest of the sector
+// after 'size' is left erased and it is also erased in the buffer.
 //
 // Returns 0 if the write was successful or 1 if write failed.
-int save_config(config_base* config);
+int save_config(config_base* config, uint32_t size = 4096u);
+
+// Appends data to the current log/configuration sector in place.
+//
+// - offset - offset from the beginning of the sector, multiple of 4, at or
+//            after the size of the data passed to the last save_config()
+// - data   - data to append
+// - size   - size of data, multiple of 4
+//
+// The area must still be erased since the sector was saved.  Flash is
+// programmed without erasing the sector, so appending does not wear it out.
+// The data is also copied to the buffer returned by load_config().  The data
+// is not covered by config_base->checksum, so it must carry its own check.
+//
+// Returns 0 if the write was successful or 1 if write failed.
+int append_config(uint32_t offset, const void* data, uint32_t size);
+
+// Checks whether the buffer returned by load_config() differs from the current
+// log/configuration sector in flash, excluding config_base.
+//
+// - size - size of data to compare, as passed to save_config()
+//
+// Returns true if the data differs or if it has never been saved.
+bool is_config_modified(uint32_t size);
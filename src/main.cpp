@@ -63,6 +63,10 @@ static void ICACHE_FLASH_ATTR clear_critical_error()
 // the default after boot, and LOW state means that a zone is ON.
 static void ICACHE_FLASH_ATTR zone_on_off(int zone, int on)
 {
+    // Write pending configuration changes first, in case switching a valve
+    // causes a brownout and resets the device
+    flush_config();
+
     for (uint32_t i = 0; i < num_zones; i++) {
         if (zones[i] == XZONE_ON && (i != zone || ! on)) {
             os_printf("zone %d off\n", i);
@@ -78,6 +82,46 @@ static void ICACHE_FLASH_ATTR zone_on_off(int zone, int on)
     }
 }
 
+// Parses a hexadecimal number terminated with a null character.
+static bool ICACHE_FLASH_ATTR parse_hex(const char* text, uint32_t* value)
+{
+    uint32_t result = 0;
+    int      len    = 0;
+
+    for ( ; text[len]; len++) {
+        const char c = text[len];
+        uint32_t   digit;
+
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return false;
+
+        result = (result << 4) | digit;
+    }
+
+    if (len == 0 || len > 8)
+        return false;
+
+    *value = result;
+    return true;
+}
+
+// Uploads the filesystem.
+//
+// Without query, the payload is the entire filesystem image.
+//
+// Differential update is performed with the following requests:
+// * upload_fs?begin      - starts the update
+// * upload_fs?begin=HEX  - starts the update, HEX is bitmap of sectors which
+//                          will be uploaded, so they can be erased ahead
+// * upload_fs?offset=HEX - payload contains sectors at the specified offset
+// * upload_fs?commit=HEX - completes the update, HEX is bitmap of sectors
+//                          copied from the active filesystem
 static HTTPStatus ICACHE_FLASH_ATTR upload_fs(void*             conn,
                                               const text_entry& query,
                                               const text_entry& headers,
@@ -95,10 +139,66 @@ static HTTPStatus ICACHE_FLASH_ATTR upload_fs(void*             conn,
         return HTTP_BAD_REQUEST;
     }
 
-    if (write_fs(payload_offset, payload.text, payload.len))
-        return HTTP_BAD_REQUEST;
+    if ( ! query.len) {
+        if (write_fs(payload_offset, payload.text, payload.len))
+            return HTTP_BAD_REQUEST;
 
-    return HTTP_OK;
+        return HTTP_OK;
+    }
+
+    uint32_t value = 0;
+    int      err   = 1;
+
+    if (os_strcmp(query.text, "begin") == 0)
+        err = begin_fs_update();
+
+    else if (os_strncmp(query.text, "begin=", 6) == 0 && parse_hex(&query.text[6], &value))
+        err = begin_fs_update(value);
+
+    else if (os_strncmp(query.text, "offset=", 7) == 0 && parse_hex(&query.text[7], &value))
+        err = update_fs(value + payload_offset, payload.text, payload.len);
+
+    else if (os_strncmp(query.text, "commit=", 7) == 0 && parse_hex(&query.text[7], &value))
+        err = commit_fs_update(value);
+
+    else
+        os_printf("Error: invalid query\n");
+
+    return err ? HTTP_BAD_REQUEST : HTTP_OK;
+}
+
+// Returns hashes of sectors of the filesystem area, used for differential update.
+//
+// "active" contains hashes of the active filesystem and "upload" contains
+// hashes of the slot to which the next update is written.
+static HTTPStatus ICACHE_FLASH_ATTR fs_sectors(void*             conn,
+                                               const text_entry& query,
+                                               const text_entry& headers,
+                                               unsigned          payload_offset,
+                                               const text_entry& payload)
+{
+    char response[HTTP_HEAD_SIZE + 32 + 2 * max_fs_sectors * 11];
+    int  pos = HTTP_HEAD_SIZE;
+
+    for (int upload_slot = 0; upload_slot < 2; upload_slot++) {
+
+        pos += os_sprintf(&response[pos], upload_slot ? "],\"upload\":[" : "{\"active\":[");
+
+        for (uint32_t sector = 0; sector < max_fs_sectors; sector++) {
+
+            uint32_t hash;
+            if (get_fs_sector_hash(upload_slot, sector, &hash))
+                break;
+
+            pos += os_sprintf(&response[pos], sector ? ",\"%08x\"" : "\"%08x\"", hash);
+        }
+    }
+
+    pos += os_sprintf(&response[pos], "]}");
+
+    webserver_send_response(conn, response, "application/json", HTTP_HEAD_SIZE, pos - HTTP_HEAD_SIZE);
+
+    return HTTP_RESPONSE_SENT;
 }
 
 static int ICACHE_FLASH_ATTR safe_concat(char* buf, int buf_size, int pos, const char* in)
@@ -112,18 +212,15 @@ static int ICACHE_FLASH_ATTR safe_concat(char* buf, int buf_size, int pos, const
     return new_pos;
 }
 
-static HTTPStatus ICACHE_FLASH_ATTR sysinfo(void*             conn,
-                                            const text_entry& query,
-                                            const text_entry& headers,
-                                            unsigned          payload_offset,
-                                            const text_entry& payload)
+// Appends system information in JSON format to 'buf' at 'pos'.
+//
+// Returns the new position, which is past the end of 'buf' if it overflowed.
+static int ICACHE_FLASH_ATTR format_sysinfo(char* buf, int buf_size, int pos)
 {
-    char response[HTTP_HEAD_SIZE + 256];
     char tmp[32];
-    int  pos = HTTP_HEAD_SIZE;
 
-    const auto print_json = [&response, &pos](const char* in) ICACHE_FLASH_ATTR {
-        pos = safe_concat(response, sizeof(response), pos, in);
+    const auto print_json = [buf, buf_size, &pos](const char* in) ICACHE_FLASH_ATTR {
+        pos = safe_concat(buf, buf_size, pos, in);
     };
 
     print_json("{\"sdk\":\"");
@@ -194,12 +291,132 @@ static HTTPStatus ICACHE_FLASH_ATTR sysinfo(void*             conn,
 
     print_json("}");
 
+    return pos;
+}
+
+static HTTPStatus ICACHE_FLASH_ATTR sysinfo(void*             conn,
+                                            const text_entry& query,
+                                            const text_entry& headers,
+                                            unsigned          payload_offset,
+                                            const text_entry& payload)
+{
+    char response[HTTP_HEAD_SIZE + 256];
+
+    const int pos = format_sysinfo(response, sizeof(response), HTTP_HEAD_SIZE);
+
     const int end = pos > sizeof(response) ? sizeof(response) : pos;
     webserver_send_response(conn, response, "application/json", HTTP_HEAD_SIZE, end - HTTP_HEAD_SIZE);
 
     return HTTP_RESPONSE_SENT;
 }
 
+// Appends a JSON string with at most 'max_len' characters of 'text' to 'buf' at 'pos'.
+//
+// Characters which could end the string or the enclosing script are escaped.
+//
+// Returns the new position, which is past the end of 'buf' if it overflowed.
+static int ICACHE_FLASH_ATTR format_json_string(char*       buf,
+                                                int         buf_size,
+                                                int         pos,
+                                                const char* text,
+                                                int         max_len)
+{
+    char tmp[8];
+
+    pos = safe_concat(buf, buf_size, pos, "\"");
+
+    for (int i = 0; i < max_len && text[i]; i++) {
+        const uint8_t c = static_cast<uint8_t>(text[i]);
+
+        if (c < 0x20u || c == '"' || c == '\\' || c == '<')
+            os_sprintf(tmp, "\\u%04x", c);
+        else {
+            tmp[0] = static_cast<char>(c);
+            tmp[1] = 0;
+        }
+
+        pos = safe_concat(buf, buf_size, pos, tmp);
+    }
+
+    return safe_concat(buf, buf_size, pos, "\"");
+}
+
+// Number of most recent log events included in the initial state of the page
+constexpr unsigned bootstrap_log_size = 16u;
+
+// Generates initial state of the web page, which the webserver inserts into
+// index.html, so that the first paint does not need separate requests for
+// system information, zones, schedule and log.
+//
+// The state is a script which defines global variable 'bootstrap', for example:
+//
+// <script>var bootstrap={"sysinfo":{...},
+//                        "zones":[{"order":1,"time_min":10,"days":1,"dow":false,"name":"Lawn"},...],
+//                        "schedule":{"enabled":true,"start_time":360,"last_watering":1561838292},
+//                        "log":[[1561838292,2,0],...]};</script>
+//
+// Log events are [timestamp, log_code, data], the most recent event first.
+// With long zone names escaped as \uXXXX the state can approach 2KB, so older
+// log events are left out if they do not fit.  If the state still does not fit,
+// the page is served without it and requests the data separately.
+static int ICACHE_FLASH_ATTR bootstrap(char* buf, int buf_size)
+{
+    char tmp[96];
+    int  pos = 0;
+
+    const auto print_json = [buf, buf_size, &pos](const char* in) ICACHE_FLASH_ATTR {
+        pos = safe_concat(buf, buf_size, pos, in);
+    };
+
+    print_json("<script>var bootstrap={\"sysinfo\":");
+    pos = format_sysinfo(buf, buf_size, pos);
+
+    print_json(",\"zones\":[");
+
+    for (uint32_t i = 0; i < num_zones; i++) {
+        const auto& zone = cfg->zones[i];
+
+        os_sprintf(tmp, "%s{\"order\":%u,\"time_min\":%u,\"days\":%u,\"dow\":%s,\"name\":",
+                   i ? "," : "",
+                   static_cast<unsigned>(zone.order),
+                   static_cast<unsigned>(zone.time_min),
+                   static_cast<unsigned>(zone.days),
+                   zone.dow ? "true" : "false");
+        print_json(tmp);
+
+        pos = format_json_string(buf, buf_size, pos, zone.name, sizeof(zone.name));
+        print_json("}");
+    }
+
+    os_sprintf(tmp, "],\"schedule\":{\"enabled\":%s,\"start_time\":%u,\"last_watering\":%u}",
+               cfg->enabled ? "true" : "false",
+               static_cast<unsigned>(cfg->start_time),
+               cfg->last_watering);
+    print_json(tmp);
+
+    print_json(",\"log\":[");
+
+    static const char end[] = "]};</script>";
+
+    log_entry events[bootstrap_log_size];
+    const unsigned num_events = get_event_history(0u, events, bootstrap_log_size);
+
+    for (unsigned i = 0; i < num_events; i++) {
+        const int len = os_sprintf(tmp, "%s[%u,%u,%u]",
+                                   i ? "," : "",
+                                   events[i].timestamp,
+                                   static_cast<unsigned>(events[i].event),
+                                   static_cast<unsigned>(events[i].data));
+        if (pos + len + static_cast<int>(sizeof(end)) > buf_size)
+            break;
+        print_json(tmp);
+    }
+
+    print_json(end);
+
+    return pos < buf_size ? pos : -1;
+}
+
 static HTTPStatus ICACHE_FLASH_ATTR manual(void*             conn,
                                            const text_entry& query,
                                            const text_entry& headers,
@@ -246,6 +463,74 @@ static HTTPStatus ICACHE_FLASH_ATTR manual(void*             conn,
     return HTTP_OK;
 }
 
+// Changes the watering schedule.
+//
+// The payload is the schedule in the same format as in bootstrap(), without
+// last_watering, e.g. {"enabled":true,"start_time":360}.  The change is saved
+// together with other changes made in quick succession.
+static HTTPStatus ICACHE_FLASH_ATTR schedule(void*             conn,
+                                             const text_entry& query,
+                                             const text_entry& headers,
+                                             unsigned          payload_offset,
+                                             const text_entry& payload)
+{
+    static const char enabled_key[]    = "{\"enabled\":";
+    static const char start_time_key[] = ",\"start_time\":";
+
+    const char*       text = payload.text;
+    const char* const end  = payload.text + payload.len;
+
+    if (end - text < static_cast<int>(sizeof(enabled_key) - 1u) ||
+        os_memcmp(text, enabled_key, sizeof(enabled_key) - 1u) != 0) {
+        os_printf("Error: payload does not start with enabled\n");
+        return HTTP_BAD_REQUEST;
+    }
+    text += sizeof(enabled_key) - 1u;
+
+    bool enabled;
+    if (end - text >= 4 && os_memcmp(text, "true", 4) == 0) {
+        enabled = true;
+        text += 4;
+    }
+    else if (end - text >= 5 && os_memcmp(text, "false", 5) == 0) {
+        enabled = false;
+        text += 5;
+    }
+    else {
+        os_printf("Error: bad enabled value\n");
+        return HTTP_BAD_REQUEST;
+    }
+
+    if (end - text < static_cast<int>(sizeof(start_time_key) - 1u) ||
+        os_memcmp(text, start_time_key, sizeof(start_time_key) - 1u) != 0) {
+        os_printf("Error: expected start_time\n");
+        return HTTP_BAD_REQUEST;
+    }
+    text += sizeof(start_time_key) - 1u;
+
+    uint32_t start_time = 0;
+    int      len        = 0;
+
+    for ( ; text < end && *text >= '0' && *text <= '9' && len < 5; text++, len++)
+        start_time = start_time * 10u + static_cast<uint32_t>(*text - '0');
+
+    if (len == 0 || start_time >= 24u * 60u) {
+        os_printf("Error: bad start_time\n");
+        return HTTP_BAD_REQUEST;
+    }
+
+    if (end - text != 1 || *text != '}') {
+        os_printf("Error: expected end of payload\n");
+        return HTTP_BAD_REQUEST;
+    }
+
+    cfg->enabled    = enabled;
+    cfg->start_time = start_time;
+    defer_save_config();
+
+    return HTTP_OK;
+}
+
 enum how_to_run {
     RUN_AUTO,
     RUN_MANUAL
@@ -257,13 +542,16 @@ static void ICACHE_FLASH_ATTR select_zone(uint32_t zone_idx, how_to_run how)
 }
 
 static const handler_entry web_handlers[] = {
-    { GET_METHOD,  "sysinfo",   sysinfo   },
-    { POST_METHOD, "upload_fs", upload_fs },
-    { PUT_METHOD,  "manual",    manual    }
+    { GET_METHOD,  "sysinfo",    sysinfo    },
+    { GET_METHOD,  "fs_sectors", fs_sectors },
+    { POST_METHOD, "upload_fs",  upload_fs  },
+    { PUT_METHOD,  "manual",     manual     },
+    { PUT_METHOD,  "schedule",   schedule   }
 };
 
 constexpr uint32_t update_interval_s = 10;
 constexpr uint32_t ntp_timeout_s     = 60;
+constexpr uint32_t scrub_interval_ms = 1000;
 
 static void ICACHE_FLASH_ATTR update_schedule_from_config(uint32_t timestamp)
 {
@@ -337,7 +625,7 @@ extern "C" void ICACHE_FLASH_ATTR user_init()
 
     init_filesystem();
 
-    configure_webserver(&web_handlers[0], sizeof(web_handlers) / sizeof(web_handlers[0]));
+    configure_webserver(&web_handlers[0], sizeof(web_handlers) / sizeof(web_handlers[0]), bootstrap);
 
     system_init_done_cb([]() ICACHE_FLASH_ATTR {
 
@@ -349,5 +637,11 @@ extern "C" void ICACHE_FLASH_ATTR user_init()
         os_timer_disarm(&timer);
         os_timer_setfn(&timer, update_zones, nullptr);
         os_timer_arm(&timer, update_interval_s * 1000, true);
+
+        // Slowly re-verify files in flash
+        static os_timer_t scrub_timer;
+        os_timer_disarm(&scrub_timer);
+        os_timer_setfn(&scrub_timer, [](void*) ICACHE_FLASH_ATTR { scrub_filesystem(); }, nullptr);
+        os_timer_arm(&scrub_timer, scrub_interval_ms, true);
     });
 }
@@ -183,6 +183,14 @@ static void ICACHE_FLASH_ATTR webserver_send_error(espconn*   conn,
                 code_str = "404 Not Found";
                 break;
 
+            case HTTP_NOT_ACCEPTABLE:
+                code_str = "406 Not Acceptable";
+                break;
+
+            case HTTP_RANGE_NOT_SATISFIABLE:
+                code_str = "416 Range Not Satisfiable";
+                break;
+
             case HTTP_SERVICE_UNAVAILABLE:
                 code_str = "503 Service Unavailable";
                 break;
@@ -211,57 +219,228 @@ static void ICACHE_FLASH_ATTR webserver_send_error(espconn*   conn,
     espconn_send(conn, reinterpret_cast<uint8_t*>(buf), os_strlen(buf));
 }
 
-static const char* ICACHE_FLASH_ATTR get_mime_type(const char* uri, int len)
+text_entry ICACHE_FLASH_ATTR get_header(const text_entry& headers,
+                                        const char*       header_name)
 {
-    struct mime_entry {
-        char        ext[5];
-        signed char len;
-        const char* mime_type;
-    };
+    // Note: headers of GET requests are not null-terminated, so the search
+    // must not go beyond headers.len
+    const int name_len = os_strlen(header_name);
 
-    static const mime_entry mime_types[] = {
-        { "html", 4, "text/html"       },
-        { "css",  3, "text/css"        },
-        { "js",   2, "text/javascript" },
-        { "ico",  3, "image/x-icon"    }
-    };
+    for (int i = 0; i + name_len <= headers.len; i++) {
 
-    for (const auto& e : mime_types) {
-        if (len <= e.len)
+        // Header names are only found at the beginning of a line
+        if (i && headers.text[i - 1] != '\n')
             continue;
 
-        if (uri[len - e.len - 1] != '.')
+        if (os_memcmp(&headers.text[i], header_name, name_len) != 0)
             continue;
 
-        if (os_memcmp(&uri[len - e.len], e.ext, e.len) == 0)
-            return e.mime_type;
+        int begin = i + name_len;
+
+        for ( ; begin < headers.len && headers.text[begin] == ' '; ++begin);
+
+        int end = begin;
+
+        for ( ; end < headers.len; ++end) {
+            const char c = headers.text[end];
+
+            if (c == '\r' || c == '\n' || c == 0)
+                break;
+        }
+
+        return text_entry{&headers.text[begin], end - begin};
     }
 
-    return nullptr;
+    return text_entry{nullptr, 0};
 }
 
-text_entry ICACHE_FLASH_ATTR get_header(const text_entry& headers,
-                                        const char*       header_name)
+// Checks whether the client accepts gzip content encoding.
+static bool ICACHE_FLASH_ATTR accepts_gzip(const text_entry& headers)
 {
-    auto begin = os_strstr(headers.text, header_name);
+    const auto accept = get_header(headers, "Accept-Encoding:");
+
+    for (int i = 0; i < accept.len; ) {
+
+        for ( ; i < accept.len && (accept.text[i] == ' ' || accept.text[i] == ','); ++i);
+
+        // Content coding name
+        const int begin = i;
+        for ( ; i < accept.len && accept.text[i] != ',' && accept.text[i] != ';' &&
+                accept.text[i] != ' '; ++i);
+        const int name_len = i - begin;
+
+        // Look for q-value, zero means that the coding is not acceptable
+        bool zero_q = false;
+        for ( ; i < accept.len && accept.text[i] != ','; ++i) {
+            if (accept.text[i] == '=' && i > begin && accept.text[i - 1] == 'q') {
+                zero_q = true;
+                for (++i; i < accept.len && accept.text[i] != ',' && accept.text[i] != ' '; ++i) {
+                    if (accept.text[i] != '0' && accept.text[i] != '.')
+                        zero_q = false;
+                }
+                break;
+            }
+        }
 
-    if ( ! begin)
-        return text_entry{nullptr, 0};
+        if (name_len == 4 && os_memcmp(&accept.text[begin], "gzip", 4) == 0)
+            return ! zero_q;
+    }
 
-    begin += os_strlen(header_name);
+    return false;
+}
 
-    for ( ; *begin == ' '; ++begin);
+// Format of ETag header value of a static file, the arguments are file
+// checksum and size.  Must match the ETag in HTTP response head prepared by mkfs.py.
+#define FILE_ETAG_FORMAT "\"%08x-%x\""
 
-    auto end = begin;
+// Checks whether header value contains ETag of a file.
+static bool ICACHE_FLASH_ATTR contains_etag(const text_entry& value, const file_entry& file)
+{
+    char etag[24];
+    os_sprintf(etag, FILE_ETAG_FORMAT, file.checksum, file.size);
+    const int etag_len = os_strlen(etag);
 
-    for (;; ++end) {
-        const char c = *end;
+    for (int i = 0; i + etag_len <= value.len; i++) {
+        if (os_memcmp(&value.text[i], etag, etag_len) == 0)
+            return true;
+    }
 
-        if (c == '\r' || c == 0)
-            break;
+    return false;
+}
+
+// Checks whether If-None-Match header matches ETag of a file, i.e. whether
+// the client already has the current version of the file.
+static bool ICACHE_FLASH_ATTR etag_matches(const text_entry& headers, const file_entry& file)
+{
+    const auto if_none_match = get_header(headers, "If-None-Match:");
+
+    if (if_none_match.len == 1 && if_none_match.text[0] == '*')
+        return true;
+
+    // The header can contain a list of ETags, possibly weak
+    return contains_etag(if_none_match, file);
+}
+
+// Parses Range header of a request for a static file.
+//
+// Only a single byte range is supported, e.g. "bytes=100-199", "bytes=100-"
+// or "bytes=-100".  Other ranges are ignored and the entire file is served.
+// If-Range header is also honored, the range is ignored if the file has changed.
+//
+// - headers - request headers
+// - file    - the requested file
+// - begin   - receives offset of the first byte of the range
+// - size    - receives size of the range
+//
+// Returns HTTP_PARTIAL_CONTENT if the range is valid, HTTP_RANGE_NOT_SATISFIABLE
+// if the range begins past the end of file or HTTP_OK if the entire file
+// should be served.
+static HTTPStatus ICACHE_FLASH_ATTR parse_range(const text_entry& headers,
+                                                const file_entry& file,
+                                                uint32_t*         begin,
+                                                uint32_t*         size)
+{
+    const auto range = get_header(headers, "Range:");
+
+    static const char bytes_unit[] = "bytes=";
+    constexpr int     unit_len     = sizeof(bytes_unit) - 1;
+
+    if (range.len <= unit_len || os_memcmp(range.text, bytes_unit, unit_len) != 0)
+        return HTTP_OK;
+
+    const auto if_range = get_header(headers, "If-Range:");
+
+    if (if_range.len && ! contains_etag(if_range, file))
+        return HTTP_OK;
+
+    // Parse first and last byte positions, either of them can be omitted
+    uint32_t first            = 0u;
+    uint32_t last             = 0u;
+    int      num_first_digits = 0;
+    int      num_last_digits  = 0;
+    bool     dash             = false;
+
+    for (int i = unit_len; i < range.len; i++) {
+        const char c = range.text[i];
+
+        if (c == '-' && ! dash)
+            dash = true;
+        else if (c >= '0' && c <= '9') {
+            uint32_t& value  = dash ? last : first;
+            int&      digits = dash ? num_last_digits : num_first_digits;
+
+            // Positions larger than any file are not supported
+            if (++digits > 9)
+                return HTTP_OK;
+
+            value = value * 10u + static_cast<uint32_t>(c - '0');
+        }
+        else
+            // Multiple ranges or garbage
+            return HTTP_OK;
+    }
+
+    if ( ! dash || (! num_first_digits && ! num_last_digits))
+        return HTTP_OK;
+
+    if ( ! num_first_digits) {
+        // Suffix range, i.e. the last N bytes
+        if ( ! last)
+            return HTTP_RANGE_NOT_SATISFIABLE;
+
+        first = last < file.size ? file.size - last : 0u;
+        last  = file.size - 1u;
+    }
+    else {
+        if (num_last_digits && last < first)
+            return HTTP_OK;
+
+        if (first >= file.size)
+            return HTTP_RANGE_NOT_SATISFIABLE;
+
+        if ( ! num_last_digits || last >= file.size)
+            last = file.size - 1u;
     }
 
-    return text_entry{begin, static_cast<int>(end - begin)};
+    *begin = first;
+    *size  = last - first + 1u;
+
+    return HTTP_PARTIAL_CONTENT;
+}
+
+static void ICACHE_FLASH_ATTR webserver_send_not_modified(espconn*          conn,
+                                                          const file_entry& file,
+                                                          bool              vary)
+{
+    char buf[96];
+
+    os_sprintf(buf, "HTTP/1.1 304 Not Modified\r\n"
+                    "ETag: " FILE_ETAG_FORMAT "\r\n"
+                    "%s"
+                    "\r\n",
+               file.checksum,
+               file.size,
+               vary ? "Vary: Accept-Encoding\r\n" : "");
+
+    print_conn_info(conn, "response", static_cast<int>(HTTP_NOT_MODIFIED));
+
+    espconn_send(conn, reinterpret_cast<uint8_t*>(buf), os_strlen(buf));
+}
+
+// Looks up gzip-compressed variant of a file, which is stored with .gz extension.
+static const file_entry* ICACHE_FLASH_ATTR find_gzip_file(const text_entry& uri)
+{
+    static const char gz_ext[] = ".gz";
+
+    char name[max_filename_size];
+
+    if (uri.len + sizeof(gz_ext) > sizeof(name))
+        return nullptr;
+
+    os_memcpy(name, uri.text, uri.len);
+    os_memcpy(&name[uri.len], gz_ext, sizeof(gz_ext));
+
+    return find_file(name);
 }
 
 struct saved_conn_t {
@@ -336,20 +515,80 @@ static HTTPStatus ICACHE_FLASH_ATTR save_connection(espconn*          conn,
     return HTTP_CONTINUE;
 }
 
+static bool ICACHE_FLASH_ATTR is_same_remote(espconn*       conn,
+                                            const uint8_t* remote_ip,
+                                            int            remote_port)
+{
+    return remote_ip[0] == conn->proto.tcp->remote_ip[0] &&
+           remote_ip[1] == conn->proto.tcp->remote_ip[1] &&
+           remote_ip[2] == conn->proto.tcp->remote_ip[2] &&
+           remote_ip[3] == conn->proto.tcp->remote_ip[3] &&
+           remote_port  == conn->proto.tcp->remote_port;
+}
+
 static saved_conn_t* find_saved_connection(espconn* conn)
 {
     if (saved_connections &&
-        saved_connections->remote_ip[0] == conn->proto.tcp->remote_ip[0] &&
-        saved_connections->remote_ip[1] == conn->proto.tcp->remote_ip[1] &&
-        saved_connections->remote_ip[2] == conn->proto.tcp->remote_ip[2] &&
-        saved_connections->remote_ip[3] == conn->proto.tcp->remote_ip[3] &&
-        saved_connections->remote_port == conn->proto.tcp->remote_port)
+        is_same_remote(conn, saved_connections->remote_ip, saved_connections->remote_port))
 
         return saved_connections;
 
     return nullptr;
 }
 
+// Static files are sent in chunks of this size.  The next chunk is read from flash
+// and sent only after the previous one has been sent, so the amount of memory needed
+// to serve a file does not depend on the size of the file.  Together with the HTTP
+// head, one chunk fits in lwIP's default TCP send buffer (2 * MSS).
+static constexpr unsigned stream_chunk_size = 2048u;
+
+// Maximum size of dynamic content inserted into a static file, which is sent
+// in one piece, like a chunk of a file
+static constexpr unsigned max_splice_size = stream_chunk_size;
+
+static splice_handler splice_content = nullptr;
+
+struct stream_conn_t {
+    stream_conn_t* next;
+    uint8_t        remote_ip[4];
+    int            remote_port;
+    espconn*       conn;
+    os_timer_t     abort_timer;
+    file_stream    file;
+    uint32_t       splice;       // position in 'file' at which 'dynamic' is sent
+    char*          dynamic;      // dynamic content which has not been sent yet, or nullptr
+    uint32_t       dynamic_size;
+};
+
+static stream_conn_t* stream_connections = nullptr;
+
+static stream_conn_t* ICACHE_FLASH_ATTR find_stream_connection(espconn* conn)
+{
+    for (auto stream = stream_connections; stream; stream = stream->next) {
+        if (is_same_remote(conn, stream->remote_ip, stream->remote_port))
+            return stream;
+    }
+
+    return nullptr;
+}
+
+static void ICACHE_FLASH_ATTR free_stream(stream_conn_t* stream)
+{
+    for (auto ptr = &stream_connections; *ptr; ptr = &(*ptr)->next) {
+        if (*ptr == stream) {
+            *ptr = stream->next;
+            break;
+        }
+    }
+
+    os_timer_disarm(&stream->abort_timer);
+
+    if (stream->dynamic)
+        os_free(stream->dynamic);
+
+    os_free(stream);
+}
+
 static void ICACHE_FLASH_ATTR free_connection(espconn *conn)
 {
     const auto saved_conn = find_saved_connection(conn);
@@ -358,6 +597,358 @@ static void ICACHE_FLASH_ATTR free_connection(espconn *conn)
         os_free(saved_connections);
         saved_connections = nullptr;
     }
+
+    const auto stream = find_stream_connection(conn);
+
+    if (stream)
+        free_stream(stream);
+}
+
+// Aborts a connection on which a file is being sent, e.g. when the file turned out
+// to be corrupted, so that the client does not wait for the rest of the data.
+// The SDK does not allow disconnecting from inside espconn callbacks, so this is
+// deferred to a timer.
+static void ICACHE_FLASH_ATTR abort_stream(stream_conn_t* stream)
+{
+    os_timer_disarm(&stream->abort_timer);
+
+    os_timer_setfn(&stream->abort_timer, [](void* arg) ICACHE_FLASH_ATTR {
+
+        const auto stream_conn = static_cast<stream_conn_t*>(arg);
+
+        print_conn_info(stream_conn->conn, "abort");
+
+        espconn_disconnect(stream_conn->conn);
+    }, stream);
+
+    os_timer_arm(&stream->abort_timer, 0, false);
+}
+
+// Reads the next chunk of the file from flash and sends it.
+//
+// The first chunk begins with the HTTP response head, which is stored
+// in the filesystem along with the file.
+//
+// If the file is in the memory-mapped flash window, the chunk is sent
+// directly from there without copying.  Otherwise files which fit in a single
+// chunk are added to the file cache, if 'fentry' is specified.
+//
+// lwIP copies the data with memcpy(), which reads unaligned data with byte
+// loads, but the window can only be read with 32-bit loads.  So only chunks
+// which begin at a multiple of 4 and have a size which is a multiple of 4 are
+// sent from the window.  Other parts of the file, e.g. the beginning of a range
+// or the last bytes of the file, are read into RAM.
+//
+// Dynamic content is sent on its own, once the file has been sent up to
+// the splice point.
+//
+// Returns true if the chunk was sent.
+static bool ICACHE_FLASH_ATTR send_file_chunk(espconn*          conn,
+                                              stream_conn_t*    stream,
+                                              const file_entry* fentry = nullptr)
+{
+    uint32_t max_size = stream_chunk_size;
+
+    if (stream->dynamic) {
+        const uint32_t left = stream->splice - stream->file.pos;
+
+        if ( ! left) {
+            const bool sent = espconn_send(conn,
+                                           reinterpret_cast<uint8_t*>(stream->dynamic),
+                                           stream->dynamic_size) == 0;
+            os_free(stream->dynamic);
+            stream->dynamic = nullptr;
+            return sent;
+        }
+
+        if (left < max_size)
+            max_size = left;
+    }
+
+    const uint32_t pos      = stream->file.begin + stream->file.pos;
+    const uint32_t left     = stream->file.size - stream->file.pos;
+    const uint32_t map_size = (left < max_size ? left : max_size) & ~3u;
+
+    if (stream->file.mapped && ! (pos & 3u) && map_size) {
+        const char* chunk = nullptr;
+
+        const int size = map_file(&stream->file, &chunk, map_size);
+        if (size <= 0)
+            return false;
+
+        return espconn_send(conn, reinterpret_cast<uint8_t*>(const_cast<char*>(chunk)), size) == 0;
+    }
+
+    uint32_t buf[stream_chunk_size / sizeof(uint32_t)];
+
+    const int size = read_file(&stream->file, buf, max_size);
+    if (size <= 0)
+        return false;
+
+    // The entire file has been read and verified
+    if (fentry && static_cast<uint32_t>(size) == stream->file.size)
+        cache_file(fentry, buf);
+
+    return espconn_send(conn, reinterpret_cast<uint8_t*>(buf), size) == 0;
+}
+
+static stream_conn_t* ICACHE_FLASH_ATTR alloc_stream(espconn* conn)
+{
+    const auto stream = static_cast<stream_conn_t*>(os_malloc(sizeof(stream_conn_t)));
+
+    if ( ! stream) {
+        os_printf("Error: out of memory\n");
+        return nullptr;
+    }
+
+    stream->next           = nullptr;
+    stream->remote_ip[0]   = conn->proto.tcp->remote_ip[0];
+    stream->remote_ip[1]   = conn->proto.tcp->remote_ip[1];
+    stream->remote_ip[2]   = conn->proto.tcp->remote_ip[2];
+    stream->remote_ip[3]   = conn->proto.tcp->remote_ip[3];
+    stream->remote_port    = conn->proto.tcp->remote_port;
+    stream->conn           = conn;
+    stream->abort_timer    = os_timer_t{ };
+    stream->splice         = 0u;
+    stream->dynamic        = nullptr;
+    stream->dynamic_size   = 0u;
+
+    return stream;
+}
+
+// Starts sending a static file.
+//
+// Small files are sent from the file cache if possible, without reading flash.
+//
+// Returns false if the file could not be read, in which case nothing has been sent.
+static bool ICACHE_FLASH_ATTR start_file_stream(espconn* conn, const file_entry* fentry)
+{
+    const char* const cached = find_cached_file(fentry);
+
+    if (cached) {
+        print_conn_info(conn, "response 200 cached content", static_cast<int>(fentry->size));
+
+        return espconn_send(conn,
+                            reinterpret_cast<uint8_t*>(const_cast<char*>(cached)),
+                            fentry->head_size + fentry->size) == 0;
+    }
+
+    const auto stream = alloc_stream(conn);
+
+    if ( ! stream)
+        return false;
+
+    print_conn_info(conn, "response 200 content", static_cast<int>(fentry->size));
+
+    if (open_file(fentry, &stream->file) || ! send_file_chunk(conn, stream, fentry)) {
+        os_free(stream);
+        return false;
+    }
+
+    if (stream->file.pos < stream->file.size) {
+        stream->next       = stream_connections;
+        stream_connections = stream;
+    }
+    else
+        os_free(stream);
+
+    return true;
+}
+
+// Reads and verifies the HTTP response head stored with a file into 'head',
+// which must have room for max_file_head_size bytes.
+static bool ICACHE_FLASH_ATTR read_file_head(const file_entry* fentry, uint32_t* head)
+{
+    file_stream head_stream;
+
+    return ! open_file(fentry, &head_stream) &&
+           read_file(&head_stream, head, fentry->head_size) == static_cast<int>(fentry->head_size);
+}
+
+// Derives a new response head from the HTTP response head stored with a file,
+// so that it has the same content type and caching headers.
+//
+// The status line is replaced with 'status' and Content-Length is removed,
+// the caller appends the headers which differ and the terminating CRLF.
+//
+// Returns pointer past the copied headers in 'dst'.
+static char* ICACHE_FLASH_ATTR copy_file_head(char*             dst,
+                                              const char*       status,
+                                              const uint32_t*   stored_head,
+                                              const file_entry* fentry)
+{
+    const char* src = reinterpret_cast<const char*>(stored_head);
+    const char* end = src + fentry->head_size - 2; // keep CRLF of the last header
+
+    const int status_len = os_strlen(status);
+    os_memcpy(dst, status, status_len);
+    dst += status_len;
+
+    bool first_line = true;
+
+    while (src < end) {
+        const char* eol = src;
+        while (eol < end && *eol != '\n')
+            ++eol;
+        if (eol < end)
+            ++eol;
+
+        static const char content_length[] = "Content-Length:";
+
+        if ( ! first_line &&
+            os_memcmp(src, content_length, sizeof(content_length) - 1) != 0) {
+
+            os_memcpy(dst, src, eol - src);
+            dst += eol - src;
+        }
+
+        first_line = false;
+        src        = eol;
+    }
+
+    return dst;
+}
+
+// Starts sending a part of a static file with 206 Partial Content response.
+//
+// The response head is derived from the HTTP response head stored with the file,
+// so it has the same content type, ETag and caching headers.  Only the requested
+// part of the file is read from flash.
+//
+// Returns false if the file could not be read, in which case nothing has been sent.
+static bool ICACHE_FLASH_ATTR start_range_stream(espconn*          conn,
+                                                 const file_entry* fentry,
+                                                 uint32_t          begin,
+                                                 uint32_t          size)
+{
+    uint32_t stored_head[max_file_head_size / sizeof(uint32_t)];
+
+    if ( ! read_file_head(fentry, stored_head))
+        return false;
+
+    const auto stream = alloc_stream(conn);
+
+    if ( ! stream)
+        return false;
+
+    if (open_file_range(fentry, begin, size, &stream->file)) {
+        os_free(stream);
+        return false;
+    }
+
+    // Replace status line and Content-Length and add Content-Range
+    char        head[max_file_head_size + 96];
+    char* const dst = copy_file_head(head, "HTTP/1.1 206 Partial Content\r\n", stored_head, fentry);
+
+    os_sprintf(dst, "Content-Length: %u\r\n"
+                    "Content-Range: bytes %u-%u/%u\r\n"
+                    "\r\n",
+               size,
+               begin,
+               begin + size - 1u,
+               fentry->size);
+
+    print_conn_info(conn, "response 206 content", static_cast<int>(size));
+
+    if (espconn_send(conn, reinterpret_cast<uint8_t*>(head), os_strlen(head)) != 0) {
+        os_free(stream);
+        return false;
+    }
+
+    // The data is sent when the head has been sent
+    stream->next       = stream_connections;
+    stream_connections = stream;
+
+    return true;
+}
+
+// Starts sending a static file with dynamic content inserted at the point marked
+// by mkfs.py, see splice_handler.
+//
+// The response head is derived from the HTTP response head stored with the file,
+// with Content-Length which includes the dynamic content.
+//
+// If the dynamic content could not be generated, e.g. because it does not fit
+// in max_splice_size, the file is sent without it.  The page can still request
+// the data separately.
+//
+// Returns false if the file could not be read, in which case nothing has been sent.
+static bool ICACHE_FLASH_ATTR start_splice_stream(espconn* conn, const file_entry* fentry)
+{
+    uint32_t stored_head[max_file_head_size / sizeof(uint32_t)];
+
+    if ( ! read_file_head(fentry, stored_head))
+        return false;
+
+    const auto stream = alloc_stream(conn);
+
+    if ( ! stream)
+        return false;
+
+    if (open_file_range(fentry, 0u, fentry->size, &stream->file)) {
+        os_free(stream);
+        return false;
+    }
+
+    stream->dynamic = static_cast<char*>(os_malloc(max_splice_size));
+
+    if ( ! stream->dynamic) {
+        os_printf("Error: out of memory\n");
+        os_free(stream);
+        return false;
+    }
+
+    const int dynamic_size = splice_content(stream->dynamic, max_splice_size);
+
+    if (dynamic_size < 0 || dynamic_size > static_cast<int>(max_splice_size))
+        os_printf("Error: dynamic content does not fit in %u bytes\n", max_splice_size);
+
+    if (dynamic_size > 0 && dynamic_size <= static_cast<int>(max_splice_size)) {
+        stream->splice       = fentry->splice;
+        stream->dynamic_size = static_cast<uint32_t>(dynamic_size);
+    }
+    else {
+        os_free(stream->dynamic);
+        stream->dynamic = nullptr;
+    }
+
+    char        head[max_file_head_size + 32];
+    char* const dst = copy_file_head(head, "HTTP/1.1 200 OK\r\n", stored_head, fentry);
+
+    os_sprintf(dst, "Content-Length: %u\r\n"
+                    "\r\n",
+               fentry->size + stream->dynamic_size);
+
+    print_conn_info(conn, "response 200 spliced content",
+                    static_cast<int>(fentry->size + stream->dynamic_size));
+
+    if (espconn_send(conn, reinterpret_cast<uint8_t*>(head), os_strlen(head)) != 0) {
+        free_stream(stream);
+        return false;
+    }
+
+    // The data is sent when the head has been sent
+    stream->next       = stream_connections;
+    stream_connections = stream;
+
+    return true;
+}
+
+static void ICACHE_FLASH_ATTR webserver_sent(void* arg)
+{
+    espconn* const conn = static_cast<espconn*>(arg);
+
+    const auto stream = find_stream_connection(conn);
+    if ( ! stream)
+        return;
+
+    if ( ! send_file_chunk(conn, stream)) {
+        abort_stream(stream);
+        return;
+    }
+
+    if (stream->file.pos == stream->file.size && ! stream->dynamic)
+        free_stream(stream);
 }
 
 static const handler_entry* request_handlers     = nullptr;
@@ -540,6 +1131,12 @@ static void ICACHE_FLASH_ATTR webserver_recv(void* arg, char* pusrdata, unsigned
         return;
     }
 
+    // Another request cannot be answered until the current file has been sent
+    if (find_stream_connection(conn)) {
+        os_printf("Error: request received while sending a file\n");
+        return;
+    }
+
     //========================================================================
     // Extract method, URI, HTTP version and headers
     //========================================================================
@@ -616,7 +1213,7 @@ static void ICACHE_FLASH_ATTR webserver_recv(void* arg, char* pusrdata, unsigned
     for (int i = 0; i < e[uri].len; i++) {
         if (e[uri].text[i] == '?') {
             e[query].text  = &e[uri].text[i + 1];
-            e[query].len   = length - i - 1;
+            e[query].len   = e[uri].len - i - 1;
             e[uri].text[i] = 0;
             e[uri].len     = i;
             break;
@@ -627,26 +1224,31 @@ static void ICACHE_FLASH_ATTR webserver_recv(void* arg, char* pusrdata, unsigned
     // Fix up the URI
     //========================================================================
 
-    // For root URI, use index.html
-    if (e[uri].len == 1 && e[uri].text[0] == '/') {
+    // Skip leading slash
+    if (e[uri].text[0] == '/') {
+        ++e[uri].text;
+        --e[uri].len;
+    }
 
-        static const char index_html[] = "index.html";
-        e[uri].text = const_cast<char*>(&index_html[0]);
-        e[uri].len  = sizeof(index_html) - 1;
+    // To lowercase
+    for (int i = 0; i < e[uri].len; i++) {
+        const char c = e[uri].text[i];
+        if (c >= 'A' && c <= 'Z')
+            e[uri].text[i] = c + 0x20;
     }
-    else {
-        // Skip leading slash
-        if (e[uri].text[0] == '/') {
-            ++e[uri].text;
-            --e[uri].len;
-        }
 
-        // To lowercase
-        for (int i = 0; i < e[uri].len; i++) {
-            const char c = e[uri].text[i];
-            if (c >= 'A' && c <= 'Z')
-                e[uri].text[i] = c + 0x20;
-        }
+    // For root URI and for directories, use index.html in the directory
+    static const char index_html[] = "index.html";
+    char              dir_index[max_filename_size];
+
+    if ((e[uri].len == 0 || e[uri].text[e[uri].len - 1] == '/') &&
+        e[uri].len + sizeof(index_html) <= sizeof(dir_index)) {
+
+        os_memcpy(dir_index, e[uri].text, e[uri].len);
+        os_memcpy(&dir_index[e[uri].len], index_html, sizeof(index_html));
+
+        e[uri].text = dir_index;
+        e[uri].len += sizeof(index_html) - 1;
     }
 
     //========================================================================
@@ -662,32 +1264,61 @@ static void ICACHE_FLASH_ATTR webserver_recv(void* arg, char* pusrdata, unsigned
             // Serve a static file
             // -------------------
 
-            constexpr int head_room = HTTP_HEAD_SIZE;
-            auto fentry = find_file(e[uri].text);
+            // Compressed variants of files are only served through content negotiation
+            const bool is_gz_name = e[uri].len > 3 &&
+                                    os_memcmp(&e[uri].text[e[uri].len - 3], ".gz", 3) == 0;
+
+            // Prefer gzip-compressed variant of the file if the client accepts it
+            auto       fentry    = is_gz_name ? nullptr : find_file(e[uri].text);
+            const auto gz_fentry = is_gz_name ? nullptr : find_gzip_file(e[uri]);
+            const bool gzip      = gz_fentry && accepts_gzip(e[headers]);
+
+            if (gzip)
+                fentry = gz_fentry;
+
+            HTTPStatus status = HTTP_NOT_FOUND;
+
+            if (!fentry) {
+                if (gz_fentry) {
+                    os_printf("Error: file '%s' is only available gzip-compressed\n", e[uri].text);
+                    status = HTTP_NOT_ACCEPTABLE;
+                }
+                else
+                    os_printf("Error: file '%s' not found\n", e[uri].text);
+            }
 
-            if (!fentry)
-                os_printf("Error: file '%s' not found\n", e[uri].text);
+            // Only files with HTTP response head prepared by mkfs.py can be served,
+            // which includes MIME type
+            if (fentry && ! fentry->head_size) {
+                os_printf("Error: cannot detect MIME type for '%s'\n", e[uri].text);
+                fentry = nullptr;
+            }
 
-            const char* mime_type = nullptr;
-            if (fentry) {
-                mime_type = get_mime_type(e[uri].text, e[uri].len);
+            uint32_t range_begin = 0u;
+            uint32_t range_size  = 0u;
+            const HTTPStatus range = fentry ? parse_range(e[headers], *fentry, &range_begin, &range_size)
+                                            : HTTP_OK;
 
-                if (!mime_type)
-                    os_printf("Error: cannot detect MIME type for '%s'\n",
-                              e[uri].text);
+            // Files with dynamic content are always sent as a whole
+            if (fentry && fentry->splice && splice_content) {
+                if ( ! start_splice_stream(conn, fentry))
+                    webserver_send_error(conn, HTTP_INTERNAL_SERVER_ERROR);
             }
 
-            char* file = nullptr;
-            if (mime_type)
-                file = load_file(fentry, head_room);
+            // The file is not read from flash if the client already has it
+            else if (fentry && etag_matches(e[headers], *fentry))
+                webserver_send_not_modified(conn, *fentry, gz_fentry != nullptr);
 
-            if (file) {
-                webserver_send_response(conn, file, mime_type, head_room, fentry->size);
+            else if (range == HTTP_RANGE_NOT_SATISFIABLE)
+                webserver_send_error(conn, range);
 
-                os_free(file);
+            else if (range == HTTP_PARTIAL_CONTENT) {
+                if ( ! start_range_stream(conn, fentry, range_begin, range_size))
+                    webserver_send_error(conn, status);
             }
-            else
-                webserver_send_error(conn, HTTP_NOT_FOUND);
+
+            else if ( ! fentry || ! start_file_stream(conn, fentry))
+                webserver_send_error(conn, status);
         }
         else if (err)
             webserver_send_error(conn, err);
@@ -750,20 +1381,30 @@ static void ICACHE_FLASH_ATTR webserver_listen(void* arg)
     espconn* const conn = static_cast<espconn*>(arg);
 
     espconn_regist_recvcb(conn, webserver_recv);
+    espconn_regist_sentcb(conn, webserver_sent);
     espconn_regist_reconcb(conn, webserver_reconnect);
     espconn_regist_disconcb(conn, webserver_disconnect);
 }
 
+// Maximum number of concurrent connections.  The SDK allows 5 by default, but
+// since the filesystem directory is not kept in RAM, there is enough heap
+// for a few more.
+static constexpr uint8_t max_connections = 8u;
+
 void ICACHE_FLASH_ATTR configure_webserver(const handler_entry* user_request_handlers,
-                                           unsigned             num_user_handlers)
+                                           unsigned             num_user_handlers,
+                                           splice_handler       splice)
 {
     request_handlers     = user_request_handlers;
     request_handlers_end = user_request_handlers + num_user_handlers;
+    splice_content       = splice;
 
     configure_wifi();
 
     configure_mdns();
 
+    espconn_tcp_set_max_con(max_connections);
+
     static espconn conn;
     static esp_tcp tcp;
 
@@ -774,4 +1415,7 @@ void ICACHE_FLASH_ATTR configure_webserver(const handler_entry* user_request_han
     espconn_regist_connectcb(&conn, webserver_listen);
 
     espconn_accept(&conn);
+
+    // Must be set after espconn_accept()
+    espconn_tcp_set_max_con_allow(&conn, max_connections);
 }
@@ -23,8 +23,12 @@ enum HTTPStatus {
     HTTP_RESPONSE_SENT         = 0, // internal, indicates that handler sent a response
     HTTP_CONTINUE              = 100,
     HTTP_OK                    = 200,
+    HTTP_PARTIAL_CONTENT       = 206,
+    HTTP_NOT_MODIFIED          = 304,
     HTTP_BAD_REQUEST           = 400,
     HTTP_NOT_FOUND             = 404,
+    HTTP_NOT_ACCEPTABLE        = 406,
+    HTTP_RANGE_NOT_SATISFIABLE = 416,
     HTTP_INTERNAL_SERVER_ERROR = 500,
     HTTP_SERVICE_UNAVAILABLE   = 503
 };
@@ -41,9 +45,23 @@ struct handler_entry {
     request_handler handler;
 };
 
+// Generates dynamic content which is inserted into a static file at the point
+// marked by mkfs.py, e.g. initial state of a page, so that the page does not
+// need to request it separately.
+//
+// - buf      - buffer for the content
+// - buf_size - size of the buffer
+//
+// Returns size of the content or -1 if it does not fit in the buffer, in which
+// case the file is served without dynamic content.
+typedef int (*splice_handler)(char* buf, int buf_size);
+
 // Configures the webserver, to be called from user_init()
+//
+// Without 'splice', files marked by mkfs.py are served without dynamic content.
 void configure_webserver(const handler_entry* user_request_handlers,
-                         unsigned             num_user_handlers);
+                         unsigned             num_user_handlers,
+                         splice_handler       splice = nullptr);
 
 // Configures NTP, to be called from callback installed with system_init_done_cb()
 void configure_ntp();
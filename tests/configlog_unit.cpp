@@ -1,11 +1,14 @@
 
 #include "mock_access.h"
 #include "../src/configlog.h"
+#include "spi_flash.h"
+#include "user_interface.h"
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 constexpr unsigned sec_per_day     = 60u * 60u * 24u;
-constexpr unsigned num_log_entries = sizeof(config::log) / sizeof(log_entry);
+constexpr unsigned num_log_entries = sizeof(config::log) / sizeof(log_record);
 
 int main(int argc, char* argv[])
 {
@@ -73,8 +76,7 @@ int main(int argc, char* argv[])
         assert(init_filesystem() == 1);
 
         const auto num_log_sectors = get_num_log_sectors();
-        const auto max_log_entries = num_log_sectors * num_log_entries;
-        const auto last_entry      = max_log_entries + 3u;
+        const auto last_entry      = num_log_sectors * num_log_entries + 3u;
 
         for (unsigned i = 0; i <= last_entry; i++) {
 
@@ -83,21 +85,37 @@ int main(int argc, char* argv[])
             assert(log_event(LOG_CONFIG_UPDATE, i));
         }
 
-        for (unsigned i = 0; i < max_log_entries; i++) {
+        // The log has wrapped around and the first sector now only contains
+        // the last four entries, the other sectors are full
+        const auto max_log_entries = (num_log_sectors - 1u) * num_log_entries + 4u;
 
-            log_entry e;
+        log_entry* const history = static_cast<log_entry*>(malloc((max_log_entries + 1u) * sizeof(log_entry)));
+        assert(history);
 
-            assert(get_event_history(i, &e, 1) == 1u);
+        assert(get_event_history(0, history, max_log_entries + 1u) == max_log_entries);
+
+        for (unsigned i = 0; i < max_log_entries; i++) {
 
             const unsigned idx = last_entry - i;
 
-            assert(e.timestamp == (idx + 1u) * sec_per_day);
-            assert(e.event     == LOG_CONFIG_UPDATE);
-            assert(e.data      == idx);
+            assert(history[i].timestamp == (idx + 1u) * sec_per_day);
+            assert(history[i].event     == LOG_CONFIG_UPDATE);
+            assert(history[i].data      == idx);
         }
 
+        free(history);
+
         log_entry e;
 
+        const unsigned offsets[] = { 0u, 3u, 4u, 5u, num_log_entries + 4u, max_log_entries - 1u };
+
+        for (const unsigned i : offsets) {
+
+            assert(get_event_history(i, &e, 1) == 1u);
+
+            assert(e.data == last_entry - i);
+        }
+
         assert(get_event_history(max_log_entries, &e, 1) == 0u);
 
         assert(get_event_history(0, &e, 0) == 0u);
@@ -106,5 +124,613 @@ int main(int argc, char* argv[])
         mock::destroy_filesystem();
     }
 
+    {
+        mock::clear_flash();
+
+        assert(init_filesystem() == 1);
+
+        const auto num_log_sectors = get_num_log_sectors();
+        const auto last_entry      = num_log_sectors / 2u + 1u;
+
+        for (unsigned i = 0; i <= last_entry; i++) {
+
+            mock::set_timestamp((i + 1u) * sec_per_day);
+
+            assert(log_event(LOG_CONFIG_UPDATE, i));
+        }
+
+        mock::reboot();
+
+        assert(init_filesystem() == 1);
+
+        // Searching for the last sector only reads headers, so in total
+        // it reads less than two full sectors
+        const uint64_t busy_before = mock::get_flash_busy_time_us();
+
+        assert(load_config() != nullptr);
+
+        const uint64_t busy_time = mock::get_flash_busy_time_us() - busy_before;
+
+        assert(busy_time < 2u * 4096u / 16u);
+
+        log_entry e;
+
+        assert(get_event_history(0, &e, 1) == 1u);
+
+        assert(e.timestamp == (last_entry + 1u) * sec_per_day);
+        assert(e.event     == LOG_CONFIG_UPDATE);
+        assert(e.data      == last_entry);
+
+        mock::destroy_filesystem();
+    }
+
+    {
+        mock::clear_flash();
+
+        assert(init_filesystem() == 1);
+
+        const auto last_entry = get_num_log_sectors() / 2u;
+
+        for (unsigned i = 0; i <= last_entry; i++) {
+
+            mock::set_timestamp((i + 1u) * sec_per_day);
+
+            assert(log_event(LOG_CONFIG_UPDATE, i));
+        }
+
+        // After a warm reboot, location of the last sector is known from RTC memory
+        mock::reboot();
+
+        assert(init_filesystem() == 1);
+
+        const uint64_t reads_before = mock::get_flash_read_count();
+
+        assert(load_config() != nullptr);
+
+        assert(mock::get_flash_read_count() - reads_before <= 3u);
+
+        log_entry e;
+
+        assert(get_event_history(0, &e, 1) == 1u);
+        assert(e.timestamp == (last_entry + 1u) * sec_per_day);
+        assert(e.data      == last_entry);
+
+        // Record in RTC memory becomes stale if the device is reset after
+        // writing a new sector, but before the record is updated
+        uint32_t rtc[8];
+
+        assert(system_rtc_mem_read(64u, rtc, sizeof(rtc)));
+
+        mock::set_timestamp((last_entry + 2u) * sec_per_day);
+
+        assert(log_event(LOG_CONFIG_UPDATE, last_entry + 1u));
+
+        mock::reboot();
+
+        assert(system_rtc_mem_write(64u, rtc, sizeof(rtc)));
+
+        assert(init_filesystem() == 1);
+
+        assert(get_event_history(0, &e, 1) == 1u);
+        assert(e.timestamp == (last_entry + 2u) * sec_per_day);
+        assert(e.data      == last_entry + 1u);
+
+        // Invalid record in RTC memory is ignored
+        mock::reboot();
+
+        memset(rtc, 0x5A, sizeof(rtc));
+
+        assert(system_rtc_mem_write(64u, rtc, sizeof(rtc)));
+
+        assert(init_filesystem() == 1);
+
+        assert(get_event_history(0, &e, 1) == 1u);
+        assert(e.timestamp == (last_entry + 2u) * sec_per_day);
+        assert(e.data      == last_entry + 1u);
+
+        // Power-on reset clears RTC memory
+        mock::destroy_filesystem();
+        mock::clear_flash();
+
+        assert(init_filesystem() == 1);
+
+        assert(get_event_history(0, &e, 1) == 0u);
+
+        mock::destroy_filesystem();
+    }
+
+    {
+        mock::clear_flash();
+
+        assert(init_filesystem() == 1);
+
+        mock::set_timestamp(sec_per_day);
+
+        // The first event writes a new sector
+        assert(log_event(LOG_BOOT, LOG_BOOT_POWER_ON));
+
+        // Further events are appended to the same sector without erasing it
+        const uint64_t erases_before = mock::get_flash_erase_count();
+        const uint64_t busy_before   = mock::get_flash_busy_time_us();
+
+        for (unsigned i = 1; i < 100u; i++) {
+
+            mock::set_timestamp(sec_per_day + i);
+
+            assert(log_event(LOG_MOISTURE, i));
+        }
+
+        assert(mock::get_flash_erase_count() == erases_before);
+
+        // All of them together take less time than writing one sector
+        assert(mock::get_flash_busy_time_us() - busy_before < 4096u * 2800u / 1024u);
+
+        // Record from an interrupted write is skipped
+        config* const cfg = static_cast<config*>(load_config());
+        assert(cfg);
+
+        const log_record torn = { { ~0u, LOG_MOISTURE, 0u }, 0u };
+
+        assert(append_config(reinterpret_cast<char*>(&cfg->log[100]) - reinterpret_cast<char*>(cfg),
+                             &torn, sizeof(torn)) == 0);
+
+        // Records cannot be overwritten
+        assert(append_config(reinterpret_cast<char*>(&cfg->log[99]) - reinterpret_cast<char*>(cfg),
+                             &torn, sizeof(torn)) == 1);
+
+        // Settings cannot be modified by appending
+        assert(append_config(0u, &torn, sizeof(torn)) == 1);
+
+        mock::set_timestamp(sec_per_day + 100u);
+
+        assert(log_event(LOG_MOISTURE, 100u));
+
+        mock::reboot();
+
+        assert(init_filesystem() == 1);
+
+        log_entry e[102];
+
+        assert(get_event_history(0, e, 102u) == 101u);
+
+        for (unsigned i = 0; i < 100u; i++) {
+            assert(e[i].timestamp == sec_per_day + 100u - i);
+            assert(e[i].event     == LOG_MOISTURE);
+            assert(e[i].data      == 100u - i);
+        }
+
+        assert(e[100].event == LOG_BOOT);
+
+        // Once the sector is full, a new one is written
+        mock::set_timestamp(sec_per_day * 2u);
+
+        for (unsigned i = 102u; i < num_log_entries; i++)
+            assert(log_event(LOG_MOISTURE, i));
+
+        const uint32_t id = load_config()->id;
+
+        assert(log_event(LOG_MOISTURE, 0u));
+
+        assert(load_config()->id == id + 1u);
+
+        assert(get_event_history(0, e, 2u) == 2u);
+        assert(e[0].data == 0u);
+        assert(e[1].data == num_log_entries - 1u);
+
+        mock::destroy_filesystem();
+    }
+
+    {
+        mock::clear_flash();
+
+        assert(init_filesystem() == 1);
+
+        // Nothing to write
+        assert(flush_config());
+
+        config* cfg = get_config();
+        assert(cfg);
+
+        // Changes made in quick succession are not written immediately
+        const uint64_t writes_before = mock::get_flash_write_count();
+
+        for (unsigned i = 0; i < num_zones; i++) {
+            cfg->zones[i].time_min = 10u + i;
+            defer_save_config();
+
+            cfg->zones[i].name[0] = static_cast<char>('A' + i);
+            defer_save_config();
+        }
+
+        assert(mock::get_flash_write_count() == writes_before);
+
+        // Write fails without time and it is retried later
+        mock::run_timers();
+
+        assert(mock::get_flash_write_count() == writes_before);
+        assert(cfg->id == ~0u);
+
+        mock::set_timestamp(sec_per_day);
+
+        // All changes are written together when a timer expires
+        mock::run_timers();
+
+        assert(mock::get_flash_write_count() == writes_before + 1u);
+        assert(cfg->id == 0u);
+
+        // No more writes
+        mock::run_timers();
+
+        assert(mock::get_flash_write_count() == writes_before + 1u);
+
+        // Explicit flush
+        mock::set_timestamp(sec_per_day + 10u);
+
+        cfg->enabled = true;
+        defer_save_config();
+
+        assert(flush_config());
+        assert(cfg->id == 1u);
+
+        mock::run_timers();
+
+        assert(cfg->id == 1u);
+
+        // Pending changes are written together with a new sector for the log
+        mock::set_timestamp(sec_per_day + 20u);
+
+        cfg->start_time       = 300u;
+        cfg->moisture_enabled = true;
+        defer_save_config();
+
+        for (unsigned i = 0; i < num_log_entries; i++)
+            assert(log_event(LOG_MOISTURE, i));
+
+        assert(cfg->id == 1u);
+
+        assert(log_event(LOG_MOISTURE, num_log_entries));
+
+        assert(cfg->id == 2u);
+
+        assert(flush_config());
+
+        mock::run_timers();
+
+        assert(cfg->id == 2u);
+
+        mock::reboot();
+
+        assert(init_filesystem() == 1);
+
+        cfg = get_config();
+        assert(cfg);
+
+        assert(cfg->id == 2u);
+        assert(cfg->enabled);
+        assert(cfg->moisture_enabled);
+        assert(cfg->start_time == 300u);
+
+        for (unsigned i = 0; i < num_zones; i++) {
+            assert(cfg->zones[i].time_min == 10u + i);
+            assert(cfg->zones[i].name[0]  == static_cast<char>('A' + i));
+        }
+
+        // Changes which have not been written yet are lost on reboot
+        cfg->enabled = false;
+        defer_save_config();
+
+        mock::reboot();
+
+        assert(init_filesystem() == 1);
+
+        assert(get_config()->enabled);
+
+        mock::destroy_filesystem();
+    }
+
+    {
+        mock::clear_flash();
+
+        assert(init_filesystem() == 1);
+
+        mock::set_timestamp(sec_per_day);
+
+        config* cfg = get_config();
+        assert(cfg);
+
+        cfg->zones[0].time_min = 15u;
+        cfg->start_time        = 360u;
+        defer_save_config();
+
+        assert(flush_config());
+        assert(cfg->id == 0u);
+
+        const uint64_t writes_before = mock::get_flash_write_count();
+
+        // Saving the same settings again does not write anything
+        mock::set_timestamp(sec_per_day + 10u);
+
+        cfg->zones[0].time_min = 15u;
+        defer_save_config();
+
+        assert(flush_config());
+        assert(cfg->id == 0u);
+
+        // Settings which were changed back are not written either
+        cfg->start_time = 420u;
+        defer_save_config();
+
+        cfg->start_time = 360u;
+        defer_save_config();
+
+        mock::run_timers();
+
+        assert(cfg->id == 0u);
+        assert(mock::get_flash_write_count() == writes_before);
+
+        // Log entries do not count as changes
+        assert(log_event(LOG_MOISTURE, 50u));
+
+        defer_save_config();
+
+        assert(flush_config());
+        assert(cfg->id == 0u);
+
+        // Actual change is written
+        cfg->zones[1].dow = true;
+        defer_save_config();
+
+        assert(flush_config());
+        assert(cfg->id == 1u);
+
+        mock::reboot();
+
+        assert(init_filesystem() == 1);
+
+        cfg = get_config();
+        assert(cfg);
+
+        assert(cfg->id == 1u);
+        assert(cfg->zones[0].time_min == 15u);
+        assert(cfg->zones[1].dow);
+        assert(cfg->start_time == 360u);
+
+        mock::destroy_filesystem();
+    }
+
+    {
+        mock::clear_flash();
+
+        assert(init_filesystem() == 1);
+
+        // Log written by older firmware, without layout magic and with log entries
+        // covered by the checksum of the sector
+        const uint32_t log_addr = mock::get_log_addr();
+
+        constexpr uint32_t old_first_timestamp = 1000u;
+
+        struct legacy_settings {
+            zone_settings zones[num_zones];
+            uint32_t      last_watering;
+            uint16_t      start_time : 11;
+            bool          enabled : 1;
+            bool          moisture_enabled : 1;
+            uint16_t      last_log_idx;
+            uint16_t      moisture_threshold;
+        };
+
+        constexpr uint32_t legacy_header_size = 16u;
+
+        const auto write_legacy_sector = [&](uint32_t idx, bool corrupt) {
+            uint32_t sector[4096u / 4u];
+            memset(sector, 0, sizeof(sector));
+
+            sector[1] = idx;
+            sector[2] = old_first_timestamp + idx * sec_per_day;
+            sector[3] = old_first_timestamp;
+
+            legacy_settings settings;
+            memset(&settings, 0, sizeof(settings));
+
+            for (uint32_t i = 0; i < num_zones; i++) {
+                settings.zones[i].order    = static_cast<zone_order>(num_zones - i);
+                settings.zones[i].time_min = 10u + idx;
+                settings.zones[i].name[0]  = static_cast<char>('A' + i);
+            }
+            settings.last_watering      = sector[2];
+            settings.start_time         = 300u;
+            settings.enabled            = true;
+            settings.last_log_idx       = 2u;
+            settings.moisture_threshold = 70u;
+
+            memcpy(reinterpret_cast<char*>(sector) + legacy_header_size, &settings, sizeof(settings));
+
+            // Old log entries
+            for (uint32_t j = legacy_header_size + sizeof(settings); j < sizeof(sector); j++)
+                reinterpret_cast<uint8_t*>(sector)[j] = static_cast<uint8_t>(j);
+
+            for (uint32_t j = 1; j < sizeof(sector) / sizeof(sector[0]); j++)
+                sector[0] -= sector[j];
+
+            if (corrupt)
+                ++sector[0];
+
+            assert(spi_flash_write(log_addr + idx * 4096u, sector, sizeof(sector)) == SPI_FLASH_RESULT_OK);
+        };
+
+        for (uint32_t i = 0; i < 3u; i++)
+            write_legacy_sector(i, false);
+
+        // Boots with the old configuration and empty log
+        config* cfg = get_config();
+        assert(cfg);
+
+        assert(cfg->id == 2u);
+        assert(cfg->enabled);
+        assert( ! cfg->moisture_enabled);
+        assert(cfg->start_time         == 300u);
+        assert(cfg->moisture_threshold == 70u);
+        assert(cfg->last_watering      == old_first_timestamp + 2u * sec_per_day);
+
+        for (uint32_t i = 0; i < num_zones; i++) {
+            assert(cfg->zones[i].order    == static_cast<zone_order>(num_zones - i));
+            assert(cfg->zones[i].time_min == 12u);
+            assert(cfg->zones[i].name[0]  == static_cast<char>('A' + i));
+        }
+
+        log_entry e;
+
+        assert(get_event_history(0, &e, 1) == 0u);
+
+        // New log continues after the old one, with the converted configuration
+        mock::set_timestamp(old_first_timestamp + 3u * sec_per_day);
+
+        assert(log_event(LOG_BOOT, LOG_BOOT_POWER_ON));
+
+        assert(cfg->id == 3u);
+        assert(cfg->first_timestamp == old_first_timestamp);
+
+        // The conversion has been saved together with the new sector
+        assert(flush_config());
+        assert(cfg->id == 3u);
+
+        mock::reboot();
+
+        assert(init_filesystem() == 1);
+
+        cfg = get_config();
+        assert(cfg);
+
+        assert(cfg->id == 3u);
+        assert(cfg->start_time         == 300u);
+        assert(cfg->moisture_threshold == 70u);
+        assert(cfg->zones[5].order     == ZONE_1);
+        assert(cfg->zones[5].time_min  == 12u);
+
+        assert(get_event_history(0, &e, 1) == 1u);
+        assert(e.event == LOG_BOOT);
+
+        assert(get_event_history(1, &e, 1) == 0u);
+
+        mock::destroy_filesystem();
+
+        // If the last old sector is corrupted, the configuration is taken from
+        // the previous one
+        mock::clear_flash();
+
+        assert(init_filesystem() == 1);
+
+        for (uint32_t i = 0; i < 3u; i++)
+            write_legacy_sector(i, i == 2u);
+
+        cfg = get_config();
+        assert(cfg);
+
+        assert(cfg->id == 1u);
+        assert(cfg->start_time        == 300u);
+        assert(cfg->zones[0].time_min == 11u);
+
+        // The corrupted sector is replaced
+        mock::set_timestamp(old_first_timestamp + 3u * sec_per_day);
+
+        assert(log_event(LOG_BOOT, LOG_BOOT_POWER_ON));
+
+        assert(cfg->id == 2u);
+
+        mock::reboot();
+
+        assert(init_filesystem() == 1);
+
+        cfg = get_config();
+        assert(cfg);
+
+        assert(cfg->id == 2u);
+        assert(cfg->zones[0].time_min == 11u);
+
+        assert(get_event_history(0, &e, 1) == 1u);
+        assert(e.event == LOG_BOOT);
+
+        mock::destroy_filesystem();
+    }
+
+    {
+        mock::clear_flash();
+
+        assert(init_filesystem() == 1);
+
+        mock::set_timestamp(sec_per_day);
+
+        config* cfg = get_config();
+        assert(cfg);
+
+        cfg->zones[0].time_min = 15u;
+        defer_save_config();
+        assert(flush_config());
+
+        assert(log_event(LOG_MOISTURE, 40u));
+
+        mock::set_timestamp(sec_per_day + 10u);
+
+        cfg->zones[0].time_min = 20u;
+        defer_save_config();
+        assert(flush_config());
+
+        assert(cfg->id == 1u);
+
+        // Power loss while writing the last sector leaves it corrupted
+        const uint32_t zero = 0u;
+        assert(spi_flash_write(mock::get_log_addr() + 4096u + sizeof(config_base),
+                               const_cast<uint32_t*>(&zero), sizeof(zero)) == SPI_FLASH_RESULT_OK);
+
+        mock::reboot();
+
+        assert(init_filesystem() == 1);
+
+        // The previous sector is loaded, with its log
+        cfg = get_config();
+        assert(cfg);
+
+        assert(cfg->id == 0u);
+        assert(cfg->zones[0].time_min == 15u);
+
+        log_entry e[2];
+
+        assert(get_event_history(0, e, 2) == 1u);
+        assert(e[0].event == LOG_MOISTURE);
+        assert(e[0].data  == 40u);
+
+        // The log continues in the previous sector
+        mock::set_timestamp(sec_per_day + 20u);
+
+        assert(log_event(LOG_MOISTURE, 41u));
+
+        assert(cfg->id == 0u);
+        assert(get_event_history(0, e, 2) == 2u);
+        assert(e[0].data == 41u);
+
+        // The corrupted sector is replaced on next save
+        cfg->zones[0].time_min = 25u;
+        defer_save_config();
+        assert(flush_config());
+
+        assert(cfg->id == 1u);
+
+        mock::reboot();
+
+        assert(init_filesystem() == 1);
+
+        cfg = get_config();
+        assert(cfg);
+
+        assert(cfg->id == 1u);
+        assert(cfg->zones[0].time_min == 25u);
+
+        assert(get_event_history(0, e, 2) == 2u);
+        assert(e[0].data == 41u);
+        assert(e[1].data == 40u);
+
+        mock::destroy_filesystem();
+    }
+
     return 0;
 }
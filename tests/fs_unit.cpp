@@ -2,8 +2,10 @@
 #include "mock_access.h"
 #include "../src/filesystem.h"
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <chrono>
 
 constexpr uint32_t sec_size = 0x1000u;
 
@@ -98,6 +100,33 @@ int main(int argc, char* argv[])
         mock::destroy_filesystem();
     }
 
+    // Reject directory which is not sorted
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc files[] = {
+            { "a", "1" },
+            { "b", "2" }
+        };
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+
+        assert(init_filesystem() == 0);
+
+        mock::fsmaker maker;
+        maker.construct(files, sizeof(files) / sizeof(files[0]));
+
+        // Swap names of the files, the checksum remains the same
+        filesystem* const fs = static_cast<filesystem*>(maker.get_buffer());
+        const uint32_t name = fs->entries[0].name;
+        fs->entries[0].name = fs->entries[1].name;
+        fs->entries[1].name = name;
+
+        assert(write_fs(0u, static_cast<const char*>(maker.get_buffer()), maker.get_size()) == 1);
+
+        mock::destroy_filesystem();
+    }
+
     // Write file system, one sector
     {
         mock::clear_flash();
@@ -165,7 +194,7 @@ int main(int argc, char* argv[])
         assert(write_fs(0u, static_cast<const char*>(maker.get_buffer()), maker.get_size()) == 0);
 
         // Bad number of files
-        fs->num_files = 146;
+        fs->num_files = max_files + 1u;
         assert(write_fs(0u, static_cast<const char*>(maker.get_buffer()), maker.get_size()) == 1);
 
         mock::destroy_filesystem();
@@ -180,20 +209,22 @@ int main(int argc, char* argv[])
         // Filesystem not initialized, cannot write
         assert(write_fs(sec_size, stuff, sizeof(stuff)) == 1);
 
-        // Init some dummy filesystem
-        static const mock::file_desc files[] = {
-            { "x", "x" }
+        // Start writing a filesystem which spans the entire available area
+        const size_t big_size = max_fs_size - 64u;
+        char* const big_contents = static_cast<char*>(malloc(big_size + 1u));
+        memset(big_contents, 'x', big_size);
+        big_contents[big_size] = 0;
+
+        const mock::file_desc files[] = {
+            { "x", big_contents }
         };
         mock::fsmaker maker;
         maker.construct(files, sizeof(files) / sizeof(files[0]));
-        assert(write_fs(0u, static_cast<const char*>(maker.get_buffer()), maker.get_size()) == 0);
+        assert(write_fs(0u, static_cast<const char*>(maker.get_buffer()), sec_size) == 0);
 
         // Write to next sector OK
         assert(write_fs(sec_size, stuff, sizeof(stuff)) == 0);
 
-        // Write to last sector OK
-        assert(write_fs(max_fs_size - sec_size, stuff, sizeof(stuff)) == 0);
-
         // Cannot write beyond the end of the available area
         assert(write_fs(max_fs_size, stuff, sizeof(stuff)) == 1);
 
@@ -203,6 +234,900 @@ int main(int argc, char* argv[])
         assert(write_fs(0x1100u, stuff, sizeof(stuff)) == 1);
         assert(write_fs(0x1F00u, stuff, sizeof(stuff)) == 1);
 
+        // Write to last sector OK, but the filesystem is not complete
+        const auto last = max_fs_size - sec_size;
+        assert(write_fs(last, static_cast<const char*>(maker.get_buffer()) + last, maker.get_size() - last) == 0);
+        assert(find_file("x") == nullptr);
+
+        // Sectors in the middle have not been written, so the filesystem is corrupted
+        assert(commit_fs_update(0u) == 1);
+        assert(find_file("x") == nullptr);
+
+        // The write has been aborted
+        assert(write_fs(sec_size, stuff, sizeof(stuff)) == 1);
+
+        free(big_contents);
+
+        mock::destroy_filesystem();
+    }
+
+    // New filesystem is written to the inactive slot
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc old_files[] = {
+            { "a", "old" }
+        };
+
+        mock::load_fs_from_memory(old_files, sizeof(old_files) / sizeof(old_files[0]));
+
+        assert(init_filesystem() == 0);
+        assert(mock::get_fs_offset() == 0u);
+
+        // New filesystem spans several sectors
+        const size_t big_size = 3u * sec_size;
+        char* const big_contents = static_cast<char*>(malloc(big_size + 1u));
+        for (size_t i = 0; i < big_size; i++)
+            big_contents[i] = static_cast<char>('a' + i % 26u);
+        big_contents[big_size] = 0;
+
+        const mock::file_desc new_files[] = {
+            { "a", "new" },
+            { "b", big_contents }
+        };
+
+        mock::fsmaker maker;
+        maker.construct(new_files, sizeof(new_files) / sizeof(new_files[0]));
+        const char* const image = static_cast<const char*>(maker.get_buffer());
+        const uint32_t    size  = static_cast<uint32_t>(maker.get_size());
+        assert(size > 3u * sec_size);
+
+        const auto check_contents = [](const char* expected) {
+            const auto a = find_file("a");
+            assert(a != nullptr);
+            char* const buf = load_file(a);
+            assert(buf != nullptr);
+            assert(memcmp(buf, expected, 3u) == 0);
+            free(buf);
+        };
+
+        // The old filesystem is used until the new one has been written
+        assert(write_fs(0u, image, sec_size) == 0);
+        assert(write_fs(sec_size, image + sec_size, sec_size) == 0);
+        check_contents("old");
+        assert(find_file("b") == nullptr);
+
+        // Interrupted write does not affect the old filesystem
+        mock::reboot();
+        assert(init_filesystem() == 0);
+        check_contents("old");
+
+        const auto write_image = [](const char* data, uint32_t data_size) -> int {
+            int err = 0;
+            for (uint32_t offset = 0; offset < data_size && ! err; offset += sec_size) {
+                const uint32_t left = data_size - offset;
+                err = write_fs(offset, data + offset, left < sec_size ? left : sec_size);
+            }
+            return err;
+        };
+
+        // Switch to the new filesystem after the last sector has been written
+        assert(write_image(image, size) == 0);
+        check_contents("new");
+        assert(find_file("b") != nullptr);
+        const auto new_offset = mock::get_fs_offset();
+        assert(new_offset != 0u);
+
+        mock::reboot();
+        assert(init_filesystem() == 0);
+        assert(mock::get_fs_offset() == new_offset);
+        check_contents("new");
+
+        // Corrupted filesystem is rejected and the current one remains in use
+        char* const bad_image = static_cast<char*>(malloc(size));
+        memcpy(bad_image, image, size);
+        bad_image[size - 2u] ^= 1;
+
+        assert(write_image(bad_image, size) == 1);
+        assert(mock::get_fs_offset() == new_offset);
+        check_contents("new");
+
+        mock::reboot();
+        assert(init_filesystem() == 0);
+        assert(mock::get_fs_offset() == new_offset);
+        check_contents("new");
+
+        // Slots alternate
+        assert(write_image(image, size) == 0);
+        assert(mock::get_fs_offset() == 0u);
+        check_contents("new");
+
+        free(bad_image);
+        free(big_contents);
+
+        mock::destroy_filesystem();
+    }
+
+    // Uploaded files are verified while they are received
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc old_files[] = {
+            { "small", "old" }
+        };
+
+        mock::load_fs_from_memory(old_files, sizeof(old_files) / sizeof(old_files[0]));
+
+        assert(init_filesystem() == 0);
+
+        char big1[6001];
+        char big2[6001];
+        memset(big1, 'a', 6000u);
+        memset(big2, 'b', 6000u);
+        big1[6000] = 0;
+        big2[6000] = 0;
+
+        const mock::file_desc new_files[] = {
+            { "big1",  big1 },
+            { "big2",  big2 },
+            { "small", "new" }
+        };
+
+        mock::fsmaker maker;
+        maker.construct(new_files, sizeof(new_files) / sizeof(new_files[0]));
+        char* const    image = static_cast<char*>(maker.get_buffer());
+        const uint32_t size  = static_cast<uint32_t>(maker.get_size());
+
+        const uint32_t last_offset = (size - 1u) / sec_size * sec_size;
+        assert(last_offset >= 2u * sec_size);
+
+        // Returns offset of the sector at which the write failed, or ~0u on success
+        const auto write_image = [&]() -> uint32_t {
+            for (uint32_t offset = 0; offset < size; offset += sec_size) {
+                const uint32_t left = size - offset;
+                if (write_fs(offset, image + offset, left < sec_size ? left : sec_size))
+                    return offset;
+            }
+            return ~0u;
+        };
+
+        const auto check_small = [](const char* expected) {
+            const auto small = find_file("small");
+            assert(small != nullptr);
+            char* const buf = load_file(small);
+            assert(buf != nullptr);
+            assert(memcmp(buf, expected, 3u) == 0);
+            free(buf);
+        };
+
+        // Corruption of the first file is detected at the sector which contains
+        // its last byte, the rest of the image is not written
+        const file_entry& big1_entry = static_cast<const filesystem*>(maker.get_buffer())->entries[0];
+        const uint32_t    big1_end   = big1_entry.offset + big1_entry.size - 1u;
+        assert(big1_end / sec_size * sec_size < last_offset);
+
+        image[big1_entry.offset + 10u] ^= 1;
+        assert(write_image() == big1_end / sec_size * sec_size);
+        check_small("old");
+        image[big1_entry.offset + 10u] ^= 1;
+
+        // A valid image is committed without reading the files back from flash
+        auto num_reads = mock::get_flash_read_count();
+        assert(write_image() == ~0u);
+        const auto stream_reads = mock::get_flash_read_count() - num_reads;
+        check_small("new");
+
+        // Sectors uploaded in any order are verified from flash on commit
+        num_reads = mock::get_flash_read_count();
+        assert(begin_fs_update() == 0);
+        for (uint32_t offset = last_offset + sec_size; offset; offset -= sec_size) {
+            const uint32_t left = size - (offset - sec_size);
+            assert(update_fs(offset - sec_size, image + offset - sec_size, left < sec_size ? left : sec_size) == 0);
+        }
+        assert(commit_fs_update(0u) == 0);
+        const auto commit_reads = mock::get_flash_read_count() - num_reads;
+        check_small("new");
+
+        assert(stream_reads < commit_reads);
+
+        mock::reboot();
+        assert(init_filesystem() == 0);
+        check_small("new");
+
+        mock::destroy_filesystem();
+    }
+
+    // Files following a directory which spans several sectors are verified while they are received
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc old_files[] = {
+            { "small", "old" }
+        };
+
+        mock::load_fs_from_memory(old_files, sizeof(old_files) / sizeof(old_files[0]));
+
+        assert(init_filesystem() == 0);
+
+        constexpr uint32_t num_new_files = 160u;
+
+        static char            names[num_new_files][16];
+        static char            contents[num_new_files][64];
+        static mock::file_desc new_files[num_new_files];
+
+        for (uint32_t i = 0; i < num_new_files; i++) {
+            snprintf(names[i], sizeof(names[i]), "file%03u", i);
+            snprintf(contents[i], sizeof(contents[i]), "contents of file number %u", i);
+            new_files[i] = { names[i], contents[i] };
+        }
+
+        mock::fsmaker maker;
+        maker.construct(new_files, num_new_files);
+        char* const    image = static_cast<char*>(maker.get_buffer());
+        const uint32_t size  = static_cast<uint32_t>(maker.get_size());
+
+        const filesystem* const hdr = static_cast<const filesystem*>(maker.get_buffer());
+        assert(hdr->dir_size > sec_size);
+
+        // File whose data comes first after the directory
+        const file_entry* first = &hdr->entries[0];
+        for (uint32_t i = 1; i < num_new_files; i++)
+            if (hdr->entries[i].offset < first->offset)
+                first = &hdr->entries[i];
+
+        const uint32_t first_sector = (first->offset + first->size - 1u) / sec_size * sec_size;
+        assert(first_sector + sec_size < size);
+
+        const auto write_image = [&]() -> uint32_t {
+            for (uint32_t offset = 0; offset < size; offset += sec_size) {
+                const uint32_t left = size - offset;
+                if (write_fs(offset, image + offset, left < sec_size ? left : sec_size))
+                    return offset;
+            }
+            return ~0u;
+        };
+
+        // Corruption is detected at the sector which contains the end of the file
+        image[first->offset + 1u] ^= 1;
+        assert(write_image() == first_sector);
+        image[first->offset + 1u] ^= 1;
+
+        // A valid image is committed without reading the files back from flash
+        auto num_reads = mock::get_flash_read_count();
+        assert(write_image() == ~0u);
+        const auto stream_reads = mock::get_flash_read_count() - num_reads;
+
+        num_reads = mock::get_flash_read_count();
+        assert(begin_fs_update() == 0);
+        for (uint32_t offset = 0; offset < size; offset += sec_size) {
+            const uint32_t left = size - offset;
+            assert(update_fs(offset, image + offset, left < sec_size ? left : sec_size) == 0);
+        }
+        assert(commit_fs_update(0u) == 0);
+        const auto commit_reads = mock::get_flash_read_count() - num_reads;
+
+        assert(stream_reads < commit_reads);
+
+        const auto f = find_file("file123");
+        assert(f != nullptr);
+
+        mock::destroy_filesystem();
+    }
+
+    // Differential update uploads only sectors which have changed
+    {
+        mock::clear_flash();
+
+        char big1[5001];
+        char big2[5001];
+        memset(big1, 'a', 5000u);
+        memset(big2, 'b', 5000u);
+        big1[5000] = 0;
+        big2[5000] = 0;
+
+        const mock::file_desc files_v1[] = {
+            { "big1",  big1 },
+            { "big2",  big2 },
+            { "small", "v1" }
+        };
+        const mock::file_desc files_v2[] = {
+            { "big1",  big1 },
+            { "big2",  big2 },
+            { "small", "v2" }
+        };
+
+        // Hash of a sector of an image, as it is stored in flash
+        const auto image_hash = [](const mock::fsmaker& maker, uint32_t sector) -> uint32_t {
+            const uint8_t* const image = static_cast<const uint8_t*>(maker.get_buffer());
+            const uint32_t       size  = static_cast<uint32_t>(maker.get_size());
+            const uint32_t       end   = mock::align_up<uint32_t, 4>(size);
+
+            uint32_t hash = 2166136261u;
+            for (uint32_t i = sector * sec_size; i < (sector + 1u) * sec_size; i++) {
+                const uint8_t byte = i < size ? image[i] : i < end ? 0u : 0xFFu;
+                hash = (hash ^ byte) * 16777619u;
+            }
+            return hash;
+        };
+
+        // Performs a differential update like the upload tool does,
+        // returns the number of uploaded sectors
+        const auto diff_update = [&](const mock::fsmaker& maker) -> uint32_t {
+            const char* const image = static_cast<const char*>(maker.get_buffer());
+            const uint32_t    size  = static_cast<uint32_t>(maker.get_size());
+
+            assert(begin_fs_update() == 0);
+
+            uint32_t uploaded = 0u;
+            uint32_t copy     = 0u;
+
+            for (uint32_t sector = 0; sector * sec_size < size; sector++) {
+                const uint32_t hash = image_hash(maker, sector);
+
+                uint32_t target_hash = 0u;
+                uint32_t active_hash = 0u;
+                assert(get_fs_sector_hash(true, sector, &target_hash) == 0);
+                assert(get_fs_sector_hash(false, sector, &active_hash) == 0);
+
+                if (hash == target_hash)
+                    continue;
+
+                if (hash == active_hash) {
+                    copy |= 1u << sector;
+                    continue;
+                }
+
+                const uint32_t offset = sector * sec_size;
+                const uint32_t left   = size - offset;
+                assert(update_fs(offset, image + offset, left < sec_size ? left : sec_size) == 0);
+                ++uploaded;
+            }
+
+            assert(commit_fs_update(copy) == 0);
+
+            return uploaded;
+        };
+
+        const auto check_small = [](const char* expected) {
+            const auto small = find_file("small");
+            assert(small != nullptr);
+            char* const buf = load_file(small);
+            assert(buf != nullptr);
+            assert(memcmp(buf, expected, 2u) == 0);
+            free(buf);
+        };
+
+        mock::fsmaker maker_v1;
+        maker_v1.construct(files_v1, sizeof(files_v1) / sizeof(files_v1[0]));
+        mock::fsmaker maker_v2;
+        maker_v2.construct(files_v2, sizeof(files_v2) / sizeof(files_v2[0]));
+
+        const uint32_t num_sectors = static_cast<uint32_t>((maker_v1.get_size() - 1u) / sec_size + 1u);
+        assert(num_sectors == 3u);
+
+        // Nothing is installed, the entire image is uploaded
+        assert(diff_update(maker_v1) == num_sectors);
+        check_small("v1");
+
+        // Only the directory and the changed file are uploaded, the other sector is copied
+        assert(diff_update(maker_v2) == 2u);
+        check_small("v2");
+        assert(find_file("big1") != nullptr);
+
+        // The other slot already contains everything
+        assert(diff_update(maker_v1) == 0u);
+        check_small("v1");
+
+        mock::reboot();
+        assert(init_filesystem() == 0);
+        check_small("v1");
+
+        // Sectors which are not uploaded or copied are left as they were, so the new
+        // directory does not match the file left over from v2 in the other slot
+        assert(begin_fs_update() == 0);
+        assert(update_fs(0u, static_cast<const char*>(maker_v1.get_buffer()), sec_size) == 0);
+        assert(commit_fs_update(0u) == 1);
+        check_small("v1");
+
+        // Hashes are only available for the filesystem area
+        uint32_t hash = 0u;
+        assert(get_fs_sector_hash(false, max_fs_sectors - 1u, &hash) == 0);
+        assert(get_fs_sector_hash(false, max_fs_sectors, &hash) == 1);
+
+        // Update must be started first
+        assert(update_fs(0u, static_cast<const char*>(maker_v2.get_buffer()), sec_size) == 1);
+        assert(commit_fs_update(0u) == 1);
+
+        mock::destroy_filesystem();
+    }
+
+    // Commit record survives power loss between erasing and writing it
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc files_v1[] = { { "a", "v1" } };
+        static const mock::file_desc files_v2[] = { { "a", "v2" } };
+        static const mock::file_desc files_v3[] = { { "a", "v3" } };
+        static const mock::file_desc files_v4[] = { { "a", "v4" } };
+        static const mock::file_desc files_v5[] = { { "a", "v5" } };
+
+        mock::load_fs_from_memory(files_v1, 1u);
+        assert(init_filesystem() == 0);
+
+        const auto check_contents = [](const char* expected) {
+            const auto a = find_file("a");
+            assert(a != nullptr);
+            char* const buf = load_file(a);
+            assert(buf != nullptr);
+            assert(memcmp(buf, expected, 2u) == 0);
+            free(buf);
+        };
+
+        const auto write_image = [](const mock::file_desc* files) {
+            mock::fsmaker maker;
+            maker.construct(files, 1u);
+            assert(write_fs(0u, static_cast<const char*>(maker.get_buffer()), maker.get_size()) == 0);
+        };
+
+        // Both copies of the commit record have been written
+        write_image(files_v2);
+        write_image(files_v3);
+        write_image(files_v4);
+        check_contents("v4");
+
+        const auto old_offset = mock::get_fs_offset();
+        assert(old_offset != 0u);
+
+        // The older copy of the record is erased, but power is lost before it is written
+        mock::fsmaker maker;
+        maker.construct(files_v5, 1u);
+
+        assert(begin_fs_update() == 0);
+        assert(update_fs(0u, static_cast<const char*>(maker.get_buffer()), maker.get_size()) == 0);
+
+        const uint64_t erase_count = mock::get_flash_erase_count();
+        mock::fail_next_flash_write();
+        assert(commit_fs_update(0u) == 1);
+        assert(mock::get_flash_erase_count() == erase_count + 1u);
+
+        // The slot which was active before remains active, even though the other
+        // slot contains a valid image
+        mock::reboot();
+        assert(init_filesystem() == 0);
+        assert(mock::get_fs_offset() == old_offset);
+        check_contents("v4");
+
+        // Next upload completes
+        write_image(files_v5);
+        check_contents("v5");
+
+        mock::reboot();
+        assert(init_filesystem() == 0);
+        assert(mock::get_fs_offset() == 0u);
+        check_contents("v5");
+
+        mock::destroy_filesystem();
+    }
+
+    // Sectors which already contain the same data are not erased or written
+    {
+        mock::clear_flash();
+
+        char big[5001];
+        memset(big, 'a', 5000u);
+        big[5000] = 0;
+
+        const mock::file_desc files_v1[] = {
+            { "big",   big  },
+            { "small", "v1" }
+        };
+        const mock::file_desc files_v2[] = {
+            { "big",   big  },
+            { "small", "v2" }
+        };
+
+        mock::fsmaker maker_v1;
+        maker_v1.construct(files_v1, sizeof(files_v1) / sizeof(files_v1[0]));
+        mock::fsmaker maker_v2;
+        maker_v2.construct(files_v2, sizeof(files_v2) / sizeof(files_v2[0]));
+
+        const uint32_t num_sectors = static_cast<uint32_t>((maker_v1.get_size() - 1u) / sec_size + 1u);
+        assert(num_sectors == 2u);
+
+        const auto write_image = [](const mock::fsmaker& maker) {
+            assert(write_fs(0u, static_cast<const char*>(maker.get_buffer()), maker.get_size()) == 0);
+        };
+
+        // Erased sectors are programmed without erasing them
+        uint64_t erase_count = mock::get_flash_erase_count();
+        uint64_t write_count = mock::get_flash_write_count();
+        write_image(maker_v1);
+        assert(mock::get_flash_erase_count() == erase_count);
+        assert(mock::get_flash_write_count() == write_count + num_sectors + 1u);
+
+        // Second slot and the other copy of the commit record are erased too
+        erase_count = mock::get_flash_erase_count();
+        write_count = mock::get_flash_write_count();
+        write_image(maker_v1);
+        assert(mock::get_flash_erase_count() == erase_count);
+        assert(mock::get_flash_write_count() == write_count + num_sectors + 1u);
+
+        // The first slot already contains the same image, only the older
+        // copy of the commit record must be erased
+        erase_count = mock::get_flash_erase_count();
+        write_count = mock::get_flash_write_count();
+        write_image(maker_v1);
+        assert(mock::get_flash_erase_count() == erase_count + 1u);
+        assert(mock::get_flash_write_count() == write_count + 1u);
+
+        // Both sectors of the second slot differ
+        erase_count = mock::get_flash_erase_count();
+        write_count = mock::get_flash_write_count();
+        write_image(maker_v2);
+        assert(mock::get_flash_erase_count() == erase_count + num_sectors + 1u);
+        assert(mock::get_flash_write_count() == write_count + num_sectors + 1u);
+
+        const auto small = find_file("small");
+        assert(small != nullptr);
+        char* const buf = load_file(small);
+        assert(buf != nullptr);
+        assert(memcmp(buf, "v2", 2u) == 0);
+        free(buf);
+
+        mock::destroy_filesystem();
+    }
+
+    // Sectors are erased ahead of the upload while their data is being received
+    {
+        constexpr uint32_t big_size = 100000u;
+
+        static char big_a[big_size + 1u];
+        static char big_b[big_size + 1u];
+        for (uint32_t i = 0; i < big_size; i++) {
+            big_a[i] = static_cast<char>('a' + i % 26u);
+            big_b[i] = static_cast<char>('0' + i % 10u);
+        }
+
+        const mock::file_desc files_a[] = { { "big", big_a } };
+        const mock::file_desc files_b[] = { { "big", big_b } };
+
+        mock::fsmaker maker_a;
+        maker_a.construct(files_a, 1u);
+        mock::fsmaker maker_b;
+        maker_b.construct(files_b, 1u);
+
+        const char* const image       = static_cast<const char*>(maker_b.get_buffer());
+        const uint32_t    size        = static_cast<uint32_t>(maker_b.get_size());
+        const uint32_t    num_sectors = (size - 1u) / sec_size + 1u;
+
+        // Uploads the image sector by sector and returns the time it took.
+        //
+        // Each sector takes 10ms to arrive, which is about 400KB/s over WiFi, and
+        // the next sector is sent once the previous one has been written.  Timers
+        // only run while the CPU is idle, waiting for data.
+        const auto upload = [&](bool erase_ahead, uint64_t* stall_us, uint64_t* erases) -> uint64_t {
+            mock::clear_flash();
+            mock::load_fs_from_memory(files_a, 1u);
+            assert(init_filesystem() == 0);
+
+            // Make the slot with the old image the one which is updated
+            assert(write_fs(0u, static_cast<const char*>(maker_a.get_buffer()), maker_a.get_size()) == 0);
+
+            const uint64_t erase_count = mock::get_flash_erase_count();
+
+            assert(begin_fs_update(erase_ahead ? ((1u << num_sectors) - 1u) : 0u) == 0);
+
+            constexpr uint64_t transfer_us = 10000u;
+
+            uint64_t now  = 0u; // time when the CPU becomes idle
+            uint64_t sent = 0u; // time when the next sector starts being sent
+
+            *stall_us = 0u;
+
+            for (uint32_t sector = 0; sector < num_sectors; sector++) {
+                const uint64_t arrival = sent + transfer_us;
+
+                while (now < arrival) {
+                    const uint64_t busy = mock::get_flash_busy_time_us();
+                    mock::run_timers();
+                    const uint64_t step = mock::get_flash_busy_time_us() - busy;
+                    if ( ! step)
+                        break;
+                    now += step;
+                }
+
+                if (now < arrival)
+                    now = arrival;
+
+                const uint32_t offset = sector * sec_size;
+                const uint32_t left   = size - offset;
+                const uint64_t busy   = mock::get_flash_busy_time_us();
+
+                assert(update_fs(offset, image + offset, left < sec_size ? left : sec_size) == 0);
+
+                const uint64_t write_us = mock::get_flash_busy_time_us() - busy;
+
+                *stall_us += write_us;
+                now       += write_us;
+                sent       = now;
+            }
+
+            assert(commit_fs_update(0u) == 0);
+
+            *erases = mock::get_flash_erase_count() - erase_count;
+
+            const auto big = find_file("big");
+            assert(big != nullptr);
+            char* const buf = load_file(big);
+            assert(buf != nullptr);
+            assert(memcmp(buf, big_b, big_size) == 0);
+            free(buf);
+
+            mock::destroy_filesystem();
+
+            return now;
+        };
+
+        uint64_t sync_stall_us  = 0u;
+        uint64_t ahead_stall_us = 0u;
+        uint64_t sync_erases    = 0u;
+        uint64_t ahead_erases   = 0u;
+
+        const uint64_t sync_us  = upload(false, &sync_stall_us, &sync_erases);
+        const uint64_t ahead_us = upload(true, &ahead_stall_us, &ahead_erases);
+
+        printf("%10s %15s %15s\n", "erase", "upload ms", "stalled ms");
+        printf("%10s %15u %15u\n", "on write", static_cast<unsigned>(sync_us / 1000u),
+               static_cast<unsigned>(sync_stall_us / 1000u));
+        printf("%10s %15u %15u\n", "ahead", static_cast<unsigned>(ahead_us / 1000u),
+               static_cast<unsigned>(ahead_stall_us / 1000u));
+
+        // All sectors have changed, so all of them are erased either way, but with
+        // erase-ahead the receive path only programs them.  The commit record is
+        // written to its copy which has not been used yet, which is still erased.
+        assert(sync_erases == num_sectors);
+        assert(ahead_erases == num_sectors);
+        assert(ahead_stall_us * 4u < sync_stall_us);
+        assert(ahead_us < sync_us);
+
+        // Sectors which are already erased are not erased again
+        {
+            mock::clear_flash();
+
+            const uint64_t erase_count = mock::get_flash_erase_count();
+
+            assert(begin_fs_update((1u << num_sectors) - 1u) == 0);
+            for (uint32_t i = 0; i < num_sectors; i++)
+                mock::run_timers();
+
+            assert(mock::get_flash_erase_count() == erase_count);
+
+            assert(write_fs(0u, image, size) == 0);
+            assert(mock::get_flash_erase_count() == erase_count);
+
+            mock::destroy_filesystem();
+        }
+    }
+
+    // Directory with long paths which spans several sectors
+    {
+        mock::clear_flash();
+
+        constexpr uint32_t num_files = 300u;
+
+        static char            names[num_files][max_filename_size];
+        static char            contents[num_files][8];
+        static mock::file_desc files[num_files];
+
+        for (uint32_t i = 0; i < num_files; i++) {
+            snprintf(names[i], sizeof(names[i]),
+                     "img/some/rather/deeply/nested/directory/zone%03u.svg", i);
+            snprintf(contents[i], sizeof(contents[i]), "<%03u/>", i);
+            files[i] = { names[i], contents[i] };
+        }
+
+        mock::fsmaker maker;
+        maker.construct(files, num_files);
+
+        const filesystem* const fs = static_cast<const filesystem*>(maker.get_buffer());
+        assert(fs->dir_size > 4u * sec_size);
+
+        // Write the image one sector at a time, the filesystem is switched when
+        // the last sector has been written
+        const char* const image = static_cast<const char*>(maker.get_buffer());
+        const uint32_t    size  = static_cast<uint32_t>(maker.get_size());
+
+        for (uint32_t offset = 0; offset < size; offset += sec_size) {
+            const uint32_t left = size - offset;
+            assert(find_file(names[0]) == nullptr);
+            assert(write_fs(offset, image + offset, left < sec_size ? left : sec_size) == 0);
+        }
+
+        for (uint32_t i = 0; i < num_files; i++) {
+            const auto file = find_file(names[i]);
+            assert(file != nullptr);
+            assert(strcmp(mock::get_file_name(file), names[i]) == 0);
+
+            char* const buf = load_file(file);
+            assert(buf != nullptr);
+            assert(memcmp(buf, contents[i], 6u) == 0);
+            free(buf);
+        }
+
+        assert(find_file("img/some/rather/deeply/nested/directory/zone300.svg") == nullptr);
+        assert(find_file("img/some/rather/deeply/nested/directory/") == nullptr);
+        assert(find_file("img") == nullptr);
+
+        mock::reboot();
+        assert(init_filesystem() == 0);
+        assert(find_file(names[num_files - 1u]) != nullptr);
+
+        mock::destroy_filesystem();
+    }
+
+    // Files with identical contents share data
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc files[] = {
+            { "a.css", "same contents" },
+            { "b.css", "same contents" },
+            { "c.css", "other" },
+            { "d.js",  "same contents" }
+        };
+
+        mock::fsmaker maker;
+        maker.construct(files, sizeof(files) / sizeof(files[0]));
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+        assert(init_filesystem() == 0);
+
+        const auto a = find_file("a.css");
+        const auto b = find_file("b.css");
+        const auto c = find_file("c.css");
+        const auto d = find_file("d.js");
+        assert(a && b && c && d);
+
+        // Same HTTP response head and contents
+        assert(a->offset == b->offset);
+        assert(a->offset != c->offset);
+
+        // Different content type, so the HTTP response head is different
+        assert(a->offset != d->offset);
+
+        // Shared data is verified once for all files which use it
+        char* file = load_file(a);
+        assert(file != nullptr);
+        free(file);
+
+        const auto orig_val = mock::modify_filesystem(a->offset, '#');
+
+        file = load_file(b);
+        assert(file != nullptr);
+        assert(file[0] == '#');
+        free(file);
+
+        // Corrupted file fails and so does the other file which shares its data
+        file_stream stream;
+        uint32_t    buf[16];
+        assert(open_file(a, &stream) == 0);
+        stream.verify = true;
+        int size;
+        do
+            size = read_file(&stream, buf, sizeof(buf));
+        while (size > 0);
+        assert(size == -1);
+        assert(load_file(b) == nullptr);
+        assert(load_file(a) == nullptr);
+
+        mock::modify_filesystem(a->offset, orig_val);
+
+        file = load_file(b);
+        assert(file != nullptr);
+        assert(memcmp(file, "same contents", 13u) == 0);
+        free(file);
+
+        // Shared data is cached once
+        {
+            char data[max_file_head_size + 16u] = { };
+
+            assert(find_cached_file(b) == nullptr);
+            cache_file(a, data);
+            assert(find_cached_file(b) != nullptr);
+            assert(find_cached_file(c) == nullptr);
+        }
+
+        // The image can be uploaded and verified
+        assert(write_fs(0u, static_cast<const char*>(maker.get_buffer()), maker.get_size()) == 0);
+        assert(find_file("b.css") != nullptr);
+        assert(find_file("b.css")->offset == find_file("a.css")->offset);
+
+        mock::destroy_filesystem();
+    }
+
+    // The directory stays in flash, only recently found entries are kept in RAM
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc files[] = {
+            { "a.css", "a" },
+            { "b.css", "b" },
+            { "c.css", "c" },
+            { "d.css", "d" },
+            { "e.css", "e" }
+        };
+
+        static_assert(sizeof(files) / sizeof(files[0]) > file_entry_cache_size, "Too few files");
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+        assert(init_filesystem() == 0);
+
+        // The entry is read from flash only when the file is found the first time
+        auto num_reads = mock::get_flash_read_count();
+
+        const auto a = find_file("a.css");
+        assert(a != nullptr);
+        assert(mock::get_flash_read_count() > num_reads);
+
+        num_reads = mock::get_flash_read_count();
+
+        assert(find_file("a.css") == a);
+        assert(mock::get_flash_read_count() == num_reads);
+
+        // Files which don't exist are not looked up in flash
+        assert(find_file("f.css") == nullptr);
+        assert(find_file("a.cs") == nullptr);
+        assert(mock::get_flash_read_count() == num_reads);
+
+        // Entries of the most recently found files remain valid
+        const file_entry* found[file_entry_cache_size];
+
+        for (uint32_t i = 0; i < file_entry_cache_size; i++) {
+            found[i] = find_file(files[i + 1u].filename);
+            assert(found[i] != nullptr);
+        }
+
+        for (uint32_t i = 0; i < file_entry_cache_size; i++) {
+            assert(strcmp(mock::get_file_name(found[i]), files[i + 1u].filename) == 0);
+
+            char* const file = load_file(found[i]);
+            assert(file != nullptr);
+            assert(file[0] == files[i + 1u].contents[0]);
+            free(file);
+        }
+
+        mock::destroy_filesystem();
+    }
+
+    // Reject directory in which files overlap
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc files[] = {
+            { "a.css", "aaaa" },
+            { "b.css", "bbbbbbbb" }
+        };
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+        assert(init_filesystem() == 0);
+
+        const uint32_t a_offset = find_file("a.css")->offset;
+        const auto     b        = find_file("b.css");
+        const uint32_t delta    = b->offset - a_offset;
+
+        // Move the second file onto the data of the first one, the checksum remains the same
+        const auto modify_word = [](uint32_t offset, uint32_t value) {
+            for (uint32_t i = 0; i < 4u; i++)
+                mock::modify_filesystem(offset + i, static_cast<uint8_t>(value >> (i * 8u)));
+        };
+
+        const uint32_t b_entry = offsetof(filesystem, entries) + sizeof(file_entry);
+        modify_word(b_entry + offsetof(file_entry, offset), b->offset - delta);
+        modify_word(b_entry + offsetof(file_entry, size),   b->size + delta);
+
+        mock::reboot();
+        assert(init_filesystem() == 1);
+
         mock::destroy_filesystem();
     }
 
@@ -307,6 +1232,240 @@ int main(int argc, char* argv[])
         mock::destroy_filesystem();
     }
 
+    // Read file in chunks
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc files[] = {
+            { "empty", "" },
+            { "abc",   "0123456789abcdefghi" }
+        };
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+
+        assert(init_filesystem() == 0);
+
+        file_stream stream;
+
+        assert(open_file(find_file("empty"), &stream) == 1);
+
+        const auto abc = find_file("abc");
+        assert(abc != nullptr);
+
+        uint32_t buf[3];
+        char* const bytes = reinterpret_cast<char*>(buf);
+
+        // Bad sizes
+        assert(open_file(abc, &stream) == 0);
+        assert(read_file(&stream, buf, 0u) == -1);
+        assert(read_file(&stream, buf, 6u) == -1);
+
+        assert(read_file(&stream, buf, 8u) == 8);
+        assert(memcmp(bytes, "01234567", 8u) == 0);
+
+        assert(read_file(&stream, buf, sizeof(buf)) == 11);
+        assert(memcmp(bytes, "89abcdefghi", 11u) == 0);
+
+        assert(read_file(&stream, buf, sizeof(buf)) == 0);
+
+        // Last chunk is padded with zeroes
+        assert(open_file(abc, &stream) == 0);
+        assert(read_file(&stream, buf, sizeof(buf)) == 12);
+        assert(read_file(&stream, buf, sizeof(buf)) == 7);
+        assert(memcmp(bytes, "cdefghi\0", 8u) == 0);
+
+        // The file has been verified, so its checksum is not verified again
+        const auto offset   = abc->offset + 1u;
+        const auto orig_val = mock::modify_filesystem(offset, '#');
+
+        assert(open_file(abc, &stream) == 0);
+        assert(read_file(&stream, buf, sizeof(buf)) == 12);
+        assert(bytes[1] == '#');
+        assert(read_file(&stream, buf, sizeof(buf)) == 7);
+
+        char* file = load_file(abc);
+        assert(file != nullptr);
+        assert(file[1] == '#');
+        free(file);
+
+        // The scrubber finds the corruption, skipping the invalid empty file
+        scrub_filesystem();
+        scrub_filesystem();
+
+        // Corruption is detected when the last chunk is read
+        assert(open_file(abc, &stream) == 0);
+        assert(read_file(&stream, buf, sizeof(buf)) == 12);
+        assert(bytes[1] == '#');
+        assert(read_file(&stream, buf, sizeof(buf)) == -1);
+
+        assert(load_file(abc) == nullptr);
+
+        mock::modify_filesystem(offset, orig_val);
+
+        assert(open_file(abc, &stream) == 0);
+        assert(read_file(&stream, buf, sizeof(buf)) == 12);
+        assert(read_file(&stream, buf, sizeof(buf)) == 7);
+
+        // The scrubber keeps going through all files
+        for (int i = 0; i < 4; i++)
+            scrub_filesystem();
+
+        file = load_file(abc);
+        assert(file != nullptr);
+        assert(memcmp(file, files[1].contents, 19u) == 0);
+        free(file);
+
+        // Reading fails after the filesystem has been rewritten
+        {
+            mock::fsmaker maker;
+            maker.construct(files, sizeof(files) / sizeof(files[0]));
+
+            assert(open_file(abc, &stream) == 0);
+            assert(read_file(&stream, buf, 8u) == 8);
+            assert(write_fs(0u, static_cast<const char*>(maker.get_buffer()), maker.get_size()) == 0);
+            assert(read_file(&stream, buf, 8u) == -1);
+        }
+
+        // Reading fails while the filesystem is being rewritten
+        assert(open_file(find_file("abc"), &stream) == 0);
+        mock::destroy_filesystem();
+        assert(read_file(&stream, buf, sizeof(buf)) == -1);
+    }
+
+    // HTTP response head is stored with the file
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc files[] = {
+            { "data",       "no head" },
+            { "index.html", "<html>" }
+        };
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+
+        assert(init_filesystem() == 0);
+
+        const auto data = find_file("data");
+        assert(data != nullptr);
+        assert(data->head_size == 0u);
+
+        const auto index = find_file("index.html");
+        assert(index != nullptr);
+        assert(index->head_size > 0u);
+        assert(index->head_size % 4u == 0u);
+
+        // Head is read first, followed by file data
+        static const char expected_head[] = "HTTP/1.1 200 OK\r\n"
+                                            "Content-Type: text/html\r\n"
+                                            "Content-Length: 6\r\n"
+                                            "Cache-Control: no-cache";
+        uint32_t buf[max_file_head_size / sizeof(uint32_t) + 2u];
+        char* const bytes = reinterpret_cast<char*>(buf);
+
+        file_stream stream;
+        assert(open_file(index, &stream) == 0);
+        assert(read_file(&stream, buf, sizeof(buf)) == static_cast<int>(index->head_size + 6u));
+        assert(memcmp(bytes, expected_head, sizeof(expected_head) - 1u) == 0);
+        assert(memcmp(&bytes[index->head_size - 4u], "\r\n\r\n<html>", 10u) == 0);
+
+        // load_file() only returns file data
+        char* file = load_file(index);
+        assert(file != nullptr);
+        assert(memcmp(file, "<html>", 6u) == 0);
+        free(file);
+
+        // Corruption of the head is detected when the head is read, load_file()
+        // does not read the head
+        const auto offset   = index->offset - index->head_size + 5u;
+        const auto orig_val = mock::modify_filesystem(offset, '2');
+
+        assert(open_file(index, &stream) == 0);
+        assert(read_file(&stream, buf, 8u) == 8);
+        assert(read_file(&stream, buf, sizeof(buf)) == -1);
+
+        file = load_file(index);
+        assert(file != nullptr);
+        free(file);
+
+        mock::modify_filesystem(offset, orig_val);
+
+        // Head and data are verified separately, even when read in one chunk
+        assert(open_file(index, &stream) == 0);
+        assert(read_file(&stream, buf, index->head_size - 4u) == static_cast<int>(index->head_size - 4u));
+        assert(read_file(&stream, buf, 8u) == 8);
+        assert(read_file(&stream, buf, 8u) == 2);
+
+        mock::destroy_filesystem();
+    }
+
+    // Benchmark file lookup as the number of files grows up to the maximum
+    {
+        static char            names[max_files][8];
+        static mock::file_desc files[max_files];
+
+        for (uint32_t i = 0; i < max_files; i++) {
+            snprintf(names[i], sizeof(names[i]), "f%03u", i);
+            files[i] = { names[i], "x" };
+        }
+
+        static const uint32_t num_files[] = { 1u, 4u, 16u, 64u, max_files };
+
+        printf("%10s %15s %15s %15s\n", "files", "compares/lookup", "hashes/lookup", "ns/lookup");
+
+        for (const uint32_t n : num_files) {
+            mock::clear_flash();
+
+            mock::load_fs_from_memory(files, n);
+
+            assert(init_filesystem() == 0);
+
+            constexpr uint32_t rounds = 200u;
+
+            uint64_t found = 0u;
+
+            const auto start_cmp  = mock::get_strncmp_count();
+            const auto start_hash = mock::get_name_hash_compare_count();
+            const auto start_time = std::chrono::steady_clock::now();
+
+            for (uint32_t r = 0; r < rounds; r++) {
+                for (uint32_t i = 0; i < n; i++)
+                    found += find_file(names[i]) != nullptr;
+            }
+
+            const auto     end_time = std::chrono::steady_clock::now();
+            const uint64_t lookups  = static_cast<uint64_t>(rounds) * n;
+            assert(found == lookups);
+
+            const double   cmps     = static_cast<double>(mock::get_strncmp_count() - start_cmp) / lookups;
+            const double   hashes   = static_cast<double>(mock::get_name_hash_compare_count() - start_hash) / lookups;
+            const auto     ns       = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                          end_time - start_time).count() / lookups;
+
+            printf("%10u %15.2f %15.2f %15u\n", n, cmps, hashes, static_cast<unsigned>(ns));
+
+            // Binary search of the index takes floor(log2(n)) + 1 hash compares,
+            // plus one to check the hash of the file found
+            uint32_t max_cmps = 1u;
+            for (uint32_t v = n; v > 1u; v /= 2u)
+                ++max_cmps;
+            assert(hashes <= max_cmps + 1u);
+
+            // Names are only compared when their hashes match
+            assert(cmps < 1.01);
+
+            for (uint32_t i = 0; i < n; i++) {
+                const auto f = find_file(names[i]);
+                assert(f != nullptr);
+                assert(strcmp(mock::get_file_name(f), names[i]) == 0);
+            }
+
+            assert(find_file("f") == nullptr);
+            assert(find_file("g") == nullptr);
+
+            mock::destroy_filesystem();
+        }
+    }
+
     struct config : public config_base
     {
         uint8_t  stuff[sec_size - sizeof(config_base) - sizeof(uint32_t)];
@@ -315,8 +1474,9 @@ int main(int argc, char* argv[])
 
     static_assert(sizeof(config) == sec_size, "Size of config struct is invalid");
 
-    // 4MB flash, 4KB per sector, 1MB for firmware, 128KB for filesystem, 5 sectors for SDK
-    constexpr uint32_t usable_log_sectors = 0x400u - 0x100u - (max_fs_size / sec_size) - 5u;
+    // 4MB flash, 4KB per sector, 1MB for firmware, 2x 128KB for filesystem slots,
+    // 2 sectors for filesystem commit record, 5 sectors for SDK
+    constexpr uint32_t usable_log_sectors = 0x400u - 0x100u - 2u * (max_fs_size / sec_size) - 2u - 5u;
 
     constexpr uint32_t seconds_per_day = 60u * 60u * 24u;
 
@@ -389,8 +1549,8 @@ int main(int argc, char* argv[])
             reboot_and_verify();
         }
 
-        // Max 1 write per sector until now
-        assert(mock::get_flash_lifetime() == 1u);
+        // Erased sectors are written without erasing them again
+        assert(mock::get_flash_lifetime() == 0u);
 
         // Write until we use all available sectors
         while (used_sectors < usable_log_sectors)
@@ -399,15 +1559,15 @@ int main(int argc, char* argv[])
         // Reboot and make sure we have correct stuff
         reboot_and_verify();
 
-        // Still max 1 write per sector until now
-        assert(mock::get_flash_lifetime() == 1u);
+        // Still no erase until now
+        assert(mock::get_flash_lifetime() == 0u);
 
         // Next write goes back to first sector
         advance_with_time();
         reboot_and_verify();
 
-        // Now one sector has been written 2 times
-        assert(mock::get_flash_lifetime() == 2u);
+        // Now one sector has been erased, because it contained old config
+        assert(mock::get_flash_lifetime() == 1u);
 
         // Write a few sectors to make sure binary search works
         for (int i = 0; i < 5; ++i) {
@@ -420,7 +1580,7 @@ int main(int argc, char* argv[])
         mock::clear_flash();
 
         // Save some files to ensure filesystem is not affected by log
-        const uint32_t big_file_size = max_fs_size - sizeof(filesystem);
+        const uint32_t big_file_size = max_fs_size - sizeof(filesystem) - sizeof("big");
         char* const big_file_contents = static_cast<char*>(malloc(big_file_size + 1));
         memset(big_file_contents, 0xCA, big_file_size);
         big_file_contents[big_file_size] = 0;
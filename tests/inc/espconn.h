@@ -32,6 +32,7 @@ enum espconn_state {
 typedef void (*espconn_connect_callback)(void* arg);
 typedef void (*espconn_reconnect_callback)(void* arg, int8_t err);
 typedef void (*espconn_recv_callback)(void* arg, char* pdata, unsigned short len);
+typedef void (*espconn_sent_callback)(void* arg);
 
 struct espconn {
     espconn_type  type;
@@ -42,13 +43,18 @@ struct espconn {
         espconn_connect_callback   disconnect_cb;
         espconn_reconnect_callback reconnect_cb;
         espconn_recv_callback      recv_cb;
+        espconn_sent_callback      sent_cb;
     } proto;
 };
 
 void espconn_mdns_init(mdns_info* info);
 int8_t espconn_accept(espconn* espconn);
+int8_t espconn_tcp_set_max_con_allow(espconn* espconn, uint8_t num);
+int8_t espconn_tcp_set_max_con(uint8_t num);
 int8_t espconn_send(espconn* conn, uint8_t* psent, uint16_t length);
+int8_t espconn_disconnect(espconn* conn);
 int8_t espconn_regist_recvcb(espconn* conn, espconn_recv_callback cb);
+int8_t espconn_regist_sentcb(espconn* conn, espconn_sent_callback cb);
 int8_t espconn_regist_reconcb(espconn* conn, espconn_reconnect_callback cb);
 int8_t espconn_regist_connectcb(espconn* conn, espconn_connect_callback cb);
 int8_t espconn_regist_disconcb(espconn* conn, espconn_connect_callback cb);
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 struct filesystem;
+struct file_entry;
 
 namespace mock {
 
@@ -13,16 +14,66 @@ namespace mock {
 
     void run_timers();
 
+    // Erases flash and clears RTC memory, like a power-on reset
     void clear_flash();
 
     uint8_t modify_filesystem(uint32_t offset, uint8_t value);
 
     void destroy_filesystem();
 
+    // Drops configuration changes which have not been written to flash yet
+    void destroy_config();
+
+    // Returns offset of the active filesystem slot from the beginning of the data area
+    uint32_t get_fs_offset();
+
+    // Returns address of the log area in flash
+    uint32_t get_log_addr();
+
+    // Resets the device, contents of RTC memory are preserved
     void reboot();
 
     uint16_t get_flash_lifetime();
 
+    // Returns the number of os_strncmp() calls so far
+    uint64_t get_strncmp_count();
+
+    // Returns the number of file name hashes compared by find_file() so far
+    uint64_t get_name_hash_compare_count();
+
+    // Returns the name of a file returned by find_file(), or nullptr if the
+    // entry is no longer valid
+    const char* get_file_name(const file_entry* file);
+
+    // Sets value returned by system_get_free_heap_size()
+    void set_free_heap_size(uint32_t size);
+
+    // Returns the number of spi_flash_read() calls so far
+    uint64_t get_flash_read_count();
+
+    // Returns the number of spi_flash_erase_sector() calls so far
+    uint64_t get_flash_erase_count();
+
+    // Returns the number of spi_flash_write() calls so far
+    uint64_t get_flash_write_count();
+
+    // Makes the next spi_flash_write() fail without writing anything, like
+    // a power loss after a sector has been erased, but before it was written
+    void fail_next_flash_write();
+
+    // Returns time in microseconds which flash operations would have taken
+    // on the device so far, according to a simple latency model
+    uint64_t get_flash_busy_time_us();
+
+    // Returns the memory-mapped flash window, which starts at the beginning of flash
+    const char* get_flash_map();
+
+    // Returns size of the memory-mapped flash window
+    uint32_t get_flash_map_size();
+
+    // Sets size of the memory-mapped flash window, 1MB by default
+    void set_flash_map_size(uint32_t size);
+
     struct file_desc
     {
         const char* filename;
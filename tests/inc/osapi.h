@@ -30,6 +30,7 @@ int os_strlen(const char* s);
 int os_strncmp(const char* s1, const char* s2, unsigned int n);
 void* os_memcpy(void* dest, const void* src, unsigned int n);
 void* os_memmove(void* dest, const void* src, unsigned int n);
+void* os_memset(void* s, int c, unsigned int n);
 int os_memcmp(const void* s1, const void* s2, unsigned int n);
 int os_strcmp(const char* s1, const char* s2);
 char* os_strstr(const char* s1, const char* s2);
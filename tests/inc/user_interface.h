@@ -23,6 +23,11 @@ enum flash_size_map {
 
 flash_size_map system_get_flash_size_map();
 
+uint32_t system_get_free_heap_size();
+
+bool system_rtc_mem_read(uint8_t src_addr, void* des_addr, uint16_t load_size);
+bool system_rtc_mem_write(uint8_t des_addr, const void* src_addr, uint16_t save_size);
+
 struct ip_addr {
     uint32_t addr;
 };
@@ -0,0 +1,79 @@
+#!/usr/bin/env python
+
+# Builds the filesystem image from www with the default flags from Makefile and
+# with --bundle and checks how the files are stored.
+
+import os
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+tests_dir = os.path.dirname(os.path.abspath(__file__))
+root_dir  = os.path.dirname(tests_dir)
+
+def BuildImage(flags):
+    tmp_dir = tempfile.mkdtemp()
+    try:
+        fs_file = os.path.join(tmp_dir, "fs.bin")
+        subprocess.check_call([sys.executable, os.path.join(root_dir, "tools", "mkfs.py")] +
+                              flags + [os.path.join(root_dir, "www"), fs_file])
+        with open(fs_file, "rb") as f:
+            return f.read()
+    finally:
+        shutil.rmtree(tmp_dir)
+
+# Returns a dictionary of files in the image, indexed by file name, each file is
+# a tuple of HTTP response head, data and splice offset
+def ParseImage(image):
+    magic, checksum, num_files, dir_size = struct.unpack("<IIII", image[:16])
+    assert magic == 0xC0DEA55E
+
+    files = { }
+    for i in range(num_files):
+        entry = image[16 + i * 28 : 16 + (i + 1) * 28]
+        name_offset, size, checksum, offset, head_size, head_checksum, splice = struct.unpack("<IIIIIII", entry)
+        name = image[name_offset : image.index(b'\0', name_offset)].decode()
+        head = image[offset - head_size : offset].decode()
+        files[name] = (head, image[offset : offset + size], splice)
+    return files
+
+def Find(files, pattern):
+    names = [name for name in files if re.match(pattern, name)]
+    assert len(names) == 1, "expected one file matching " + pattern + ", found " + str(names)
+    return names[0]
+
+def MakefileFlags():
+    with open(os.path.join(root_dir, "Makefile")) as f:
+        m = re.search(r"^MKFS_FLAGS \?= (.*)$", f.read(), re.M)
+    return m.group(1).split()
+
+# Bundling does not apply to the page with dynamic content, so it makes no difference
+for flags in (MakefileFlags(), ["--bundle", "--hash-names"]):
+    files = ParseImage(BuildImage(flags))
+
+    # The page with dynamic content is a small shell, which is not compressed or cached
+    head, data, splice = files["index.html"]
+    assert splice
+    assert "index.html.gz" not in files
+    assert "Cache-Control: no-store" in head
+    assert len(data) < 4096
+    assert b"<script src=\"app." in data
+
+    # Scripts and stylesheets are separate files with hashed names, which are
+    # compressed and cached indefinitely
+    for pattern in (r"^app\.[0-9a-f]{10}\.js$", r"^app\.[0-9a-f]{10}\.css$"):
+        name = Find(files, pattern)
+        assert name.encode() in data
+        assert name + ".gz" in files
+
+        for variant in (name, name + ".gz"):
+            head = files[variant][0]
+            assert "max-age=31536000, immutable" in head
+            assert "ETag: " in head
+
+        assert "Content-Encoding: gzip" in files[name + ".gz"][0]
+
+print("mkfs test passed")
@@ -105,11 +105,19 @@ int os_strlen(const char* s)
     return strlen(s);
 }
 
+static uint64_t strncmp_count = 0u;
+
 int os_strncmp(const char* s1, const char* s2, unsigned int n)
 {
+    ++strncmp_count;
     return strncmp(s1, s2, n);
 }
 
+uint64_t mock::get_strncmp_count()
+{
+    return strncmp_count;
+}
+
 void* os_memcpy(void* dest, const void* src, unsigned int n)
 {
     return memcpy(dest, src, n);
@@ -120,6 +128,11 @@ void* os_memmove(void* dest, const void* src, unsigned int n)
     return memmove(dest, src, n);
 }
 
+void* os_memset(void* s, int c, unsigned int n)
+{
+    return memset(s, c, n);
+}
+
 int os_memcmp(const void* s1, const void* s2, unsigned int n)
 {
     return memcmp(s1, s2, n);
@@ -142,12 +155,59 @@ flash_size_map system_get_flash_size_map()
     return FLASH_SIZE_32M_MAP_512_512;
 }
 
+static constexpr uint32_t default_free_heap = 40u * 1024u;
+
+static uint32_t free_heap = default_free_heap;
+
+uint32_t system_get_free_heap_size()
+{
+    return free_heap;
+}
+
+void mock::set_free_heap_size(uint32_t size)
+{
+    free_heap = size;
+}
+
+// RTC memory consists of 4-byte blocks, the first 64 blocks are reserved for the system
+// and the remaining 128 blocks are available to the user.  Unlike the heap, RTC memory
+// survives mock::reboot() and it is only cleared by mock::clear_flash().
+static constexpr unsigned rtc_user_block = 64u;
+static constexpr unsigned rtc_num_blocks = 192u;
+
+static uint32_t rtc_mem[rtc_num_blocks];
+
+static bool check_rtc_mem_range(uint8_t addr, const void* ptr, uint16_t size)
+{
+    return addr >= rtc_user_block &&
+           addr * 4u + size <= rtc_num_blocks * 4u &&
+           (reinterpret_cast<uintptr_t>(ptr) & 3u) == 0u;
+}
+
+bool system_rtc_mem_read(uint8_t src_addr, void* des_addr, uint16_t load_size)
+{
+    if (!check_rtc_mem_range(src_addr, des_addr, load_size))
+        return false;
+
+    memcpy(des_addr, &rtc_mem[src_addr], load_size);
+    return true;
+}
+
+bool system_rtc_mem_write(uint8_t des_addr, const void* src_addr, uint16_t save_size)
+{
+    if (!check_rtc_mem_range(des_addr, src_addr, save_size))
+        return false;
+
+    memcpy(&rtc_mem[des_addr], src_addr, save_size);
+    return true;
+}
+
 static constexpr unsigned num_sectors  = 0x400u;
 static constexpr unsigned fs_first_sec = 0x100u;
 static constexpr unsigned tail_sectors = 5u; // Used by the SDK
 static constexpr uint16_t sec_lifetime = 10000u;
 
-static uint8_t  flash[num_sectors * SPI_FLASH_SEC_SIZE];
+alignas(4) static uint8_t flash[num_sectors * SPI_FLASH_SEC_SIZE];
 static uint8_t  sector_status[num_sectors];
 static uint16_t sector_life[num_sectors];
 
@@ -158,6 +218,8 @@ static wps_st_cb_t   wps_callback  = nullptr;
 static espconn       accept_conn;
 static bool          accept_called = false;
 static mock::buffer* recv_buf      = nullptr;
+static bool          send_pending  = false;
+static bool          disconnecting = false;
 
 enum sec_status {
     SEC_ERASED,
@@ -165,11 +227,49 @@ enum sec_status {
     SEC_BAD
 };
 
+static uint64_t flash_erase_count = 0u;
+static uint64_t flash_write_count = 0u;
+
+// Flash latency model, based on typical timing of SPI NOR flash used with ESP8266:
+// 4KB sector erase takes about 50ms, programming takes about 0.7ms per 256-byte
+// page and reading at 40MHz in QIO mode takes about 1us per 16 bytes.
+static constexpr uint64_t flash_erase_us          = 50000u;
+static constexpr uint64_t flash_write_us_per_kb   = 2800u;
+static constexpr uint64_t flash_read_bytes_per_us = 16u;
+
+static uint64_t flash_busy_us = 0u;
+
+uint64_t mock::get_flash_busy_time_us()
+{
+    return flash_busy_us;
+}
+
+uint64_t mock::get_flash_erase_count()
+{
+    return flash_erase_count;
+}
+
+uint64_t mock::get_flash_write_count()
+{
+    return flash_write_count;
+}
+
+static bool fail_next_write = false;
+
+void mock::fail_next_flash_write()
+{
+    fail_next_write = true;
+}
+
 SpiFlashOpResult spi_flash_erase_sector(uint16_t sec)
 {
     assert(sec >= fs_first_sec);
     assert(sec <  num_sectors - tail_sectors);
 
+    ++flash_erase_count;
+
+    flash_busy_us += flash_erase_us;
+
     if (sector_life[sec] >= sec_lifetime || sector_status[sec] == SEC_BAD) {
         sector_status[sec] = SEC_BAD;
         return SPI_FLASH_RESULT_ERR;
@@ -183,30 +283,83 @@ SpiFlashOpResult spi_flash_erase_sector(uint16_t sec)
     return SPI_FLASH_RESULT_OK;
 }
 
+// Like NOR flash, writing can only change bits from 1 to 0.  Unlike real flash,
+// which would silently leave such bits set, the write fails if any bit would
+// have to change from 0 to 1, because that indicates a missing erase.
 SpiFlashOpResult spi_flash_write(uint32_t dst_addr, uint32_t* src_addr, uint32_t size)
 {
     assert(dst_addr >= fs_first_sec * SPI_FLASH_SEC_SIZE);
     assert(dst_addr + size <= (num_sectors - tail_sectors) * SPI_FLASH_SEC_SIZE);
-    assert(dst_addr % SPI_FLASH_SEC_SIZE == 0u);
+    assert(dst_addr % 4u == 0u);
+    assert(size % 4u == 0u);
+
+    ++flash_write_count;
+
+    if (fail_next_write) {
+        fail_next_write = false;
+        return SPI_FLASH_RESULT_ERR;
+    }
+
+    flash_busy_us += (size * flash_write_us_per_kb + 1023u) / 1024u;
 
     const auto begin_sec = dst_addr / SPI_FLASH_SEC_SIZE;
     const auto end_sec   = ((dst_addr + size - 1u) / SPI_FLASH_SEC_SIZE) + 1u;
 
-    for (auto i = begin_sec; i < end_sec; ++i) {
-        if (sector_status[i] != SEC_ERASED)
+    for (auto i = begin_sec; i < end_sec; ++i)
+        if (sector_status[i] == SEC_BAD)
+            return SPI_FLASH_RESULT_ERR;
+
+    const uint8_t* const src = reinterpret_cast<const uint8_t*>(src_addr);
+
+    for (uint32_t i = 0; i < size; i++)
+        if ((flash[dst_addr + i] & src[i]) != src[i])
             return SPI_FLASH_RESULT_ERR;
+
+    for (auto i = begin_sec; i < end_sec; ++i)
         sector_status[i] = SEC_WRITTEN;
-    }
 
     memcpy(&flash[dst_addr], src_addr, size);
 
     return SPI_FLASH_RESULT_OK;
 }
 
+static uint64_t flash_read_count = 0u;
+
+// Like on the device, only the first 1MB of flash is mapped by default
+static constexpr uint32_t default_flash_map_size = 0x100000u;
+
+static uint32_t flash_map_size = default_flash_map_size;
+
+const char* mock::get_flash_map()
+{
+    return reinterpret_cast<const char*>(&flash[0]);
+}
+
+uint32_t mock::get_flash_map_size()
+{
+    return flash_map_size;
+}
+
+void mock::set_flash_map_size(uint32_t size)
+{
+    assert(size <= sizeof(flash));
+    flash_map_size = size;
+}
+
+uint64_t mock::get_flash_read_count()
+{
+    return flash_read_count;
+}
+
 SpiFlashOpResult spi_flash_read(uint32_t src_addr, uint32_t* dst_addr, uint32_t size)
 {
+    ++flash_read_count;
+
+    flash_busy_us += (size + flash_read_bytes_per_us - 1u) / flash_read_bytes_per_us;
+
     assert(src_addr >= fs_first_sec * SPI_FLASH_SEC_SIZE);
     assert(src_addr + size <= (num_sectors - tail_sectors) * SPI_FLASH_SEC_SIZE);
+    assert(src_addr % 4u == 0u);
 
     const auto begin_sec = src_addr / SPI_FLASH_SEC_SIZE;
     const auto end_sec   = ((src_addr + size - 1u) / SPI_FLASH_SEC_SIZE) + 1u;
@@ -228,6 +381,13 @@ void mock::clear_flash()
     memset(&sector_status, SEC_ERASED, sizeof(sector_status));
     memset(&sector_life, 0u, sizeof(sector_life));
 
+    // Power-on reset
+    memset(&rtc_mem, 0u, sizeof(rtc_mem));
+
+    flash_map_size = default_flash_map_size;
+
+    fail_next_write = false;
+
     timestamp     = 0u;
     timezone      = 8;
     wps_callback  = nullptr;
@@ -238,6 +398,8 @@ void mock::clear_flash()
 
 uint8_t mock::modify_filesystem(uint32_t offset, uint8_t value)
 {
+    offset += get_fs_offset();
+
     assert(offset / SPI_FLASH_SEC_SIZE < num_sectors - tail_sectors - fs_first_sec);
 
     const uint32_t sec = offset / SPI_FLASH_SEC_SIZE + fs_first_sec;
@@ -280,16 +442,19 @@ void os_timer_arm(os_timer_t* timer, uint32_t time, bool repeat_flag)
 {
     assert( ! timer->next);
     assert( ! timer->prev);
+    assert(timers != timer);
 
     timer->time   = time;
     timer->repeat = repeat_flag;
     timer->next   = timers;
+    if (timers)
+        timers->prev = timer;
     timers        = timer;
 }
 
 void os_timer_disarm(os_timer_t* timer)
 {
-    if ( ! timer->next && ! timer->prev)
+    if ( ! timer->next && ! timer->prev && timers != timer)
         return;
 
     if (timer->next)
@@ -308,6 +473,7 @@ void os_timer_setfn(os_timer_t* timer, timer_func func, void* arg)
 {
     assert( ! timer->next);
     assert( ! timer->prev);
+    assert(timers != timer);
 
     timer->func = func;
     timer->arg  = arg;
@@ -317,13 +483,14 @@ void mock::run_timers()
 {
     for (auto timer = timers; timer; ) {
 
-        timer->func(timer->arg);
-
+        // The timer can be disarmed by its own function
         auto next = timer->next;
 
         if (!timer->repeat)
             os_timer_disarm(timer);
 
+        timer->func(timer->arg);
+
         timer = next;
     }
 }
@@ -397,6 +564,21 @@ int8_t espconn_accept(espconn* conn)
     accept_conn.proto.recv_cb       = nullptr;
     accept_conn.proto.reconnect_cb  = nullptr;
     accept_conn.proto.disconnect_cb = nullptr;
+    accept_conn.proto.sent_cb       = nullptr;
+    return 0;
+}
+
+int8_t espconn_tcp_set_max_con(uint8_t num)
+{
+    assert(num > 0u);
+    return 0;
+}
+
+int8_t espconn_tcp_set_max_con_allow(espconn* conn, uint8_t num)
+{
+    assert(conn);
+    assert(accept_called);
+    assert(num > 0u);
     return 0;
 }
 
@@ -407,9 +589,28 @@ int8_t espconn_send(espconn* conn, uint8_t* psent, uint16_t length)
     assert(length);
     assert(recv_buf);
 
+    // The next send is only allowed after the sent callback for the previous one
+    assert(!send_pending);
+    assert(!disconnecting);
+
+    // lwIP copies the data with memcpy(), which uses byte loads for unaligned
+    // data, but the memory-mapped flash window can only be read with 32-bit loads
+    if (psent >= &flash[0] && psent < &flash[0] + sizeof(flash)) {
+        assert((psent - &flash[0]) % 4 == 0);
+        assert(length % 4u == 0u);
+    }
+
     const size_t pos = recv_buf->size();
     recv_buf->resize(pos + length);
     memcpy(recv_buf->data() + pos, psent, length);
+    send_pending = true;
+    return 0;
+}
+
+int8_t espconn_disconnect(espconn* conn)
+{
+    assert(conn);
+    disconnecting = true;
     return 0;
 }
 
@@ -421,6 +622,14 @@ int8_t espconn_regist_recvcb(espconn* conn, espconn_recv_callback cb)
     return 0;
 }
 
+int8_t espconn_regist_sentcb(espconn* conn, espconn_sent_callback cb)
+{
+    assert(conn);
+    assert(cb);
+    conn->proto.sent_cb = cb;
+    return 0;
+}
+
 int8_t espconn_regist_reconcb(espconn* conn, espconn_reconnect_callback cb)
 {
     assert(conn);
@@ -490,15 +699,26 @@ void mock::send_http(const char* request, size_t request_size, buffer* response)
 
         conn.proto.recv_cb(&conn, send_buf, static_cast<int>(send_size));
 
+        // Acknowledge sent data until the server stops sending
+        while (send_pending) {
+            send_pending = false;
+            if (conn.proto.sent_cb)
+                conn.proto.sent_cb(&conn);
+        }
+
         request      += send_size;
         request_size -= send_size;
 
+        if (disconnecting)
+            break;
+
         // TODO handle 100-continue
         if (response->size())
             break;
     }
 
-    recv_buf = nullptr;
+    recv_buf      = nullptr;
+    disconnecting = false;
 
     conn.proto.disconnect_cb(&conn);
 }
@@ -516,10 +736,12 @@ void mock::send_http(const buffer& request, buffer* response)
 void mock::reboot()
 {
     destroy_filesystem();
+    destroy_config();
 
     user_rf_cal_sector_set();
 
     timestamp     = 0u;
+    free_heap     = default_free_heap;
     timers        = nullptr;
     wps_callback  = nullptr;
     accept_called = false;
@@ -550,38 +772,231 @@ static uint32_t calc_checksum(const void* buf, size_t size)
     return checksum;
 }
 
+// Marks the point in HTML files at which the server inserts dynamic content,
+// must match mkfs.py
+static const char splice_marker[] = "<!--#bootstrap-->";
+
+// Prepares file data like mkfs.py does, the splice marker is removed and
+// the data before it is padded with spaces to a multiple of 4 bytes.
+//
+// Returns allocated data, 'size' receives its size and 'splice' receives
+// offset of the marker or 0 if there is none.
+static char* prepare_contents(const mock::file_desc& file, size_t* size, uint32_t* splice)
+{
+    const size_t file_size = strlen(file.contents);
+    const size_t name_len  = strlen(file.filename);
+    const char*  marker    = strstr(file.contents, splice_marker);
+
+    if (name_len < 5u || strcmp(&file.filename[name_len - 5u], ".html") != 0)
+        marker = nullptr;
+
+    char* const data = static_cast<char*>(malloc(file_size + 4u));
+
+    if ( ! marker) {
+        memcpy(data, file.contents, file_size);
+        *size   = file_size;
+        *splice = 0u;
+        return data;
+    }
+
+    const size_t before = static_cast<size_t>(marker - file.contents);
+    const size_t pad    = before ? ((0u - before) & 3u) : 4u;
+    const size_t after  = file_size - before - (sizeof(splice_marker) - 1u);
+
+    memcpy(data, file.contents, before);
+    memset(data + before, ' ', pad);
+    memcpy(data + before + pad, marker + sizeof(splice_marker) - 1u, after);
+
+    *size   = before + pad + after;
+    *splice = static_cast<uint32_t>(before + pad);
+    return data;
+}
+
+// Prepares HTTP response head for a file, like mkfs.py does.
+//
+// Returns size of the head, which is 0 if the MIME type is unknown.
+static size_t make_head(const mock::file_desc* files,
+                        size_t                 num_files,
+                        const mock::file_desc& file,
+                        const char*            data,
+                        size_t                 file_size,
+                        uint32_t               splice,
+                        char                   (&head)[max_file_head_size + 1])
+{
+    static const char* const mime_types[][2] = {
+        { ".html", "text/html"       },
+        { ".css",  "text/css"        },
+        { ".js",   "text/javascript" },
+        { ".ico",  "image/x-icon"    },
+        { ".svg",  "image/svg+xml"   }
+    };
+
+    const size_t len      = strlen(file.filename);
+    const bool   gzip     = len > 3 && strcmp(&file.filename[len - 3], ".gz") == 0;
+    const size_t name_len = gzip ? len - 3 : len;
+
+    const char* mime_type = nullptr;
+    for (const auto& mime : mime_types) {
+        const size_t ext_len = strlen(mime[0]);
+        if (name_len > ext_len && memcmp(&file.filename[name_len - ext_len], mime[0], ext_len) == 0)
+            mime_type = mime[1];
+    }
+
+    if ( ! mime_type)
+        return 0u;
+
+    bool vary = gzip;
+    for (size_t i = 0; i < num_files; i++) {
+        const char* const other = files[i].filename;
+        if (strlen(other) == len + 3 && strncmp(other, file.filename, len) == 0 &&
+            strcmp(&other[len], ".gz") == 0)
+            vary = true;
+    }
+
+    const size_t aligned = mock::align_up<size_t, 4>(file_size);
+
+    char* const contents = static_cast<char*>(calloc(aligned + 1u, 1u));
+    memcpy(contents, data, file_size);
+    const uint32_t checksum = calc_checksum(contents, aligned);
+    free(contents);
+
+    char validator[64] = "";
+    if ( ! splice)
+        snprintf(validator, sizeof(validator),
+                 "\r\nETag: \"%08x-%x\"\r\n"
+                 "Accept-Ranges: bytes",
+                 checksum,
+                 static_cast<unsigned>(file_size));
+
+    // Files with dynamic content are not cached and cannot be requested in parts
+    size_t head_size = snprintf(head, sizeof(head),
+                                "HTTP/1.1 200 OK\r\n"
+                                "Content-Type: %s\r\n"
+                                "Content-Length: %u\r\n"
+                                "Cache-Control: %s"
+                                "%s%s%s",
+                                mime_type,
+                                static_cast<unsigned>(file_size),
+                                splice ? "no-store" : "no-cache",
+                                validator,
+                                gzip ? "\r\nContent-Encoding: gzip" : "",
+                                vary ? "\r\nVary: Accept-Encoding" : "");
+
+    while ((head_size + 4u) & 3u)
+        head[head_size++] = ' ';
+
+    memcpy(&head[head_size], "\r\n\r\n", 4u);
+    head_size += 4u;
+
+    assert(head_size <= max_file_head_size);
+
+    return head_size;
+}
+
 void mock::fsmaker::construct(const file_desc* files, size_t num_files)
 {
-    const size_t hdr_size = sizeof(filesystem) + (num_files - 1u) * sizeof(file_entry);
-    size = hdr_size;
+    const size_t entries_size = sizeof(filesystem) + (num_files - 1u) * sizeof(file_entry);
 
+    // File names follow the entries
+    size_t names_size = 0u;
     for (size_t i = 0; i < num_files; i++)
-        size += align_up<size_t, 4>(strlen(files[i].contents));
+        names_size += strlen(files[i].filename) + 1u;
+
+    const size_t hdr_size = entries_size + align_up<size_t, 4>(names_size);
+    size = hdr_size;
 
-    fs = static_cast<filesystem*>(malloc(size));
+    char head[max_file_head_size + 1];
+
+    for (size_t i = 0; i < num_files; i++) {
+        size_t      file_size = 0u;
+        uint32_t    splice    = 0u;
+        char* const data      = prepare_contents(files[i], &file_size, &splice);
+
+        size += make_head(files, num_files, files[i], data, file_size, splice, head);
+        size += align_up<size_t, 4>(file_size);
+
+        free(data);
+    }
+
+    fs = static_cast<filesystem*>(calloc(size, 1u));
 
     char* fs_ptr = reinterpret_cast<char*>(fs);
 
+    char* name_buf = fs_ptr + entries_size;
     char* file_buf = fs_ptr + hdr_size;
 
     fs->magic     = FILESYSTEM_MAGIC;
     fs->num_files = num_files;
+    fs->dir_size  = hdr_size;
+
+    // Sort files by name, like mkfs.py does
+    const file_desc** const sorted = static_cast<const file_desc**>(
+            malloc(num_files * sizeof(file_desc*)));
+    for (size_t i = 0; i < num_files; i++)
+        sorted[i] = &files[i];
+    qsort(sorted, num_files, sizeof(file_desc*), [](const void* a, const void* b) -> int {
+        return strcmp((*static_cast<const file_desc* const*>(a))->filename,
+                      (*static_cast<const file_desc* const*>(b))->filename);
+    });
 
     for (size_t i = 0; i < num_files; i++) {
-        const size_t file_size = strlen(files[i].contents);
+        const file_desc& file = *sorted[i];
+
+        auto& entry = fs->entries[i];
+
+        const size_t name_size = strlen(file.filename) + 1u;
+        memcpy(name_buf, file.filename, name_size);
+        entry.name = static_cast<uint32_t>(name_buf - fs_ptr);
+        name_buf += name_size;
+
+        size_t      file_size = 0u;
+        uint32_t    splice    = 0u;
+        char* const data      = prepare_contents(file, &file_size, &splice);
+
+        const size_t head_size = make_head(files, num_files, file, data, file_size, splice, head);
+
+        // Files with identical HTTP response head and contents share data, like in mkfs.py
+        bool shared = false;
+        for (size_t j = 0; j < i && ! shared; j++) {
+            const auto& other = fs->entries[j];
+            if (other.head_size == head_size && other.size == file_size &&
+                other.splice == splice &&
+                memcmp(fs_ptr + other.offset - head_size, head, head_size) == 0 &&
+                memcmp(fs_ptr + other.offset, data, file_size) == 0) {
+
+                entry.size          = other.size;
+                entry.checksum      = other.checksum;
+                entry.offset        = other.offset;
+                entry.head_size     = other.head_size;
+                entry.head_checksum = other.head_checksum;
+                entry.splice        = other.splice;
+                shared = true;
+            }
+        }
+        if (shared) {
+            free(data);
+            continue;
+        }
+
+        // HTTP response head is stored right before file data
+        memcpy(file_buf, head, head_size);
+        file_buf += head_size;
+
         const size_t aligned = align_up<size_t, 4>(file_size);
         if (file_size > 0) {
-            memcpy(file_buf, files[i].contents, file_size);
+            memcpy(file_buf, data, file_size);
             if (aligned > file_size)
                 memset(file_buf + file_size, 0, aligned - file_size);
         }
 
-        auto& entry = fs->entries[i];
+        free(data);
 
-        strncpy(entry.filename, files[i].filename, sizeof(entry.filename));
-        entry.size     = file_size;
-        entry.checksum = calc_checksum(file_buf, aligned);
-        entry.offset   = static_cast<uint32_t>(file_buf - fs_ptr);
+        entry.size          = file_size;
+        entry.checksum      = calc_checksum(file_buf, aligned);
+        entry.offset        = static_cast<uint32_t>(file_buf - fs_ptr);
+        entry.head_size     = head_size;
+        entry.head_checksum = calc_checksum(head, head_size);
+        entry.splice        = splice;
 
         if (aligned > file_size)
             memset(file_buf + file_size, 'x', aligned - file_size);
@@ -589,6 +1004,10 @@ void mock::fsmaker::construct(const file_desc* files, size_t num_files)
         file_buf += aligned;
     }
 
+    free(sorted);
+
+    size = static_cast<size_t>(file_buf - fs_ptr);
+
     fs->checksum = calc_checksum(&fs->num_files, hdr_size - 8u);
 }
 
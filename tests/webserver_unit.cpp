@@ -4,7 +4,9 @@
 #include "../src/filesystem.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <utility>
 
 #define check_response(buffer, expected) do {                    \
     static const char val[] = expected;                          \
@@ -17,8 +19,9 @@
     assert(memmem((buffer).data(), (buffer).size(), val, sizeof(val) - 1)); \
 } while (0)
 
-static bool get_handler_called  = false;
-static bool post_handler_called = false;
+static bool get_handler_called   = false;
+static bool post_handler_called  = false;
+static bool query_handler_called = false;
 
 int main(int argc, char* argv[])
 {
@@ -67,9 +70,11 @@ int main(int argc, char* argv[])
         mock::clear_flash();
 
         static const mock::file_desc files[] = {
-            { "afile.css",  "a" },
-            { "bfile",      "b" },
-            { "index.html", "index" }
+            { "afile.css",      "a" },
+            { "bfile",          "b" },
+            { "img/index.html", "img" },
+            { "img/zone1.svg",  "<svg/>" },
+            { "index.html",     "index" }
         };
 
         mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
@@ -114,6 +119,23 @@ int main(int argc, char* argv[])
                     return HTTP_RESPONSE_SENT;
                 }
             },
+            { POST_METHOD, "withquery", [](void*             conn,
+                                           const text_entry& query,
+                                           const text_entry& headers,
+                                           unsigned          payload_offset,
+                                           const text_entry& payload) -> HTTPStatus
+                {
+                    query_handler_called = true;
+                    assert(conn);
+                    assert(headers.len);
+                    assert(payload_offset == 0);
+                    static const char expected[] = "offset=1000";
+                    assert(query.len == sizeof(expected) - 1);
+                    assert(memcmp(query.text, expected, sizeof(expected) - 1) == 0);
+                    assert(payload.len == 4);
+                    return HTTP_OK;
+                }
+            },
         };
 
         configure_webserver(&web_handlers[0], sizeof(web_handlers) / sizeof(web_handlers[0]));
@@ -153,6 +175,35 @@ int main(int argc, char* argv[])
             response.clear();
         }
 
+        {
+            static const char request[] = "GET /img/Zone1.svg HTTP/1.1\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Content-Type: image/svg+xml\r\n");
+            check_string(response, "Content-Length: 6\r\n");
+            check_string(response, "\r\n\r\n<svg/>");
+            response.clear();
+        }
+
+        {
+            static const char request[] = "GET /img/ HTTP/1.1\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Content-Type: text/html\r\n");
+            check_string(response, "\r\n\r\nimg");
+            response.clear();
+        }
+
+        {
+            static const char request[] = "GET /img HTTP/1.1\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 404 Not Found\r\n");
+            response.clear();
+        }
+
         {
             static const char request[] = "GET /bfile HTTP/1.1\r\n";
             send_http(request, sizeof(request) - 1, &response);
@@ -208,7 +259,869 @@ int main(int argc, char* argv[])
             response.clear();
         }
 
+        {
+            static const char request[] = "POST /withquery?offset=1000 HTTP/1.1\r\n"
+                                          "Content-Length: 4\r\n"
+                                          "\r\n"
+                                          "data";
+            send_http(request, sizeof(request) - 1, &response);
+
+            assert(query_handler_called);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            response.clear();
+        }
+
+        mock::destroy_filesystem();
+    }
+
+    // Gzip-compressed variants of files
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc files[] = {
+            { "both.css",      "plain" },
+            { "both.css.gz",   "GZ" },
+            { "gzonly.js.gz",  "GZJS" },
+            { "plain.html",    "html" }
+        };
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+
+        assert(init_filesystem() == 0);
+
+        configure_webserver(nullptr, 0);
+
+        mock::buffer response;
+
+        {
+            static const char request[] = "GET /both.css HTTP/1.1\r\n"
+                                          "Accept-Encoding: gzip, deflate\r\n"
+                                          "\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Content-Type: text/css\r\n");
+            check_string(response, "Content-Length: 2\r\n");
+            check_string(response, "Content-Encoding: gzip\r\n");
+            check_string(response, "Vary: Accept-Encoding");
+            check_string(response, "\r\n\r\nGZ");
+            response.clear();
+        }
+
+        {
+            static const char request[] = "GET /both.css HTTP/1.1\r\n"
+                                          "Host: sprinklers.local\r\n"
+                                          "Accept-Encoding: deflate, gzip;q=0.5\r\n"
+                                          "\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Content-Encoding: gzip\r\n");
+            check_string(response, "\r\n\r\nGZ");
+            response.clear();
+        }
+
+        {
+            static const char request[] = "GET /both.css HTTP/1.1\r\n"
+                                          "\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Content-Length: 5\r\n");
+            check_string(response, "Vary: Accept-Encoding");
+            assert( ! memmem(response.data(), response.size(), "Content-Encoding", 16));
+            check_string(response, "\r\n\r\nplain");
+            response.clear();
+        }
+
+        {
+            static const char request[] = "GET /both.css HTTP/1.1\r\n"
+                                          "Accept-Encoding: gzip;q=0, deflate\r\n"
+                                          "\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "\r\n\r\nplain");
+            response.clear();
+        }
+
+        {
+            static const char request[] = "GET /both.css HTTP/1.1\r\n"
+                                          "Accept-Encoding: x-gzip2\r\n"
+                                          "\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "\r\n\r\nplain");
+            response.clear();
+        }
+
+        {
+            static const char request[] = "GET /gzonly.js HTTP/1.1\r\n"
+                                          "Accept-Encoding: gzip\r\n"
+                                          "\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Content-Type: text/javascript\r\n");
+            check_string(response, "Content-Encoding: gzip\r\n");
+            check_string(response, "\r\n\r\nGZJS");
+            response.clear();
+        }
+
+        {
+            static const char request[] = "GET /gzonly.js HTTP/1.1\r\n"
+                                          "\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 406 Not Acceptable\r\n");
+            response.clear();
+        }
+
+        {
+            static const char request[] = "GET /plain.html HTTP/1.1\r\n"
+                                          "Accept-Encoding: gzip\r\n"
+                                          "\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Cache-Control: no-cache");
+            assert( ! memmem(response.data(), response.size(), "Content-Encoding", 16));
+            assert( ! memmem(response.data(), response.size(), "Vary", 4));
+            check_string(response, "\r\n\r\nhtml");
+            response.clear();
+        }
+
+        {
+            static const char request[] = "GET /both.css.gz HTTP/1.1\r\n"
+                                          "\r\n";
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 404 Not Found\r\n");
+            response.clear();
+        }
+
+        mock::destroy_filesystem();
+    }
+
+    // ETag and If-None-Match
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc files[] = {
+            { "app.js",    "function() { }" },
+            { "app.js.gz", "compressed" },
+            { "index.html", "index" }
+        };
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+
+        assert(init_filesystem() == 0);
+
+        // Serve files from flash, so that corrupted data is detected
+        set_file_cache_size(0u);
+
+        configure_webserver(nullptr, 0);
+
+        const auto fentry = find_file("index.html");
+        assert(fentry != nullptr);
+
+        char etag[32];
+        snprintf(etag, sizeof(etag), "\"%08x-%x\"", fentry->checksum, fentry->size);
+
+        char request[256];
+        mock::buffer response;
+
+        {
+            static const char plain_request[] = "GET / HTTP/1.1\r\n\r\n";
+            send_http(plain_request, sizeof(plain_request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            char etag_header[48];
+            snprintf(etag_header, sizeof(etag_header), "ETag: %s\r\n", etag);
+            assert(memmem(response.data(), response.size(), etag_header, strlen(etag_header)));
+            response.clear();
+        }
+
+        const auto send_if_none_match = [&](const char* uri, const char* value) {
+            snprintf(request, sizeof(request),
+                     "GET %s HTTP/1.1\r\n"
+                     "Accept-Encoding: gzip\r\n"
+                     "If-None-Match: %s\r\n"
+                     "\r\n", uri, value);
+            send_http(request, strlen(request), &response);
+        };
+
+        // Corrupt file data to make sure that flash is not touched on 304
+        const auto offset   = fentry->offset;
+        const auto orig_val = mock::modify_filesystem(offset, 'X');
+
+        {
+            send_if_none_match("/", etag);
+
+            check_response(response, "HTTP/1.1 304 Not Modified\r\n");
+            check_string(response, "ETag: \"");
+            assert( ! memmem(response.data(), response.size(), "Vary", 4));
+            assert(response.size() > 4);
+            assert(memcmp(response.end() - 4, "\r\n\r\n", 4) == 0);
+            response.clear();
+        }
+
+        {
+            char list[96];
+            snprintf(list, sizeof(list), "\"abc\", W/%s", etag);
+            send_if_none_match("/index.html", list);
+
+            check_response(response, "HTTP/1.1 304 Not Modified\r\n");
+            response.clear();
+        }
+
+        {
+            send_if_none_match("/index.html", "*");
+
+            check_response(response, "HTTP/1.1 304 Not Modified\r\n");
+            response.clear();
+        }
+
+        // The file has already been verified, let the scrubber find the corruption
+        for (int i = 0; i < 3; i++)
+            scrub_filesystem();
+
+        {
+            // Stale ETag, the corrupted file is not served
+            send_if_none_match("/index.html", "\"00000000-5\"");
+
+            check_response(response, "HTTP/1.1 404 Not Found\r\n");
+            response.clear();
+        }
+
+        mock::modify_filesystem(offset, orig_val);
+
+        {
+            send_if_none_match("/index.html", "\"00000000-5\"");
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "\r\n\r\nindex");
+            response.clear();
+        }
+
+        // ETag of gzip-compressed variant
+        {
+            const auto gz_fentry = find_file("app.js.gz");
+            snprintf(etag, sizeof(etag), "\"%08x-%x\"", gz_fentry->checksum, gz_fentry->size);
+
+            send_if_none_match("/app.js", etag);
+
+            check_response(response, "HTTP/1.1 304 Not Modified\r\n");
+            check_string(response, "Vary: Accept-Encoding\r\n");
+            response.clear();
+
+            // Uncompressed variant does not match
+            snprintf(request, sizeof(request),
+                     "GET /app.js HTTP/1.1\r\n"
+                     "If-None-Match: %s\r\n"
+                     "\r\n", etag);
+            send_http(request, strlen(request), &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "\r\n\r\nfunction() { }");
+            response.clear();
+        }
+
+        mock::destroy_filesystem();
+    }
+
+    // Large files are sent in chunks
+    {
+        mock::clear_flash();
+
+        constexpr size_t big_size = 10000u;
+
+        char* const big_contents = static_cast<char*>(malloc(big_size + 1u));
+        for (size_t i = 0; i < big_size; i++)
+            big_contents[i] = static_cast<char>('a' + i % 26u);
+        big_contents[big_size] = 0;
+
+        const mock::file_desc files[] = {
+            { "big.js", big_contents }
+        };
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+
+        assert(init_filesystem() == 0);
+
+        configure_webserver(nullptr, 0);
+
+        mock::buffer response;
+
+        static const char request[] = "GET /big.js HTTP/1.1\r\n";
+
+        {
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Content-Type: text/javascript\r\n");
+            check_string(response, "Content-Length: 10000\r\n");
+
+            const char* const body = static_cast<const char*>(
+                    memmem(response.data(), response.size(), "\r\n\r\n", 4)) + 4;
+
+            assert(static_cast<size_t>(response.end() - body) == big_size);
+            assert(memcmp(body, big_contents, big_size) == 0);
+            response.clear();
+        }
+
+        // Corruption in the last chunk truncates the response
+        {
+            const auto fentry   = find_file("big.js");
+            const auto offset   = fentry->offset + big_size - 1u;
+            const auto orig_val = mock::modify_filesystem(offset, '#');
+
+            // The file has already been verified, let the scrubber find the corruption
+            for (size_t i = 0; i < big_size / 512u + 1u; i++)
+                scrub_filesystem();
+
+            send_http(request, sizeof(request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Content-Length: 10000\r\n");
+
+            const char* const body = static_cast<const char*>(
+                    memmem(response.data(), response.size(), "\r\n\r\n", 4)) + 4;
+
+            assert(static_cast<size_t>(response.end() - body) < big_size);
+            response.clear();
+
+            mock::modify_filesystem(offset, orig_val);
+        }
+
+        // Corruption in a file which fits in one chunk is reported as not found
+        {
+            static const mock::file_desc small_files[] = {
+                { "small.css", "small" }
+            };
+
+            mock::destroy_filesystem();
+            mock::clear_flash();
+            mock::load_fs_from_memory(small_files, sizeof(small_files) / sizeof(small_files[0]));
+            assert(init_filesystem() == 0);
+
+            configure_webserver(nullptr, 0);
+
+            const auto offset = find_file("small.css")->offset;
+            mock::modify_filesystem(offset, 'S');
+
+            static const char small_request[] = "GET /small.css HTTP/1.1\r\n";
+            send_http(small_request, sizeof(small_request) - 1, &response);
+
+            check_response(response, "HTTP/1.1 404 Not Found\r\n");
+            response.clear();
+        }
+
+        free(big_contents);
+
+        mock::destroy_filesystem();
+    }
+
+    // Small files are served from the file cache
+    {
+        mock::clear_flash();
+
+        static const mock::file_desc files[] = {
+            { "a.css", "aaaa" },
+            { "b.css", "bbbb" },
+            { "c.css", "cccc" }
+        };
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+
+        assert(init_filesystem() == 0);
+
+        configure_webserver(nullptr, 0);
+
+        mock::buffer response;
+
+        const auto get = [&response](const char* uri) -> uint64_t {
+            char request[64];
+            snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\n\r\n", uri);
+
+            const auto num_reads = mock::get_flash_read_count();
+
+            response.clear();
+            send_http(request, strlen(request), &response);
+
+            return mock::get_flash_read_count() - num_reads;
+        };
+
+        assert(get("/a.css") > 0u);
+        check_response(response, "HTTP/1.1 200 OK\r\n");
+        check_string(response, "\r\n\r\naaaa");
+
+        mock::buffer first_response = std::move(response);
+
+        assert(get("/a.css") == 0u);
+        assert(response.size() == first_response.size());
+        assert(memcmp(response.data(), first_response.data(), response.size()) == 0);
+
+        // The cached copy has already been verified
+        {
+            const auto offset   = find_file("a.css")->offset;
+            const auto orig_val = mock::modify_filesystem(offset, 'X');
+
+            assert(get("/a.css") == 0u);
+            check_string(response, "\r\n\r\naaaa");
+
+            mock::modify_filesystem(offset, orig_val);
+        }
+
+        // The least recently used file is evicted when the cache is full
+        {
+            const auto fentry = find_file("b.css");
+
+            // Room for two files, but not for three
+            set_file_cache_size(2u * (fentry->head_size + fentry->size + 32u));
+
+            assert(get("/b.css") > 0u);
+            assert(get("/a.css") == 0u);
+            assert(get("/b.css") == 0u);
+            assert(get("/c.css") > 0u);
+            assert(get("/c.css") == 0u);
+            assert(get("/b.css") == 0u);
+            assert(get("/a.css") > 0u);
+            check_string(response, "\r\n\r\naaaa");
+            assert(get("/c.css") > 0u);
+
+            set_file_cache_size(default_file_cache_size);
+        }
+
+        // Memory is given back when free heap runs low
+        {
+            assert(get("/a.css") == 0u);
+
+            mock::set_free_heap_size(8u * 1024u);
+
+            assert(get("/a.css") > 0u);
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            assert(get("/a.css") > 0u);
+
+            mock::set_free_heap_size(40u * 1024u);
+
+            assert(get("/a.css") > 0u);
+            assert(get("/a.css") == 0u);
+        }
+
+        // The cache is emptied when the filesystem is rewritten
+        {
+            static const mock::file_desc new_files[] = {
+                { "a.css", "AAAA" }
+            };
+
+            mock::fsmaker maker;
+            maker.construct(new_files, sizeof(new_files) / sizeof(new_files[0]));
+
+            assert(write_fs(0u, static_cast<const char*>(maker.get_buffer()), maker.get_size()) == 0);
+
+            assert(get("/a.css") > 0u);
+            check_string(response, "\r\n\r\nAAAA");
+            get("/b.css");
+            check_response(response, "HTTP/1.1 404 Not Found\r\n");
+        }
+
+        mock::destroy_filesystem();
+    }
+
+    // Files in the memory-mapped flash window are sent without reading flash
+    {
+        constexpr size_t big_size = 10001u;
+
+        char* const big_contents = static_cast<char*>(malloc(big_size + 1u));
+        for (size_t i = 0; i < big_size; i++)
+            big_contents[i] = static_cast<char>('a' + i % 26u);
+        big_contents[big_size] = 0;
+
+        const mock::file_desc files[] = {
+            { "big.js", big_contents }
+        };
+
+        mock::buffer response;
+
+        static const char request[] = "GET /big.js HTTP/1.1\r\n";
+
+        const auto get = [&response]() -> uint64_t {
+            const auto num_reads = mock::get_flash_read_count();
+
+            response.clear();
+            send_http(request, sizeof(request) - 1, &response);
+
+            return mock::get_flash_read_count() - num_reads;
+        };
+
+        const auto check_body = [&response, big_contents]() {
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Content-Length: 10001\r\n");
+
+            const char* const body = static_cast<const char*>(
+                    memmem(response.data(), response.size(), "\r\n\r\n", 4)) + 4;
+
+            assert(static_cast<size_t>(response.end() - body) == big_size);
+            assert(memcmp(body, big_contents, big_size) == 0);
+        };
+
+        const auto load = [&files]() {
+            mock::destroy_filesystem();
+            mock::clear_flash();
+            mock::set_flash_map_size(4u * 1024u * 1024u);
+            mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+            assert(init_filesystem() == 0);
+            configure_webserver(nullptr, 0);
+        };
+
+        load();
+
+        // Only the last byte, which does not fill a word, is read from flash,
+        // because the window can only be read with 32-bit loads
+        assert(get() == 1u);
+        check_body();
+
+        // Once verified, the file is sent as is
+        assert(get() == 1u);
+        check_body();
+
+        // Corruption is detected before anything is sent
+        {
+            load();
+
+            const auto offset = find_file("big.js")->offset + big_size / 2u;
+            mock::modify_filesystem(offset, '#');
+
+            assert(get() == 0u);
+            check_response(response, "HTTP/1.1 404 Not Found\r\n");
+        }
+
+        // Corruption in the HTTP response head is detected as well
+        {
+            load();
+
+            const auto fentry = find_file("big.js");
+            mock::modify_filesystem(fentry->offset - fentry->head_size, 'X');
+
+            assert(get() == 0u);
+            check_response(response, "HTTP/1.1 404 Not Found\r\n");
+        }
+
+        // Like on NodeMCU, the filesystem is outside of the 1MB window, so the file
+        // is read from flash
+        {
+            load();
+            mock::set_flash_map_size(1024u * 1024u);
+
+            assert(get() > 0u);
+            check_body();
+        }
+
+        free(big_contents);
+
         mock::destroy_filesystem();
+        mock::clear_flash();
+    }
+
+    // Range requests
+    {
+        mock::clear_flash();
+
+        constexpr size_t big_size = 10001u;
+
+        char* const big_contents = static_cast<char*>(malloc(big_size + 1u));
+        for (size_t i = 0; i < big_size; i++)
+            big_contents[i] = static_cast<char>('a' + i % 26u);
+        big_contents[big_size] = 0;
+
+        const mock::file_desc files[] = {
+            { "big.js", big_contents }
+        };
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+
+        assert(init_filesystem() == 0);
+
+        configure_webserver(nullptr, 0);
+
+        const auto fentry = find_file("big.js");
+        assert(fentry != nullptr);
+
+        char etag[32];
+        snprintf(etag, sizeof(etag), "\"%08x-%x\"", fentry->checksum, fentry->size);
+
+        mock::buffer response;
+
+        const auto get = [&response](const char* headers) -> uint64_t {
+            char request[256];
+            snprintf(request, sizeof(request), "GET /big.js HTTP/1.1\r\n%s\r\n", headers);
+
+            const auto num_reads = mock::get_flash_read_count();
+
+            response.clear();
+            send_http(request, strlen(request), &response);
+
+            return mock::get_flash_read_count() - num_reads;
+        };
+
+        const auto check_body = [&response, big_contents](size_t begin, size_t size) {
+            const char* const body = static_cast<const char*>(
+                    memmem(response.data(), response.size(), "\r\n\r\n", 4)) + 4;
+
+            assert(static_cast<size_t>(response.end() - body) == size);
+            assert(memcmp(body, big_contents + begin, size) == 0);
+        };
+
+        // The file has not been verified yet, so the first range request verifies
+        // the entire file
+        assert(get("Range: bytes=0-99\r\n") > 2u);
+        check_response(response, "HTTP/1.1 206 Partial Content\r\n");
+        check_string(response, "Content-Type: text/javascript\r\n");
+        check_string(response, "Content-Length: 100\r\n");
+        check_string(response, "Content-Range: bytes 0-99/10001\r\n");
+        assert( ! memmem(response.data(), response.size(), "Content-Length: 10001", 21u));
+        check_body(0u, 100u);
+
+        // Only the stored head and the requested part are read
+        assert(get("Range: bytes=5000-5099\r\n") == 2u);
+        check_response(response, "HTTP/1.1 206 Partial Content\r\n");
+        check_string(response, "Content-Range: bytes 5000-5099/10001\r\n");
+        check_body(5000u, 100u);
+
+        // Open-ended range
+        get("Range: bytes=7000-\r\n");
+        check_response(response, "HTTP/1.1 206 Partial Content\r\n");
+        check_string(response, "Content-Length: 3001\r\n");
+        check_string(response, "Content-Range: bytes 7000-10000/10001\r\n");
+        check_body(7000u, 3001u);
+
+        // Last bytes of the file
+        get("Range: bytes=-3\r\n");
+        check_response(response, "HTTP/1.1 206 Partial Content\r\n");
+        check_string(response, "Content-Range: bytes 9998-10000/10001\r\n");
+        check_body(9998u, 3u);
+
+        // Last byte position past the end of file
+        get("Range: bytes=10000-20000\r\n");
+        check_response(response, "HTTP/1.1 206 Partial Content\r\n");
+        check_string(response, "Content-Range: bytes 10000-10000/10001\r\n");
+        check_body(10000u, 1u);
+
+        // Range which begins past the end of file
+        get("Range: bytes=10001-\r\n");
+        check_response(response, "HTTP/1.1 416 Range Not Satisfiable\r\n");
+
+        // Unsupported or invalid ranges are ignored
+        static const char* const ignored[] = {
+            "Range: bytes=0-1,5-6\r\n",
+            "Range: bytes=10-9\r\n",
+            "Range: bytes=-\r\n",
+            "Range: bytes=abc\r\n",
+            "Range: lines=1-2\r\n"
+        };
+        for (const char* headers : ignored) {
+            get(headers);
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_body(0u, big_size);
+        }
+
+        // If-Range with the current ETag
+        {
+            char headers[128];
+            snprintf(headers, sizeof(headers), "Range: bytes=10-19\r\nIf-Range: %s\r\n", etag);
+            get(headers);
+            check_response(response, "HTTP/1.1 206 Partial Content\r\n");
+            check_body(10u, 10u);
+        }
+
+        // If-Range with an old ETag
+        get("Range: bytes=10-19\r\nIf-Range: \"12345678-10\"\r\n");
+        check_response(response, "HTTP/1.1 200 OK\r\n");
+        check_body(0u, big_size);
+
+        // Corrupted file which has not been verified yet
+        {
+            mock::reboot();
+            assert(init_filesystem() == 0);
+            configure_webserver(nullptr, 0);
+
+            const auto orig_val = mock::modify_filesystem(find_file("big.js")->offset + 9000u, '#');
+
+            get("Range: bytes=0-99\r\n");
+            check_response(response, "HTTP/1.1 404 Not Found\r\n");
+
+            mock::modify_filesystem(find_file("big.js")->offset + 9000u, orig_val);
+        }
+
+        // Files in the memory-mapped flash window are not read with spi_flash_read
+        {
+            mock::reboot();
+            mock::set_flash_map_size(4u * 1024u * 1024u);
+            assert(init_filesystem() == 0);
+            configure_webserver(nullptr, 0);
+
+            assert(get("Range: bytes=5000-5099\r\n") == 1u);
+            check_response(response, "HTTP/1.1 206 Partial Content\r\n");
+            check_body(5000u, 100u);
+
+            // Unaligned parts at both ends of the range are read from flash
+            assert(get("Range: bytes=5001-5102\r\n") == 3u);
+            check_response(response, "HTTP/1.1 206 Partial Content\r\n");
+            check_body(5001u, 102u);
+
+            get("Range: bytes=-3\r\n");
+            check_response(response, "HTTP/1.1 206 Partial Content\r\n");
+            check_body(9998u, 3u);
+        }
+
+        free(big_contents);
+
+        mock::destroy_filesystem();
+        mock::clear_flash();
+    }
+
+    // Dynamic content is inserted into files at the splice marker
+    {
+        mock::clear_flash();
+
+        // The marker is past the first chunk and not aligned, it is padded with spaces
+        constexpr size_t before_size = 3001u;
+        constexpr size_t after_size  = 3000u;
+        static const char marker[]   = "<!--#bootstrap-->";
+
+        char* const html = static_cast<char*>(malloc(before_size + sizeof(marker) + after_size));
+        memset(html, 'b', before_size);
+        memcpy(html + before_size, marker, sizeof(marker) - 1u);
+        memset(html + before_size + sizeof(marker) - 1u, 'a', after_size);
+        html[before_size + sizeof(marker) - 1u + after_size] = 0;
+
+        const mock::file_desc files[] = {
+            { "index.html", html }
+        };
+
+        mock::load_fs_from_memory(files, sizeof(files) / sizeof(files[0]));
+
+        assert(init_filesystem() == 0);
+
+        const auto fentry = find_file("index.html");
+        assert(fentry != nullptr);
+        assert(fentry->splice == before_size + 3u);
+        assert(fentry->size == before_size + 3u + after_size);
+
+        const unsigned file_size = fentry->size;
+
+        static const char dynamic[] = "<script>var bootstrap={}</script>";
+        static int        num_calls = 0;
+
+        const splice_handler splice = [](char* buf, int buf_size) -> int {
+            ++num_calls;
+            assert(buf_size >= static_cast<int>(sizeof(dynamic)));
+            memcpy(buf, dynamic, sizeof(dynamic) - 1u);
+            return sizeof(dynamic) - 1u;
+        };
+
+        mock::buffer response;
+
+        const auto get = [&](const char* headers) {
+            char request[128];
+            snprintf(request, sizeof(request), "GET / HTTP/1.1\r\n%s\r\n", headers);
+            send_http(request, strlen(request), &response);
+        };
+
+        const auto check_body = [&](bool with_dynamic) {
+            const char* const body = static_cast<const char*>(
+                    memmem(response.data(), response.size(), "\r\n\r\n", 4)) + 4;
+            const size_t dynamic_size = with_dynamic ? sizeof(dynamic) - 1u : 0u;
+
+            assert(static_cast<size_t>(response.end() - body) == before_size + 3u + dynamic_size + after_size);
+
+            for (size_t i = 0; i < before_size; i++)
+                assert(body[i] == 'b');
+            assert(memcmp(body + before_size, "   ", 3u) == 0);
+            assert(memcmp(body + before_size + 3u, dynamic, dynamic_size) == 0);
+            for (size_t i = 0; i < after_size; i++)
+                assert(body[before_size + 3u + dynamic_size + i] == 'a');
+        };
+
+        char content_length[32];
+
+        // Without a handler, the file is served as it is stored
+        {
+            configure_webserver(nullptr, 0);
+
+            get("");
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            snprintf(content_length, sizeof(content_length), "Content-Length: %u\r\n", file_size);
+            assert(memmem(response.data(), response.size(), content_length, strlen(content_length)));
+            check_body(false);
+            response.clear();
+        }
+
+        mock::reboot();
+        assert(init_filesystem() == 0);
+        configure_webserver(nullptr, 0, splice);
+
+        snprintf(content_length, sizeof(content_length), "Content-Length: %u\r\n",
+                 file_size + static_cast<unsigned>(sizeof(dynamic) - 1u));
+
+        // The content is generated on every request, the file is not cacheable
+        for (int i = 1; i <= 2; i++) {
+            get("");
+            assert(num_calls == i);
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Content-Type: text/html\r\n");
+            check_string(response, "Cache-Control: no-store");
+            assert(memmem(response.data(), response.size(), content_length, strlen(content_length)));
+            assert( ! memmem(response.data(), response.size(), "ETag", 4));
+            check_body(true);
+            response.clear();
+        }
+
+        // Range requests are not supported, the entire file is sent
+        {
+            get("Range: bytes=0-99\r\n");
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_body(true);
+            response.clear();
+        }
+
+        // Files in the memory-mapped flash window are spliced too
+        {
+            mock::reboot();
+            mock::set_flash_map_size(4u * 1024u * 1024u);
+            assert(init_filesystem() == 0);
+            configure_webserver(nullptr, 0, splice);
+
+            get("");
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_body(true);
+            response.clear();
+
+            mock::set_flash_map_size(1024u * 1024u);
+        }
+
+        // Content which does not fit is left out, the page requests the data separately
+        {
+            mock::reboot();
+            assert(init_filesystem() == 0);
+            configure_webserver(nullptr, 0, [](char*, int) -> int { return -1; });
+
+            get("");
+            check_response(response, "HTTP/1.1 200 OK\r\n");
+            check_string(response, "Cache-Control: no-store");
+            snprintf(content_length, sizeof(content_length), "Content-Length: %u\r\n", file_size);
+            assert(memmem(response.data(), response.size(), content_length, strlen(content_length)));
+            check_body(false);
+            response.clear();
+        }
+
+        free(html);
+
+        mock::destroy_filesystem();
+        mock::clear_flash();
     }
 
     return 0;
@@ -1,14 +1,52 @@
 #!/usr/bin/env python
 
+import base64
+import gzip
+import hashlib
+import io
 import os
+import re
 import sys
 import struct
 
-if len(sys.argv) != 3:
-    print("Usage: mkfs.py <source_dir> <dest_fs_file>")
+args = [arg for arg in sys.argv[1:] if not arg.startswith("--")]
+opts = [arg for arg in sys.argv[1:] if arg.startswith("--")]
+
+# Alignment of file data, must be a power of two and at least 4
+align = 4
+for opt in opts:
+    if opt.startswith("--align=") and opt[8:].isdigit():
+        align = int(opt[8:])
+
+flags = ("--no-gzip", "--gzip-only", "--minify", "--bundle", "--hash-names")
+
+if (len(args) != 2 or align < 4 or (align & (align - 1)) or
+    any(opt not in flags and not opt.startswith("--align=") for opt in opts)):
+    print("Usage: mkfs.py [--no-gzip] [--gzip-only] [--minify] [--bundle] [--hash-names] [--align=<n>]")
+    print("               <source_dir> <dest_fs_file>")
+    print("")
+    print("  --no-gzip    Don't store gzip-compressed variants of files")
+    print("  --gzip-only  Don't store uncompressed files if they have gzip-compressed variants")
+    print("  --minify     Remove comments and redundant whitespace from HTML, JS and CSS files")
+    print("  --bundle     Inline scripts and stylesheets into HTML files which refer to them and")
+    print("               embed icons as data URIs, so a page loads with a single request.")
+    print("               Inlined files are not stored separately.  Implies --minify.")
+    print("               Does not apply to HTML files with the splice marker, e.g. index.html,")
+    print("               which are not compressed or cached, so the files they refer to are")
+    print("               kept separate, compressed and cacheable")
+    print("  --hash-names Add hash of contents to names of files referenced from HTML files and")
+    print("               stylesheets and rewrite the references.  Such files never change, so")
+    print("               browsers are allowed to cache them indefinitely")
+    print("  --align=<n>  Align file data to n bytes, a power of two, default is 4.  When the")
+    print("               filesystem is in the memory-mapped flash window, files are sent")
+    print("               directly from flash, use e.g. 32 to align them to flash cache lines")
     sys.exit(1)
 
-dir = sys.argv[1]
+bundle      = "--bundle" in opts
+minify      = "--minify" in opts or bundle
+hash_names  = "--hash-names" in opts
+
+dir = args[0]
 if not os.path.isdir(dir):
     print("Error: '" + dir + "' is not a directory");
     sys.exit(1)
@@ -21,21 +59,108 @@ def Checksum(data):
         checksum = (checksum - value) & 0xFFFFFFFF
     return checksum
 
-class Entry:
+def Gzip(data):
+    buf = io.BytesIO()
+    # Zero mtime and no file name, so that the image is reproducible
+    with gzip.GzipFile(filename="", mode="wb", compresslevel=9, fileobj=buf, mtime=0) as f:
+        f.write(data)
+    return buf.getvalue()
 
-    def __init__(self, filename):
-        path = os.path.join(dir, filename)
+# Must match max_file_head_size in filesystem.h
+max_head_size = 256
 
-        if not os.path.isfile(path):
-            print("Error: '" + path + "' is not a file")
-            sys.exit(1)
+# Must match max_filename_size in filesystem.h, minus terminating null
+max_filename_len = 63
+
+# Must match max_files in filesystem.h
+max_files = 512
+
+mime_types = {
+    "html": "text/html",
+    "css":  "text/css",
+    "js":   "text/javascript",
+    "ico":  "image/x-icon",
+    "svg":  "image/svg+xml"
+}
+
+# Marks the point in HTML files at which the server inserts dynamic content,
+# e.g. initial state of the page.  Must match the splice marker in tests/mock.cpp
+splice_marker = b"<!--#bootstrap-->"
+
+# Removes the splice marker from file data.  The data before the marker is padded
+# with spaces, so that the offset of the marker, at which the server inserts
+# dynamic content, is a non-zero multiple of 4 bytes.
+#
+# Returns the data and offset of the marker, or 0 if there is no marker.
+def Splice(filename, contents):
+    pos = contents.find(splice_marker)
+    if not filename.endswith(".html") or pos < 0:
+        return contents, 0
+
+    if contents.find(splice_marker, pos + 1) >= 0:
+        print("Warning: '" + filename + "' contains more than one splice marker, " +
+              "only the first one is used")
+
+    pad = (-pos & 3) if pos else 4
+    return contents[:pos] + b' ' * pad + contents[pos + len(splice_marker):], pos + pad
+
+# Files with hashed names change their names whenever their contents change,
+# so browsers can cache them for a year without revalidation, while other files,
+# including HTML files which refer to them, are revalidated on every load.
+# Files with dynamic content are never cached, they have no ETag and cannot be
+# requested in parts.  The server adjusts their Content-Length.
+def MakeHead(filename, size, checksum, gzip, vary, immutable, dynamic):
+    ext = filename.rsplit(".", 1)[-1] if "." in filename else ""
+    if ext not in mime_types:
+        print("Warning: Unknown MIME type for '" + filename + "', the file will not be served")
+        return b''
+
+    headers = [ "HTTP/1.1 200 OK",
+                "Content-Type: " + mime_types[ext],
+                "Content-Length: " + str(size) ]
+    if dynamic:
+        headers.append("Cache-Control: no-store")
+    else:
+        headers += [ "Cache-Control: " + ("max-age=31536000, immutable" if immutable else "no-cache"),
+                     # Must match FILE_ETAG_FORMAT in webserver.cpp
+                     "ETag: \"%08x-%x\"" % (checksum, size),
+                     "Accept-Ranges: bytes" ]
+    if gzip:
+        headers.append("Content-Encoding: gzip")
+    if vary:
+        headers.append("Vary: Accept-Encoding")
+
+    # Pad the last header with trailing whitespace, which is allowed by HTTP,
+    # so that the head is a multiple of 4 bytes and file data which follows it
+    # is aligned
+    head = "\r\n".join(headers)
+    head += " " * ((-len(head) - 4) & 3) + "\r\n\r\n"
+
+    if len(head) > max_head_size:
+        print("Error: HTTP response head for '" + filename + "' is too long")
+        sys.exit(1)
+
+    return head.encode()
 
-        if len(filename) > 16:
-            print("Error: Filename '" + filename + "' is too long (must be max 16 chars)")
+class Entry:
+
+    # - filename - name of the file in the filesystem
+    # - contents - file data
+    # - name     - name which determines MIME type
+    # - gzip     - whether the data is gzip-compressed
+    # - vary      - whether the file has another variant with different encoding
+    # - immutable - whether the file has hashed name
+    # - splice    - offset in file data at which the server inserts dynamic content, or 0
+    def __init__(self, filename, contents, name, gzip, vary, immutable, splice = 0):
+        if len(filename.encode()) > max_filename_len:
+            print("Error: Filename '" + filename + "' is too long (must be max " +
+                  str(max_filename_len) + " chars)")
             sys.exit(1)
 
-        with open(path, "rb") as f:
-            contents = f.read()
+        # The server converts URIs to lowercase
+        if filename != filename.lower():
+            print("Warning: Filename '" + filename + "' contains uppercase characters, " +
+                  "the file will not be served")
 
         size = len(contents)
 
@@ -43,26 +168,363 @@ class Entry:
         if size & 3:
             contents += b'\0' * (4 - (size & 3))
 
-        self.filename = filename
-        self.size     = size
-        self.checksum = Checksum(contents)
-        self.contents = contents
+        self.filename      = filename
+        self.size          = size
+        self.checksum      = Checksum(contents)
+        self.head          = MakeHead(name, size, self.checksum, gzip, vary, immutable, splice != 0)
+        self.head_checksum = Checksum(self.head)
+        self.contents      = contents
+        self.splice        = splice
 
-files = list(map(Entry, os.listdir(dir)))
+def ReadFile(filename):
+    path = os.path.join(dir, filename)
 
-# 28 is size of file_entry structure in bytes, 12 is the fs header size
-fs_dir_size = len(files) * 28 + 12
+    if not os.path.isfile(path):
+        print("Error: '" + path + "' is not a file")
+        sys.exit(1)
 
-data   = bytes()
-fs_hdr = struct.pack("<I", len(files))
+    with open(path, "rb") as f:
+        return f.read()
+
+# Splits JS or CSS source into tokens: strings, comments, whitespace and other code.
+# Regular expression literals in JS are recognized by the preceding character.
+def Tokenize(text, js):
+    i = 0
+    n = len(text)
+    tokens = []
+    while i < n:
+        c = text[i]
+        if c in "\"'`" if js else c in "\"'":
+            j = i + 1
+            while j < n and text[j] != c:
+                j += 2 if text[j] == "\\" else 1
+            tokens.append(("str", text[i : j + 1]))
+            i = j + 1
+        elif text.startswith("/*", i):
+            j = text.find("*/", i + 2)
+            i = n if j < 0 else j + 2
+            tokens.append(("space", " "))
+        elif js and text.startswith("//", i):
+            j = text.find("\n", i)
+            i = n if j < 0 else j
+        elif c.isspace():
+            j = i
+            while j < n and text[j].isspace():
+                j += 1
+            tokens.append(("space", "\n" if "\n" in text[i:j] else " "))
+            i = j
+        elif js and c == "/" and (not tokens or Last(tokens) in "(,=:[!&|?{};+-*%<>~^"):
+            j = i + 1
+            in_class = False
+            while j < n and (text[j] != "/" or in_class) and text[j] != "\n":
+                if text[j] == "\\":
+                    j += 1
+                elif text[j] in "[]":
+                    in_class = text[j] == "["
+                j += 1
+            tokens.append(("str", text[i : j + 1]))
+            i = j + 1
+        else:
+            tokens.append(("code", c))
+            i += 1
+    return tokens
+
+# Returns the last character of code before the last token, skipping whitespace
+def Last(tokens):
+    for kind, value in reversed(tokens):
+        if kind != "space":
+            return value[-1]
+    return ""
+
+# Removes comments and whitespace which is not needed.  Line breaks in JS are kept
+# where they could terminate a statement, because of automatic semicolon insertion.
+def MinifyCode(text, js):
+    tokens = Tokenize(text, js)
+    out = []
+    for idx, (kind, value) in enumerate(tokens):
+        if kind != "space":
+            out.append(value)
+            continue
+        prev = out[-1][-1] if out else ""
+        next = ""
+        for kind2, value2 in tokens[idx + 1:]:
+            if kind2 != "space":
+                next = value2[0]
+                break
+        if not prev or not next:
+            continue
+        if js:
+            if value == "\n" and prev not in "{;,(" and next not in ")]}":
+                out.append("\n")
+            elif prev not in "{}()[];,:=?&|" and next not in "{}()[];,:=?&|":
+                out.append(" ")
+        else:
+            if prev not in "{};,>" and next not in "{};,>" and prev != ":":
+                out.append(" ")
+    text = "".join(out)
+    if not js:
+        text = text.replace(";}", "}")
+    return text.strip()
+
+def MinifyHtml(text):
+    # Whitespace is significant in these elements, they are left as they are
+    parts = re.split(r"(?is)(<(pre|textarea|script|style)\b.*?</\2\s*>)", text)
+    out = []
+    for i in range(0, len(parts), 3):
+        # Conditional comments and the splice marker are kept
+        part = re.sub(r"(?s)<!--(?![\[#]).*?-->", "", parts[i])
+        # Any run of whitespace is equivalent to a single space or line break
+        part = re.sub(r"[ \t\r]*\n\s*", "\n", part)
+        part = re.sub(r"[ \t]+", " ", part)
+        out.append(part)
+        if i + 1 < len(parts):
+            out.append(parts[i + 1])
+    return "".join(out).strip() + "\n"
+
+def Minify(filename, contents):
+    ext = filename.rsplit(".", 1)[-1]
+    if ext in ("js", "css"):
+        return MinifyCode(contents.decode(), ext == "js").encode()
+    if ext == "html":
+        return MinifyHtml(contents.decode()).encode()
+    return contents
+
+# Files which have been inlined into HTML files
+inlined = set()
+
+# Returns path of a local file referenced from 'filename', or None if the
+# reference is not a plain relative path to a file in the filesystem
+def ResolveRef(filename, ref, files):
+    if re.match(r"^([a-z][a-z0-9+.-]*:|/|#)", ref, re.I) or "?" in ref or "#" in ref:
+        return None
+    path = os.path.normpath(os.path.join(os.path.dirname(filename), ref)).replace(os.sep, "/")
+    return path if path in files else None
+
+def Attrs(tag):
+    return dict((m.group(1).lower(), m.group(2)) for m in
+                re.finditer(r"([\w-]+)\s*=\s*\"([^\"]*)\"", tag))
+
+# Files referenced from HTML files which are not bundled
+referenced = set()
+
+# Inlines files referenced from 'html' of 'filename'.
+#
+# Bundling does not apply to files with the splice marker, e.g. index.html.
+# Files with dynamic content are neither compressed nor cached, so they are
+# kept small and the files they refer to are served separately, compressed
+# and cacheable.  Bundling them would make every page load transfer all of
+# the scripts and stylesheets uncompressed.
+def Bundle(filename, html, files):
+    if splice_marker.decode() in html:
+        for m in FindRefs(filename, html):
+            path = ResolveRef(filename, m.group(1), files)
+            if path:
+                referenced.add(path)
+        return html
+
+    def InlineScript(m):
+        attrs = Attrs(m.group(1))
+        path  = ResolveRef(filename, attrs.get("src", ""), files)
+        # Deferred and module scripts would run at a different time if inlined
+        if (not path or not path.endswith(".js") or
+            any(a in attrs for a in ("async", "defer")) or
+            re.search(r"\b(async|defer)\b", m.group(1)) or
+            attrs.get("type", "text/javascript") not in ("text/javascript", "application/javascript")):
+            return m.group(0)
+        inlined.add(path)
+        code = MinifyCode(ReadFile(path).decode(), True)
+        return "<script>" + code.replace("</", "<\\/") + "</script>"
+
+    def InlineLink(m):
+        attrs = Attrs(m.group(0))
+        rel   = attrs.get("rel", "").lower().split()
+        path  = ResolveRef(filename, attrs.get("href", ""), files)
+        if not path:
+            return m.group(0)
+        contents = ReadFile(path)
+        if "stylesheet" in rel and path.endswith(".css"):
+            # Relative URLs in the stylesheet would resolve differently
+            if "url(" in contents.decode() and os.path.dirname(path) != os.path.dirname(filename):
+                return m.group(0)
+            inlined.add(path)
+            media = ' media="' + attrs["media"] + '"' if "media" in attrs else ""
+            return "<style" + media + ">" + MinifyCode(contents.decode(), False) + "</style>"
+        if "icon" in rel:
+            ext = path.rsplit(".", 1)[-1]
+            if ext not in mime_types:
+                return m.group(0)
+            inlined.add(path)
+            uri = "data:" + mime_types[ext] + ";base64," + base64.b64encode(contents).decode()
+            return m.group(0).replace('"' + attrs["href"] + '"', '"' + uri + '"', 1)
+        return m.group(0)
+
+    html = re.sub(r"(?is)<script\b([^>]*)>\s*</script\s*>", InlineScript, html)
+    html = re.sub(r"(?is)<link\b[^>]*>", InlineLink, html)
+    return html
 
+# Files which have been renamed to include a hash of their contents
+hashed = set()
+
+def HashName(filename, contents):
+    digest = hashlib.sha256(contents).hexdigest()[:10]
+    base   = filename.rsplit("/", 1)[-1]
+    if "." in base:
+        stem, ext = filename.rsplit(".", 1)
+        return stem + "." + digest + "." + ext
+    return filename + "." + digest
+
+# References to other files, in HTML attributes and in url() in stylesheets
+ref_patterns = {
+    "html": r'(?i)\b(?:src|href)\s*=\s*"([^"]*)"',
+    "css":  r'(?i)\burl\(\s*["\']?([^"\')]*)["\']?\s*\)'
+}
+
+def FindRefs(filename, text):
+    ext = filename.rsplit(".", 1)[-1]
+    if ext not in ref_patterns:
+        return []
+    return [m for m in re.finditer(ref_patterns[ext], text)]
+
+# Rewrites references in 'text' of 'filename' to files which have been renamed
+def RewriteRefs(filename, text, renames):
+    out = []
+    pos = 0
+    for m in FindRefs(filename, text):
+        path = ResolveRef(filename, m.group(1), sources)
+        if path in renames:
+            ref  = m.group(1)
+            base = path.rsplit("/", 1)[-1]
+            out.append(text[pos : m.start(1)])
+            out.append(ref[: len(ref) - len(base)] + renames[path].rsplit("/", 1)[-1])
+            pos = m.end(1)
+    out.append(text[pos:])
+    return "".join(out)
+
+def HashNames(filenames):
+    referenced = set()
+    for filename in filenames:
+        for m in FindRefs(filename, sources[filename].decode(errors="replace")):
+            path = ResolveRef(filename, m.group(1), sources)
+            if path and not path.endswith(".html"):
+                # Stylesheets imported by other stylesheets keep their names, so that
+                # stylesheets can be renamed after the files they refer to
+                if not (filename.endswith(".css") and path.endswith(".css")):
+                    referenced.add(path)
+
+    renames = { }
+
+    for filename in sorted(referenced, key=lambda f: (f.endswith(".css"), f)):
+        if filename.endswith(".css"):
+            sources[filename] = RewriteRefs(filename, sources[filename].decode(), renames).encode()
+        renames[filename] = HashName(filename, sources[filename])
+
+    for filename in filenames:
+        if filename.endswith(".html"):
+            sources[filename] = RewriteRefs(filename, sources[filename].decode(), renames).encode()
+
+    for filename, new_name in renames.items():
+        sources[new_name] = sources.pop(filename)
+        hashed.add(new_name)
+
+    return sorted(renames.get(filename, filename) for filename in filenames)
+
+def LoadFiles(filename, contents):
+    # Dynamic content cannot be inserted into compressed data, so files with
+    # the splice marker are only stored uncompressed
+    contents, splice = Splice(filename, contents)
+    if splice:
+        return [Entry(filename, contents, filename, False, False, False, splice)]
+
+    # The server serves the gzip-compressed variant, stored with .gz extension,
+    # to clients which accept gzip content encoding.
+    compressed = None
+    if "--no-gzip" not in opts:
+        compressed = Gzip(contents)
+        if len(compressed) >= len(contents):
+            compressed = None
+
+    immutable = filename in hashed
+
+    entries = []
+    if compressed:
+        entries.append(Entry(filename + ".gz", compressed, filename, True, True, immutable))
+
+    if not compressed or "--gzip-only" not in opts:
+        entries.append(Entry(filename, contents, filename, False, compressed is not None, immutable))
+
+    return entries
+
+# File names are paths relative to the source directory, with directories
+# separated by '/'
+def ListFiles():
+    for root, dirs, names in os.walk(dir):
+        dirs.sort()
+        for name in sorted(names):
+            yield os.path.relpath(os.path.join(root, name), dir).replace(os.sep, "/")
+
+filenames = list(ListFiles())
+sources   = dict((filename, ReadFile(filename)) for filename in filenames)
+
+if bundle:
+    for filename in filenames:
+        if filename.endswith(".html"):
+            sources[filename] = Bundle(filename, sources[filename].decode(), sources).encode()
+
+    filenames = [filename for filename in filenames
+                 if filename not in inlined or filename in referenced]
+
+if minify:
+    for filename in filenames:
+        sources[filename] = Minify(filename, sources[filename])
+
+if hash_names:
+    filenames = HashNames(filenames)
+
+files = [entry for filename in filenames for entry in LoadFiles(filename, sources[filename])]
+
+if len(files) > max_files:
+    print("Error: Too many files (must be max " + str(max_files) + ")")
+    sys.exit(1)
+
+# The directory must be sorted by file name, which ensures that file names are unique
+files.sort(key=lambda entry: entry.filename.encode())
+
+# The directory consists of 16-byte header, 28-byte file entries and null-terminated
+# file names, padded to a multiple of 4 bytes
+names = bytes()
+name_offsets = []
 for file in files:
-    offset = len(data) + fs_dir_size
-    data += file.contents
+    name_offsets.append(16 + len(files) * 28 + len(names))
+    names += file.filename.encode() + b'\0'
+names += b'\0' * (-len(names) & 3)
+
+fs_dir_size = 16 + len(files) * 28 + len(names)
+
+data   = bytes()
+fs_hdr = struct.pack("<II", len(files), fs_dir_size)
+
+# Offsets of data already stored, files with identical HTTP response head and
+# contents are stored only once and share the data
+stored = { }
+
+# HTTP response head of each file is stored right before file data
+for file, name_offset in zip(files, name_offsets):
+    key = (file.head, file.contents, file.splice)
+    if key in stored:
+        offset = stored[key]
+    else:
+        data  += b'\0' * ((-(len(data) + fs_dir_size + len(file.head))) & (align - 1))
+        data  += file.head
+        offset = len(data) + fs_dir_size
+        data  += file.contents
+        stored[key] = offset
+
+    fs_hdr += struct.pack("<IIIIIII", name_offset, file.size, file.checksum, offset,
+                          len(file.head), file.head_checksum, file.splice)
 
-    fs_hdr += struct.pack("<16sIII", file.filename.encode(), file.size, file.checksum, offset)
+fs_hdr += names
 
-with open(sys.argv[2], "wb+") as f:
-    f.write(struct.pack("<II", 0xC0DEA55A, Checksum(fs_hdr)))
+with open(args[1], "wb+") as f:
+    f.write(struct.pack("<II", 0xC0DEA55E, Checksum(fs_hdr)))
     f.write(fs_hdr)
     f.write(data)
@@ -0,0 +1,95 @@
+#!/usr/bin/env python
+
+import json
+import sys
+
+try:
+    from urllib.request import Request, urlopen
+    from urllib.error import HTTPError
+except ImportError:
+    from urllib2 import Request, urlopen, HTTPError
+
+if len(sys.argv) != 3:
+    print("Usage: upload_fs.py <host> <fs_file>")
+    print("")
+    print("Uploads only the sectors of the filesystem image which differ from")
+    print("what is already stored in flash.  Falls back to uploading the entire")
+    print("image if the device does not support differential update.")
+    sys.exit(1)
+
+host = sys.argv[1]
+
+with open(sys.argv[2], "rb") as f:
+    image = f.read()
+
+# Must match SPI_FLASH_SEC_SIZE
+sector_size = 4096
+
+def Post(query, data):
+    url = "http://" + host + "/upload_fs" + ("?" + query if query else "")
+    req = Request(url, data=data, headers={ "Content-Type": "application/octet-stream" })
+    urlopen(req).read()
+
+# Must match get_fs_sector_hash() in filesystem.cpp, 32-bit FNV-1a
+def Hash(data):
+    value = 2166136261
+    for byte in bytearray(data):
+        value = ((value ^ byte) * 16777619) & 0xFFFFFFFF
+    return "%08x" % value
+
+try:
+    hashes = json.loads(urlopen("http://" + host + "/fs_sectors").read().decode())
+except Exception as e:
+    print("Differential update not available (" + str(e) + "), uploading entire image")
+    Post(None, image)
+    sys.exit(0)
+
+# In flash, the image is padded with zeroes to a multiple of 4 bytes and the rest
+# of the last sector is erased
+padded = image + b'\0' * (-len(image) & 3)
+padded += b'\xFF' * (-len(padded) & (sector_size - 1))
+
+num_sectors = len(padded) // sector_size
+if num_sectors > len(hashes["upload"]):
+    print("Error: filesystem image is too large")
+    sys.exit(1)
+
+upload = []
+copy   = 0
+
+for i in range(num_sectors):
+    sector = padded[i * sector_size : (i + 1) * sector_size]
+    value  = Hash(sector)
+
+    # Sector is already in the slot which is being written
+    if value == hashes["upload"][i]:
+        continue
+
+    # Sector will be copied from the active filesystem
+    if value == hashes["active"][i]:
+        copy |= 1 << i
+        continue
+
+    upload.append(i)
+
+print("Uploading %u of %u sectors, copying %u" % (len(upload), num_sectors, bin(copy).count("1")))
+
+# The device erases the sectors which will be uploaded while they are being sent,
+# older firmware only accepts plain "begin"
+try:
+    Post("begin=%x" % sum(1 << i for i in upload), b'')
+except HTTPError:
+    Post("begin", b'')
+
+# Consecutive sectors are sent in one request
+i = 0
+while i < len(upload):
+    first = upload[i]
+    while i + 1 < len(upload) and upload[i + 1] == upload[i] + 1:
+        i += 1
+    end = upload[i] + 1
+    i += 1
+
+    Post("offset=%x" % (first * sector_size), image[first * sector_size : end * sector_size])
+
+Post("commit=%x" % copy, b'')
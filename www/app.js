@@ -135,6 +135,13 @@ function Send(method, url, contents, type, Sent, retryCount)
     request.send(contents);
 }
 
+// Returns a part of the initial state which the device inserts into index.html,
+// see bootstrap() in main.cpp, or null if the page has been loaded from elsewhere.
+function Bootstrap(name)
+{
+    return (typeof bootstrap === "object" && bootstrap !== null && bootstrap[name]) || null;
+}
+
 function OnPageLoad()
 {
     E("quickbar").addButton("togauto", "Start Full Cycle", ToggleAuto);
@@ -145,13 +152,16 @@ function OnPageLoad()
         const b = z.addButton("togz" + iz, "Start");
     }
 
+    const bootstrap_zones = Bootstrap("zones");
+    if (bootstrap_zones) {
+        enzones = bootstrap_zones.map(function(z) { return z.order ? 1 : 0; });
+    }
+
     SetZone();
 
     const table = E("sysinfo").insert("table");
 
-    Send("GET", "/sysinfo", null, null, function(request) {
-        if (request.status !== 200) return;
-        const r = eval("(" + request.responseText + ")");
+    const ShowSysinfo = function(r) {
         const Add = function(name, value) {
             const row = table.insert("tr");
             row.insert("td", name);
@@ -169,7 +179,18 @@ function OnPageLoad()
         }
         Add("SDK Version", r.sdk);
         Add("Heap Free [B]", r.heap_free);
-    });
+    };
+
+    const sysinfo = Bootstrap("sysinfo");
+    if (sysinfo) {
+        ShowSysinfo(sysinfo);
+    }
+    else {
+        Send("GET", "/sysinfo", null, null, function(request) {
+            if (request.status !== 200) return;
+            ShowSysinfo(eval("(" + request.responseText + ")"));
+        });
+    }
 }
 
 /*